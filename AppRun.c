@@ -30,6 +30,7 @@ THE SOFTWARE.
 #include <unistd.h>
 #include <libgen.h>
 #include <dirent.h>
+#include <glob.h>
 #include <string.h>
 
 #define die(...)                                \
@@ -142,7 +143,22 @@ int main(int argc, char *argv[])
     old_env = getenv("QT_PLUGIN_PATH") ?: "";
     snprintf(new_env7, length, "QT_PLUGIN_PATH=%s/usr/lib/qt4/plugins/:%s/usr/lib/i386-linux-gnu/qt4/plugins/:%s/usr/lib/x86_64-linux-gnu/qt4/plugins/:%s/usr/lib32/qt4/plugins/:%s/usr/lib64/qt4/plugins/:%s/usr/lib/qt5/plugins/:%s/usr/lib/i386-linux-gnu/qt5/plugins/:%s/usr/lib/x86_64-linux-gnu/qt5/plugins/:%s/usr/lib32/qt5/plugins/:%s/usr/lib64/qt5/plugins/:%s", appdir, appdir, appdir, appdir, appdir, appdir, appdir, appdir, appdir, appdir, old_env);
     putenv(new_env7);
-    
+
+    /* Written by appimagetool --caches with module paths relative to usr/, the working directory,
+     * into usr/lib{,32,64}[/<triplet>]/gdk-pixbuf-2.0/<version>/ like it looks for the loaders */
+    const char *pixbuf_caches[] = { "lib", "lib/*-*", "lib32", "lib32/*-*", "lib64", "lib64/*-*" };
+    char new_env8[length+1];
+    unsigned int i;
+    for (i = 0; i < sizeof(pixbuf_caches) / sizeof(pixbuf_caches[0]) && getenv("GDK_PIXBUF_MODULE_FILE") == NULL; i++) {
+        glob_t found;
+        snprintf(new_env8, length, "%s/usr/%s/gdk-pixbuf-2.0/*/loaders.cache", appdir, pixbuf_caches[i]);
+        if (glob(new_env8, 0, NULL, &found) == 0) {
+            snprintf(new_env8, length, "GDK_PIXBUF_MODULE_FILE=%s", found.gl_pathv[0]);
+            putenv(new_env8);
+        }
+        globfree(&found);
+    }
+
     /* Run */
     ret = execvp(executable, argv); // FIXME: What about arguments in the Exec= line of the desktop file?
 
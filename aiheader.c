@@ -0,0 +1,177 @@
+#include <elf.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "elf.h"
+#include "getsection.h"
+#include "aiheader.h"
+
+int appimage_read_header(const char *path, struct appimage_header *hdr)
+{
+    ssize_t ret;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ret = pread(fd, hdr, sizeof(*hdr), APPIMAGE_HEADER_OFFSET);
+    close(fd);
+    if (ret != sizeof(*hdr) || memcmp(hdr->magic, APPIMAGE_HEADER_MAGIC, sizeof(hdr->magic)) != 0)
+        return -1;
+    hdr->version = le32toh(hdr->version);
+    hdr->flags = le32toh(hdr->flags);
+    hdr->payload_offset = le64toh(hdr->payload_offset);
+    hdr->upd_info_offset = le64toh(hdr->upd_info_offset);
+    hdr->upd_info_length = le64toh(hdr->upd_info_length);
+    hdr->signature_offset = le64toh(hdr->signature_offset);
+    hdr->signature_length = le64toh(hdr->signature_length);
+    /* Later versions only ever append fields */
+    if (hdr->version < 1)
+        return -1;
+    return 0;
+}
+
+unsigned long appimage_get_payload_offset(const char *path)
+{
+    struct appimage_header hdr;
+    struct stat st;
+    unsigned long elf_size = get_elf_size(path);
+
+    /* The payload follows the ELF file, whatever a damaged header says */
+    if (appimage_read_header(path, &hdr) == 0 && stat(path, &st) == 0
+        && hdr.payload_offset >= elf_size && hdr.payload_offset <= (uint64_t) st.st_size)
+        return hdr.payload_offset;
+    return elf_size;
+}
+
+int appimage_get_section(const char *path, const char *section_name, unsigned long *offset, unsigned long *length)
+{
+    struct appimage_header hdr;
+    if (appimage_read_header(path, &hdr) == 0) {
+        if (strcmp(section_name, ".upd_info") == 0 && hdr.upd_info_offset != 0) {
+            *offset = hdr.upd_info_offset;
+            *length = hdr.upd_info_length;
+            return 0;
+        }
+        if (strcmp(section_name, ".sha256_sig") == 0 && hdr.signature_offset != 0) {
+            *offset = hdr.signature_offset;
+            *length = hdr.signature_length;
+            return 0;
+        }
+    }
+    return get_elf_section_offset_and_lenghth((char *) path, (char *) section_name, offset, length);
+}
+
+/* Find a section in an ELF file in memory */
+static void find_section(const char *elf, size_t size, int is64, const char *name, uint64_t *offset, uint64_t *length)
+{
+    uint64_t shoff, str_offset;
+    unsigned int shnum, shentsize, shstrndx, i;
+
+    if (is64) {
+        const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) elf;
+        shoff = ehdr->e_shoff;
+        shnum = ehdr->e_shnum;
+        shentsize = ehdr->e_shentsize;
+        shstrndx = ehdr->e_shstrndx;
+    } else {
+        const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *) elf;
+        shoff = ehdr->e_shoff;
+        shnum = ehdr->e_shnum;
+        shentsize = ehdr->e_shentsize;
+        shstrndx = ehdr->e_shstrndx;
+    }
+    if (shstrndx >= shnum || shoff + (uint64_t) shnum * shentsize > size)
+        return;
+    if (is64)
+        str_offset = ((const Elf64_Shdr *) (elf + shoff + shstrndx * shentsize))->sh_offset;
+    else
+        str_offset = ((const Elf32_Shdr *) (elf + shoff + shstrndx * shentsize))->sh_offset;
+
+    for (i = 0; i < shnum; i++) {
+        uint64_t name_offset, sh_offset, sh_size;
+        if (is64) {
+            const Elf64_Shdr *shdr = (const Elf64_Shdr *) (elf + shoff + i * shentsize);
+            name_offset = shdr->sh_name;
+            sh_offset = shdr->sh_offset;
+            sh_size = shdr->sh_size;
+        } else {
+            const Elf32_Shdr *shdr = (const Elf32_Shdr *) (elf + shoff + i * shentsize);
+            name_offset = shdr->sh_name;
+            sh_offset = shdr->sh_offset;
+            sh_size = shdr->sh_size;
+        }
+        if (str_offset + name_offset + strlen(name) < size
+            && strcmp(elf + str_offset + name_offset, name) == 0) {
+            *offset = sh_offset;
+            *length = sh_size;
+        }
+    }
+}
+
+int appimage_layout_runtime(const char *runtime, size_t runtime_size, char *out)
+{
+    struct appimage_header hdr;
+    uint64_t shoff, sht_size, new_shoff;
+    int is64;
+
+    if (runtime_size < EI_NIDENT || memcmp(runtime, ELFMAG, SELFMAG) != 0)
+        return -1;
+    /* The section headers are read in host byte order below */
+    if (runtime[EI_DATA] != (__BYTE_ORDER == __LITTLE_ENDIAN ? ELFDATA2LSB : ELFDATA2MSB))
+        return -1;
+
+    /* E.g., the runtime of an existing AppImage that is being patched */
+    if (runtime_size == APPIMAGE_PAYLOAD_OFFSET
+        && memcmp(runtime + APPIMAGE_HEADER_OFFSET, APPIMAGE_HEADER_MAGIC, strlen(APPIMAGE_HEADER_MAGIC)) == 0) {
+        memcpy(out, runtime, runtime_size);
+        return 0;
+    }
+
+    is64 = runtime[EI_CLASS] == ELFCLASS64;
+    if (is64) {
+        const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) runtime;
+        if (runtime_size < sizeof(*ehdr))
+            return -1;
+        shoff = ehdr->e_shoff;
+        sht_size = (uint64_t) ehdr->e_shnum * ehdr->e_shentsize;
+    } else {
+        const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *) runtime;
+        if (runtime_size < sizeof(*ehdr))
+            return -1;
+        shoff = ehdr->e_shoff;
+        sht_size = (uint64_t) ehdr->e_shnum * ehdr->e_shentsize;
+    }
+    /* get_elf_size() makes the same assumption */
+    if (shoff + sht_size != runtime_size)
+        return -1;
+    /* Runtime, then the header in a block of its own, then the section headers */
+    new_shoff = APPIMAGE_PAYLOAD_OFFSET - sht_size;
+    if (shoff > APPIMAGE_HEADER_OFFSET || new_shoff < APPIMAGE_HEADER_OFFSET + 4096)
+        return -1;
+
+    memset(out, 0, APPIMAGE_PAYLOAD_OFFSET);
+    memcpy(out, runtime, shoff);
+    memcpy(out + new_shoff, runtime + shoff, sht_size);
+    if (is64)
+        ((Elf64_Ehdr *) out)->e_shoff = new_shoff;
+    else
+        ((Elf32_Ehdr *) out)->e_shoff = new_shoff;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, APPIMAGE_HEADER_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(APPIMAGE_HEADER_VERSION);
+    hdr.flags = htole32(APPIMAGE_FLAG_PAGE_ALIGNED);
+    hdr.payload_offset = htole64(APPIMAGE_PAYLOAD_OFFSET);
+    find_section(out, APPIMAGE_PAYLOAD_OFFSET, is64, ".upd_info", &hdr.upd_info_offset, &hdr.upd_info_length);
+    find_section(out, APPIMAGE_PAYLOAD_OFFSET, is64, ".sha256_sig", &hdr.signature_offset, &hdr.signature_length);
+    hdr.upd_info_offset = htole64(hdr.upd_info_offset);
+    hdr.upd_info_length = htole64(hdr.upd_info_length);
+    hdr.signature_offset = htole64(hdr.signature_offset);
+    hdr.signature_length = htole64(hdr.signature_length);
+    memcpy(out + APPIMAGE_HEADER_OFFSET, &hdr, sizeof(hdr));
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __AIHEADER_H__
+#define __AIHEADER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-offset AppImage header
+ *
+ * appimagetool pads the runtime so that the payload (the squashfs) starts
+ * at APPIMAGE_PAYLOAD_OFFSET and puts this header into the padding, at
+ * APPIMAGE_HEADER_OFFSET. Readers get the payload offset and the location
+ * of the update information and the signature with a single pread instead
+ * of walking the ELF headers. The section header table of the runtime is
+ * moved to the end of the padding, so get_elf_size() still returns the
+ * payload offset and readers that know nothing about the header keep
+ * working. All fields are little endian. */
+
+#define APPIMAGE_PAYLOAD_OFFSET (256*1024)
+#define APPIMAGE_HEADER_OFFSET (APPIMAGE_PAYLOAD_OFFSET - 4*4096)
+#define APPIMAGE_HEADER_MAGIC "AIHEADER"
+#define APPIMAGE_HEADER_VERSION 1
+
+/* Bits in flags; readers ignore bits they do not know */
+#define APPIMAGE_FLAG_PAGE_ALIGNED (1 << 0)   /* payload_offset is a multiple of the page size */
+
+struct appimage_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t payload_offset;
+    uint64_t upd_info_offset;
+    uint64_t upd_info_length;
+    uint64_t signature_offset;
+    uint64_t signature_length;
+};
+
+/* Read the header of the AppImage at path. Returns 0 and fills in hdr,
+ * converted to host byte order, if there is one, and -1 otherwise */
+int appimage_read_header(const char *path, struct appimage_header *hdr);
+
+/* Offset of the payload in the AppImage at path, from the header if
+ * present and between the end of the ELF file and the end of the file,
+ * and from the ELF headers otherwise */
+unsigned long appimage_get_payload_offset(const char *path);
+
+/* Offset and length of ".upd_info" or ".sha256_sig" in the AppImage at
+ * path, from the header if present and from the ELF section headers
+ * otherwise. offset is left alone if the section cannot be found. */
+int appimage_get_section(const char *path, const char *section_name, unsigned long *offset, unsigned long *length);
+
+/* Lay out the first APPIMAGE_PAYLOAD_OFFSET bytes of an AppImage in out:
+ * the runtime, padding, the header and the relocated section header table.
+ * A runtime that already carries a header is copied as it is. Returns -1
+ * if the runtime is too large or not an ELF file this can handle. */
+int appimage_layout_runtime(const char *runtime, size_t runtime_size, char *out);
+
+#endif /* __AIHEADER_H__ */
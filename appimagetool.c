@@ -38,6 +38,10 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "binreloc.h"
 #ifndef NULL
@@ -49,8 +53,26 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <inotifytools/inotifytools.h>
+#include <inotifytools/inotify.h>
+
+#include <elf.h>
+#include <time.h>
+
 #include "elf.h"
 #include "getsection.h"
+#include "aiheader.h"
+#include "elfstrip.h"
+#include "elfinfo.h"
+#include "elfdeps.h"
+#include "caches.h"
+#include "sortfile.h"
+#include "parallel.h"
+#include "tarstream.h"
+#include "delta.h"
+#include "check.h"
+#include "prefetch.h"
+#include "profile.h"
 
 extern int _binary_runtime_start;
 extern int _binary_runtime_size;
@@ -63,11 +85,30 @@ static gboolean verbose = FALSE;
 static gboolean version = FALSE;
 static gboolean sign = FALSE;
 static gboolean no_appstream = FALSE;
+static gboolean strip_elf = FALSE;
+static gboolean watch = FALSE;
+static gboolean precompute = FALSE;
+static gboolean similarity_order = FALSE;
+static gboolean group_small_files = FALSE;
+static gint compression_level = 0;
+static gboolean order_report = FALSE;
+static gboolean uncompressed_elf = FALSE;
+static gboolean check = FALSE;
 gchar **remaining_args = NULL;
 gchar *updateinformation = NULL;
 gchar *bintray_user = NULL;
 gchar *bintray_repo = NULL;
 gchar *sqfs_comp = "gzip";
+gchar *sqfs_block_size = NULL;
+gchar *debug_dir = NULL;
+gchar *unused_libs = NULL;
+gchar *patch_image = NULL;
+static gboolean delta = FALSE;
+gchar *apply_delta = NULL;
+gchar *from_tar = NULL;
+gchar **variant_specs = NULL;
+gchar *hot_set = NULL;
+gchar *startup_profile = NULL;
 
 // #####################################################################
 
@@ -83,7 +124,7 @@ int sfs_ls(char* image) {
     sqfs_traverse trv;
     sqfs fs;
     
-    unsigned long fs_offset = get_elf_size(image);
+    unsigned long fs_offset = appimage_get_payload_offset(image);
     
     if ((err = sqfs_open_image(&fs, image, fs_offset)))
         die("sqfs_open_image error");
@@ -103,10 +144,66 @@ int sfs_ls(char* image) {
     return 0;
 }
 
+/* The squashfs block size in bytes for block_size, or the default of comp if
+* it is NULL; files smaller than this go into fragments */
+static guint64 sqfs_block_bytes(const gchar *comp, const gchar *block_size) {
+    if(block_size == NULL)
+        return (0 == strcmp("xz", comp)) ? 16384 : 131072;
+    gchar *end;
+    guint64 size = g_ascii_strtoull(block_size, &end, 10);
+    if(*end == 'K' || *end == 'k')
+        size *= 1024;
+    else if(*end == 'M' || *end == 'm')
+        size *= 1024 * 1024;
+    return size;
+}
+
+/* Command line for mksquashfs; source and destination are not copied
+* extra_args, if not NULL, are appended to the mksquashfs command line */
+static GPtrArray *mksquashfs_argv(char *source, char *destination, GPtrArray *extra_args) {
+    GPtrArray *args = g_ptr_array_new();
+    guint i;
+    g_ptr_array_add(args, "mksquashfs");
+    g_ptr_array_add(args, source);
+    g_ptr_array_add(args, destination);
+    g_ptr_array_add(args, "-comp");
+    g_ptr_array_add(args, sqfs_comp);
+    if(0==strcmp("xz", sqfs_comp))
+    {
+        g_ptr_array_add(args, "-Xdict-size");
+        g_ptr_array_add(args, "100%");
+    }
+    if(compression_level != 0 && (0==strcmp("zstd", sqfs_comp) || 0==strcmp("gzip", sqfs_comp)))
+    {
+        /* Decompression speed does not depend on the level */
+        g_ptr_array_add(args, "-Xcompression-level");
+        g_ptr_array_add(args, g_strdup_printf("%d", compression_level));
+    }
+    if(sqfs_block_size != NULL)
+    {
+        g_ptr_array_add(args, "-b");
+        g_ptr_array_add(args, sqfs_block_size);
+    }
+    else if(0==strcmp("xz", sqfs_comp))
+    {
+        // https://jonathancarter.org/2015/04/06/squashfs-performance-testing/ says:
+        // improved performance by using a 16384 block size with a sacrifice of around 3% more squashfs image space
+        g_ptr_array_add(args, "-b");
+        g_ptr_array_add(args, "16384");
+    }
+    g_ptr_array_add(args, "-root-owned");
+    g_ptr_array_add(args, "-noappend");
+    g_ptr_array_add(args, "-no-xattrs");
+    if (extra_args != NULL)
+        for (i = 0; i < extra_args->len; i++)
+            g_ptr_array_add(args, g_ptr_array_index(extra_args, i));
+    g_ptr_array_add(args, NULL);
+    return args;
+}
+
 /* Generate a squashfs filesystem using mksquashfs on the $PATH 
 * execlp(), execvp(), and execvpe() search on the $PATH */
-int sfs_mksquashfs(char *source, char *destination) {
-    pid_t parent = getpid();
+int sfs_mksquashfs(char *source, char *destination, GPtrArray *extra_args) {
     pid_t pid = fork();
     
     if (pid == -1) {
@@ -115,22 +212,76 @@ int sfs_mksquashfs(char *source, char *destination) {
     } else if (pid > 0) {
         int status;
         waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            return(-1);
     } else {
         // we are the child
-        if(0==strcmp("xz", sqfs_comp))
-        {
-            // https://jonathancarter.org/2015/04/06/squashfs-performance-testing/ says:
-            // improved performance by using a 16384 block size with a sacrifice of around 3% more squashfs image space
-            execlp("mksquashfs", "mksquashfs", source, destination, "-comp", "xz", "-root-owned", "-noappend", "-Xdict-size", "100%", "-b", "16384", "-no-xattrs", "-root-owned", NULL);
-        } else {
-        execlp("mksquashfs", "mksquashfs", source, destination, "-comp", sqfs_comp, "-root-owned", "-noappend", "-no-xattrs", "-root-owned", NULL);
-        }
-        perror("execlp");   // execlp() returns only on error
-        return(-1); // exec never returns
+        GPtrArray *args = mksquashfs_argv(source, destination, extra_args);
+        execvp("mksquashfs", (char **) args->pdata);
+        perror("execvp");   // execvp() returns only on error
+        exit(1); // exec never returns
     }
     return(0);
 }
 
+/* Whether the mksquashfs on the $PATH knows option, e.g. "-tar" to read a
+* tar archive from stdin, which it can since squashfs-tools 4.6 */
+gboolean mksquashfs_supports(const char *option) {
+    gchar *argv[] = { "mksquashfs", "-help", NULL };
+    gchar *out = NULL;
+    gchar *err = NULL;
+    gboolean found;
+    if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &out, &err, NULL, NULL))
+        return FALSE;
+    found = (out != NULL && strstr(out, option) != NULL) || (err != NULL && strstr(err, option) != NULL);
+    g_free(out);
+    g_free(err);
+    return found;
+}
+
+/* Generate a squashfs filesystem from a tar archive that write_tar writes
+* into the pipe given to it, while mksquashfs reads the other end */
+int sfs_mksquashfs_from_tar(char *destination, GPtrArray *extra_args, int (*write_tar)(int fd, void *data), void *data) {
+    int fds[2];
+    int ret;
+    int status;
+    void (*old_handler)(int);
+    
+    if (pipe(fds) != 0)
+        return(-1);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return(-1);
+    } else if (pid == 0) {
+        // we are the child
+        GPtrArray *tar_args = g_ptr_array_new();
+        guint i;
+        dup2(fds[0], 0);
+        close(fds[0]);
+        close(fds[1]);
+        g_ptr_array_add(tar_args, "-tar");
+        if (extra_args != NULL)
+            for (i = 0; i < extra_args->len; i++)
+                g_ptr_array_add(tar_args, g_ptr_array_index(extra_args, i));
+        GPtrArray *args = mksquashfs_argv("-", destination, tar_args);
+        execvp("mksquashfs", (char **) args->pdata);
+        perror("execvp");   // execvp() returns only on error
+        exit(1); // exec never returns
+    }
+    close(fds[0]);
+    /* If mksquashfs dies early, we want EPIPE rather than being killed */
+    old_handler = signal(SIGPIPE, SIG_IGN);
+    ret = write_tar(fds[1], data);
+    close(fds[1]);
+    signal(SIGPIPE, old_handler);
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return(-1);
+    return(ret);
+}
+
 /* Generate a squashfs filesystem
 * The following would work if we link to mksquashfs.o after we renamed 
 * main() to mksquashfs_main() in mksquashfs.c but we don't want to actually do
@@ -146,6 +297,1114 @@ int sfs_mksquashfs(char *source, char *destination) {
 * }
 */
 
+/* Append the contents of the file at src_path to dst */
+static int append_file(FILE *dst, const char *src_path) {
+    char buf[64*1024];
+    size_t n;
+    FILE *src = fopen(src_path, "rb");
+    if (src == NULL)
+        return(-1);
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
+        if (fwrite(buf, 1, n, dst) != n) {
+            fclose(src);
+            return(-1);
+        }
+    }
+    fclose(src);
+    return(0);
+}
+
+/* Write the runtime followed by the squashfs filesystem in tempfile to
+* destination, mark it as executable and delete tempfile */
+int assemble_appimage(char *tempfile, char *destination, const char *runtime, size_t runtime_size) {
+    fprintf (stderr, "Generating AppImage...\n");
+    FILE *fpdst = fopen(destination, "w");
+    if (fpdst == NULL) {
+        fprintf (stderr, "Not able to open the destination file for writing, aborting\n");
+        unlink(tempfile);
+        return(-1);
+    }
+    
+    if (verbose)
+        printf("Size of the runtime: %lu bytes\n", (unsigned long) runtime_size);
+    /* Put the payload at a fixed offset and describe it in the header there */
+    char *layout = g_malloc(APPIMAGE_PAYLOAD_OFFSET);
+    if (appimage_layout_runtime(runtime, runtime_size, layout) != 0) {
+        fprintf (stderr, "The runtime (%lu bytes) does not fit in front of the AppImage header at offset %d, aborting\n",
+                 (unsigned long) runtime_size, APPIMAGE_HEADER_OFFSET);
+        g_free(layout);
+        fclose(fpdst);
+        unlink(destination);
+        unlink(tempfile);
+        return(-1);
+    }
+    fwrite(layout, APPIMAGE_PAYLOAD_OFFSET, 1, fpdst);
+    g_free(layout);
+    fseek (fpdst, 0, SEEK_END);
+    
+    if (append_file(fpdst, tempfile) != 0) {
+        fprintf (stderr, "Not able to copy the tempfile into the AppImage, aborting\n");
+        fclose(fpdst);
+        unlink(tempfile);
+        return(-1);
+    }
+    if (fclose(fpdst) != 0) {
+        fprintf (stderr, "Not able to write the AppImage, aborting\n");
+        unlink(tempfile);
+        return(-1);
+    }
+    
+    fprintf (stderr, "Marking the AppImage as executable...\n");
+    if (chmod (destination, 0755) < 0) {
+        fprintf (stderr, "Could not set executable bit, aborting\n");
+        return(-1);
+    }
+    if(unlink(tempfile) != 0) {
+        fprintf (stderr, "Could not delete the tempfile, aborting\n");
+        return(-1);
+    }
+    return(0);
+}
+
+/* Package source as an AppImage at destination: generate the squashfs
+* and prepend the runtime that is embedded into this executable */
+int generate_appimage(char *source, char *destination, GPtrArray *mksquashfs_args) {
+    /* mksquashfs can currently not start writing at an offset,
+    * so we need a tempfile. https://github.com/plougher/squashfs-tools/pull/13
+    * should hopefully change that. */
+    char *tempfile;
+    fprintf (stderr, "Generating squashfs...\n");
+    tempfile = br_strcat(destination, ".temp");
+    int result = sfs_mksquashfs(source, tempfile, mksquashfs_args);
+    if(result != 0) {
+        fprintf (stderr, "sfs_mksquashfs error\n");
+        unlink(tempfile);
+        return(-1);
+    }
+    
+    /* runtime is embedded into this executable
+    * http://stupefydeveloper.blogspot.de/2008/08/cc-embed-binary-data-into-elf.html */
+    int size = (int)&_binary_runtime_size;
+    char *data = (char *)&_binary_runtime_start;
+    return assemble_appimage(tempfile, destination, data, size);
+}
+
+/* Whether mksquashfs may be asked for this compression */
+static gboolean comp_supported(const char *comp) {
+    return 0 == strcmp(comp, "gzip") || 0 == strcmp(comp, "xz") || 0 == strcmp(comp, "zstd");
+}
+
+/* One output of --variant: an AppImage with its own compression, block size and runtime */
+struct variant {
+    gchar *comp;
+    gchar *block_size;      /* NULL for the default of comp */
+    gchar *runtime;         /* NULL for the runtime embedded into this executable */
+    gchar *destination;
+    gchar *tempfile;
+    pid_t pid;
+    int fd;                 /* Into the mksquashfs of this variant, -1 once closed */
+    gboolean done;
+};
+
+/* Parse COMP[:BLOCKSIZE[:RUNTIME]]; destination gets a suffix naming the
+* variant, e.g. Foo-x86_64.AppImage becomes Foo-x86_64-zstd.AppImage */
+static struct variant *parse_variant(const gchar *spec, const gchar *destination) {
+    gchar **parts = g_strsplit(spec, ":", 3);
+    struct variant *v = g_new0(struct variant, 1);
+    gchar *base;
+    
+    v->comp = g_strdup(parts[0]);
+    if (parts[1] != NULL && *parts[1] != '\0')
+        v->block_size = g_strdup(parts[1]);
+    if (parts[1] != NULL && parts[2] != NULL && *parts[2] != '\0')
+        v->runtime = g_strdup(parts[2]);
+    g_strfreev(parts);
+    if (g_str_has_suffix(destination, ".AppImage"))
+        base = g_strndup(destination, strlen(destination) - strlen(".AppImage"));
+    else
+        base = g_strdup(destination);
+    if (v->block_size != NULL)
+        v->destination = g_strdup_printf("%s-%s-%s.AppImage", base, v->comp, v->block_size);
+    else
+        v->destination = g_strdup_printf("%s-%s.AppImage", base, v->comp);
+    v->tempfile = g_strconcat(v->destination, ".temp", NULL);
+    v->pid = -1;
+    v->fd = -1;
+    g_free(base);
+    return v;
+}
+
+struct fan_out {
+    int in;
+    GPtrArray *variants;
+};
+
+/* Copy the tar archive to the mksquashfs of every variant. The writes
+* block, so the variants move in lock-step: the archive is read no faster
+* than the slowest mksquashfs takes it, and a fast one waits for it rather
+* than the whole archive being buffered. One that stops reading is
+* dropped, and the others carry on. */
+static void *fan_out_tar(void *arg) {
+    struct fan_out *fo = arg;
+    size_t buf_size = 1024*1024;
+    char *buf = g_malloc(buf_size);
+    ssize_t n;
+    guint i;
+    
+    while ((n = read(fo->in, buf, buf_size)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+        for (i = 0; i < fo->variants->len; i++) {
+            struct variant *v = g_ptr_array_index(fo->variants, i);
+            ssize_t done = 0;
+            while (v->fd >= 0 && done < n) {
+                ssize_t w = write(v->fd, buf + done, n - done);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0) {
+                    fprintf(stderr, "mksquashfs for %s stopped reading\n", v->destination);
+                    close(v->fd);
+                    v->fd = -1;
+                    break;
+                }
+                done += w;
+            }
+        }
+    }
+    for (i = 0; i < fo->variants->len; i++) {
+        struct variant *v = g_ptr_array_index(fo->variants, i);
+        if (v->fd >= 0)
+            close(v->fd);
+        v->fd = -1;
+    }
+    g_free(buf);
+    return NULL;
+}
+
+/* Package source once for the variants: the AppDir is walked and read a
+* single time, as a tar archive in the order of sort_file that is copied to
+* one mksquashfs per variant, which all compress at the same time */
+static int generate_variant_batch(char *source, GPtrArray *variants, GPtrArray *tar_args, char *sort_file, char *exclude_file) {
+    struct fan_out fo;
+    pthread_t tid;
+    int fds[2];
+    int ret = 0;
+    int failed = 0;
+    guint i;
+    void (*old_handler)(int);
+    
+    fprintf (stderr, "Generating %u squashfs variants...\n", variants->len);
+    for (i = 0; i < variants->len; i++) {
+        struct variant *v = g_ptr_array_index(variants, i);
+        if (pipe(fds) != 0) {
+            ret = -1;
+            break;
+        }
+        /* The later variants must not hold the pipes of the earlier ones open */
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        v->pid = fork();
+        if (v->pid == -1) {
+            close(fds[0]);
+            close(fds[1]);
+            ret = -1;
+            break;
+        } else if (v->pid == 0) {
+            // we are the child
+            dup2(fds[0], 0);
+            close(fds[0]);
+            sqfs_comp = v->comp;
+            sqfs_block_size = v->block_size;
+            GPtrArray *args = mksquashfs_argv("-", v->tempfile, tar_args);
+            execvp("mksquashfs", (char **) args->pdata);
+            perror("execvp");   // execvp() returns only on error
+            exit(1); // exec never returns
+        }
+        close(fds[0]);
+        v->fd = fds[1];
+        if (verbose)
+            fprintf (stderr, "%s: %s compression, %s blocks, %s runtime\n", v->destination, v->comp,
+                     v->block_size ? v->block_size : "default", v->runtime ? v->runtime : "embedded");
+    }
+    
+    /* If a mksquashfs dies early, we want EPIPE rather than being killed */
+    old_handler = signal(SIGPIPE, SIG_IGN);
+    if (ret == 0 && pipe(fds) == 0) {
+        fo.in = fds[0];
+        fo.variants = variants;
+        if (pthread_create(&tid, NULL, fan_out_tar, &fo) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            ret = -1;
+        } else {
+            ret = tar_from_directory(fds[1], source, sort_file, exclude_file, FALSE);
+            if (ret == 0)
+                ret = tar_write_end(fds[1]);
+            close(fds[1]);
+            pthread_join(tid, NULL);
+            close(fds[0]);
+        }
+    } else {
+        ret = -1;
+    }
+    signal(SIGPIPE, old_handler);
+    
+    for (i = 0; i < variants->len; i++) {
+        struct variant *v = g_ptr_array_index(variants, i);
+        int status = 0;
+        gchar *runtime_file = NULL;
+        const char *runtime;
+        gsize runtime_size;
+        
+        if (v->fd >= 0)
+            close(v->fd);
+        v->fd = -1;
+        if (v->pid <= 0)
+            continue;
+        waitpid(v->pid, &status, 0);
+        if (ret != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf (stderr, "Could not generate the squashfs for %s\n", v->destination);
+            unlink(v->tempfile);
+            failed++;
+            continue;
+        }
+        if (v->runtime != NULL) {
+            if (!g_file_get_contents(v->runtime, &runtime_file, &runtime_size, NULL)) {
+                fprintf (stderr, "Could not read the runtime %s\n", v->runtime);
+                unlink(v->tempfile);
+                failed++;
+                continue;
+            }
+            runtime = runtime_file;
+        } else {
+            /* runtime is embedded into this executable */
+            runtime = (char *)&_binary_runtime_start;
+            runtime_size = (int)&_binary_runtime_size;
+        }
+        if (assemble_appimage(v->tempfile, v->destination, runtime, runtime_size) != 0)
+            failed++;
+        else
+            fprintf (stderr, "Generated %s\n", v->destination);
+        g_free(runtime_file);
+    }
+    return (ret != 0 || failed > 0) ? -1 : 0;
+}
+
+/* Package source for every variant. -sort and -ef in mksquashfs_args are
+* applied to the tar archive, since mksquashfs ignores them for one. With
+* --group-small-files, which files are small depends on the block size, so
+* the variants of each block size get a sort file and a tar archive of
+* their own. */
+static int generate_variants(char *source, GPtrArray *variants, GPtrArray *mksquashfs_args) {
+    GPtrArray *tar_args = g_ptr_array_new();
+    char *sort_file = NULL;
+    char *exclude_file = NULL;
+    int ret = 0;
+    guint i, j;
+    
+    g_ptr_array_add(tar_args, "-tar");
+    for (i = 0; mksquashfs_args != NULL && i < mksquashfs_args->len; i++) {
+        char *arg = g_ptr_array_index(mksquashfs_args, i);
+        if (i + 1 < mksquashfs_args->len && 0 == strcmp(arg, "-sort")) {
+            sort_file = g_ptr_array_index(mksquashfs_args, ++i);
+        } else if (i + 1 < mksquashfs_args->len && 0 == strcmp(arg, "-ef")) {
+            exclude_file = g_ptr_array_index(mksquashfs_args, ++i);
+        } else {
+            g_ptr_array_add(tar_args, arg);
+        }
+    }
+    
+    if (!group_small_files || similarity_order) {
+        ret = generate_variant_batch(source, variants, tar_args, sort_file, exclude_file);
+        g_ptr_array_free(tar_args, TRUE);
+        return ret;
+    }
+    for (i = 0; i < variants->len; i++) {
+        struct variant *v = g_ptr_array_index(variants, i);
+        guint64 limit = sqfs_block_bytes(v->comp, v->block_size);
+        GPtrArray *batch;
+        gchar *batch_sort;
+        
+        if (v->done)
+            continue;
+        batch = g_ptr_array_new();
+        for (j = i; j < variants->len; j++) {
+            struct variant *w = g_ptr_array_index(variants, j);
+            if (!w->done && sqfs_block_bytes(w->comp, w->block_size) == limit) {
+                w->done = TRUE;
+                g_ptr_array_add(batch, w);
+            }
+        }
+        batch_sort = g_strconcat(v->destination, ".sort", NULL);
+        if (write_small_file_sort(source, batch_sort, limit, verbose) < 0
+            || generate_variant_batch(source, batch, tar_args, batch_sort, exclude_file) != 0)
+            ret = -1;
+        unlink(batch_sort);
+        g_free(batch_sort);
+        g_ptr_array_free(batch, TRUE);
+    }
+    g_ptr_array_free(tar_args, TRUE);
+    return ret;
+}
+
+/* Overwrite an ELF section of the AppImage at path with zeros */
+static void clear_elf_section(char *path, char *section_name) {
+    unsigned long offset = 0;
+    unsigned long length = 0;
+    appimage_get_section(path, section_name, &offset, &length);
+    if(offset == 0)
+        return;
+    FILE *fp = fopen(path, "r+");
+    if (fp == NULL)
+        die("Not able to open the destination file for writing, aborting");
+    gchar *zeros = g_malloc0(length);
+    fseek(fp, offset, SEEK_SET);
+    fwrite(zeros, length, 1, fp);
+    g_free(zeros);
+    fclose(fp);
+}
+
+/* Check updateinformation, embed it into the .upd_info section of destination
+* and, as a courtesy, generate the zsync file if zsyncmake is installed */
+void embed_updateinformation(char *destination) {
+    FILE *fp;
+    char command[PATH_MAX];
+
+    if(!g_str_has_prefix(updateinformation,"zsync|"))
+        if(!g_str_has_prefix(updateinformation,"bintray-zsync|"))
+            die("The provided updateinformation is not in a recognized format");
+        
+    gchar **ui_type = g_strsplit_set(updateinformation, "|", -1);
+                
+    if(verbose)
+        printf("updateinformation type: %s\n", ui_type[0]);
+    /* TODO: Further checking of the updateinformation */
+
+    /* As a courtesy, we also generate the zsync file */
+    gchar *zsyncmake_path = g_find_program_in_path ("zsyncmake");
+    if(!zsyncmake_path){
+        fprintf (stderr, "zsyncmake is not installed, skipping\n");
+    } else {
+        fprintf (stderr, "zsyncmake is installed and updateinformation is provided, "
+        "hence generating zsync file\n");
+        sprintf (command, "%s %s -u %s", zsyncmake_path, destination, basename(destination));
+        fp = popen(command, "r");
+        if (fp == NULL)
+            die("Failed to run zsyncmake command");            
+    }
+    
+    unsigned long ui_offset = 0;
+    unsigned long ui_length = 0;
+    appimage_get_section(destination, ".upd_info", &ui_offset, &ui_length);
+    if(verbose)
+        printf("ui_offset: %lu\n", ui_offset);
+    if(verbose)
+        printf("ui_length: %lu\n", ui_length);
+    if(ui_offset == 0) {
+        die("Could not determine offset for updateinformation");
+    } else {
+        if(strlen(updateinformation)>ui_length)
+            die("updateinformation does not fit into segment, aborting");
+        /* The section may still hold longer updateinformation from before */
+        clear_elf_section(destination, ".upd_info");
+        FILE *fpdst2 = fopen(destination, "r+");
+        if (fpdst2 == NULL)
+            die("Not able to open the destination file for writing, aborting");
+        fseek(fpdst2, ui_offset, SEEK_SET);
+        fwrite(updateinformation, strlen(updateinformation), 1, fpdst2);
+        fclose(fpdst2);
+    }
+}
+
+/* Sign the sha256 digest of destination with gpg2 and embed the
+* signature into its .sha256_sig section */
+void sign_appimage(char *destination) {
+    FILE *fp;
+    char command[PATH_MAX];
+
+    /* The user has indicated that he wants to sign */
+    gchar *gpg2_path = g_find_program_in_path ("gpg2");
+    gchar *sha256sum_path = g_find_program_in_path ("sha256sum");
+    if(!gpg2_path){
+        fprintf (stderr, "gpg2 is not installed, cannot sign\n");
+    }
+    else if(!sha256sum_path){
+        fprintf (stderr, "sha256sum is not installed, cannot sign\n");
+    } else {
+        fprintf (stderr, "gpg2 and sha256sum are installed and user requested to sign, "
+        "hence signing\n");
+        char *digestfile;
+        digestfile = br_strcat(destination, ".digest");
+        char *ascfile;
+        ascfile = br_strcat(destination, ".digest.asc");
+        if (g_file_test (digestfile, G_FILE_TEST_IS_REGULAR))
+            unlink(digestfile);
+        /* The digest covers the section, so it must not hold an old signature */
+        clear_elf_section(destination, ".sha256_sig");
+        sprintf (command, "%s %s", sha256sum_path, destination);
+        if(verbose)
+            fprintf (stderr, "%s\n", command);
+        fp = popen(command, "r");
+        if (fp == NULL)
+            die("sha256sum command did not succeed");
+        char output[1024];
+        fgets(output, sizeof(output)-1, fp);
+        if(verbose)
+            printf("sha256sum: %s\n", g_strsplit_set(output, " ", -1)[0]);
+        FILE *fpx = fopen(digestfile, "w");
+        if (fpx != NULL)
+        {
+            fputs(g_strsplit_set(output, " ", -1)[0], fpx);
+            fclose(fpx);
+        }
+        if(WEXITSTATUS(pclose(fp)) != 0)
+            die("sha256sum command did not succeed");
+        if (g_file_test (ascfile, G_FILE_TEST_IS_REGULAR))
+            unlink(ascfile);
+        sprintf (command, "%s --detach-sign --armor %s", gpg2_path, digestfile);
+        if(verbose)
+            fprintf (stderr, "%s\n", command);
+        fp = popen(command, "r");
+        if(WEXITSTATUS(pclose(fp)) != 0)
+            die("gpg2 command did not succeed");
+        unsigned long sig_offset = 0;
+        unsigned long sig_length = 0;
+        appimage_get_section(destination, ".sha256_sig", &sig_offset, &sig_length);
+        if(verbose)
+            printf("sig_offset: %lu\n", sig_offset);
+        if(verbose)
+            printf("sig_length: %lu\n", sig_length);
+        if(sig_offset == 0) {
+            die("Could not determine offset for signature");
+        } else {
+            FILE *fpdst3 = fopen(destination, "r+");
+            if (fpdst3 == NULL)
+                die("Not able to open the destination file for writing, aborting");
+//            if(strlen(updateinformation)>sig_length)
+//                die("signature does not fit into segment, aborting");
+            fseek(fpdst3, sig_offset, SEEK_SET);
+            FILE *fpsrc2 = fopen(ascfile, "rb");
+            if (fpsrc2 == NULL) {
+                die("Not able to open the asc file for reading, aborting");
+            }
+            char byte;
+            while (!feof(fpsrc2))
+            {
+                fread(&byte, sizeof(char), 1, fpsrc2);
+                fwrite(&byte, sizeof(char), 1, fpdst3);
+            }
+            fclose(fpsrc2);
+            fclose(fpdst3);
+        }
+        if (g_file_test (ascfile, G_FILE_TEST_IS_REGULAR))
+            unlink(ascfile);
+        if (g_file_test (digestfile, G_FILE_TEST_IS_REGULAR))
+            unlink(digestfile);
+    }
+}
+
+/* Names that mksquashfs -comp uses for the squashfs compression ids */
+static char *sqfs_compression_name(int id) {
+    switch (id) {
+        case 1: return "gzip";
+        case 2: return "lzma";
+        case 3: return "lzo";
+        case 4: return "xz";
+        case 5: return "lz4";
+        case 6: return "zstd";
+    }
+    return NULL;
+}
+
+struct image_source {
+    char *image;
+    char *overlay;
+};
+
+static int write_image_tar(int fd, void *data) {
+    struct image_source *src = data;
+    if (tar_from_image(fd, src->image, src->overlay, parallel_default_threads(), verbose) != 0)
+        return(-1);
+    return tar_write_end(fd);
+}
+
+/* Whether none of names is a top-level entry of the squashfs of image.
+* mksquashfs can only append entries to the root directory: a file below a
+* directory that is already there would be added next to it under another
+* name. */
+static gboolean names_are_new(char *image, unsigned long fs_offset, GPtrArray *names) {
+    sqfs fs;
+    guint i;
+    gboolean adds_only = TRUE;
+    
+    if (sqfs_open_image(&fs, image, fs_offset) != SQFS_OK)
+        return FALSE;
+    for (i = 0; adds_only && i < names->len; i++) {
+        sqfs_inode inode;
+        bool found = false;
+        if (sqfs_inode_get(&fs, &inode, sqfs_inode_root(&fs)) != SQFS_OK
+            || sqfs_lookup_path(&fs, &inode, g_ptr_array_index(names, i), &found) != SQFS_OK || found)
+            adds_only = FALSE;
+    }
+    sqfs_fd_close(fs.fd);
+    return adds_only;
+}
+
+/* Whether none of the top-level entries of overlay is in the squashfs of
+* image */
+static gboolean overlay_adds_only(char *image, unsigned long fs_offset, char *overlay) {
+    GDir *dir = g_dir_open(overlay, 0, NULL);
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    const gchar *name;
+    gboolean adds_only;
+    
+    if (dir == NULL)
+        return FALSE;
+    while ((name = g_dir_read_name(dir)) != NULL)
+        g_ptr_array_add(names, g_strdup(name));
+    g_dir_close(dir);
+    adds_only = names_are_new(image, fs_offset, names);
+    g_ptr_array_free(names, TRUE);
+    return adds_only;
+}
+
+/* Copy the squashfs of image to destination and have mksquashfs append
+* sources to it: the contents of a single directory, or else each source as
+* a top-level entry. The data blocks and the compression of the image are
+* kept as they are, only the tables are written anew. */
+static int append_squashfs(char *image, unsigned long fs_offset, GPtrArray *sources, GPtrArray *mksquashfs_args, char *destination) {
+    FILE *src = fopen(image, "rb");
+    FILE *dst;
+    char buf[64*1024];
+    size_t n;
+    int status;
+    
+    if (src == NULL || fseek(src, fs_offset, SEEK_SET) != 0) {
+        if (src != NULL)
+            fclose(src);
+        return(-1);
+    }
+    dst = fopen(destination, "wb");
+    if (dst == NULL) {
+        fclose(src);
+        return(-1);
+    }
+    while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
+        if (fwrite(buf, 1, n, dst) != n)
+            break;
+    }
+    fclose(src);
+    if (n != 0 || fclose(dst) != 0)
+        return(-1);
+    
+    pid_t pid = fork();
+    if (pid == -1)
+        return(-1);
+    if (pid == 0) {
+        // we are the child
+        GPtrArray *argv = g_ptr_array_new();
+        guint i;
+        g_ptr_array_add(argv, "mksquashfs");
+        for (i = 0; i < sources->len; i++)
+            g_ptr_array_add(argv, g_ptr_array_index(sources, i));
+        g_ptr_array_add(argv, destination);
+        g_ptr_array_add(argv, "-root-owned");
+        g_ptr_array_add(argv, "-no-xattrs");
+        g_ptr_array_add(argv, "-no-recovery");
+        for (i = 0; mksquashfs_args != NULL && i < mksquashfs_args->len; i++)
+            g_ptr_array_add(argv, g_ptr_array_index(mksquashfs_args, i));
+        g_ptr_array_add(argv, NULL);
+        execvp("mksquashfs", (char **) argv->pdata);
+        perror("execvp");   // execvp() returns only on error
+        exit(1);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return(-1);
+    return(0);
+}
+
+/* Regenerate the squashfs of image, with the files in overlay added if it is
+* not NULL, and write it together with runtime to destination. If overlay
+* only adds new top-level entries, they are appended to a copy of the
+* squashfs and its data blocks are kept. Otherwise the tree is streamed into
+* mksquashfs as a tar archive, rather than extracted to disk, and every file
+* is compressed again. The updateinformation of image is kept, the
+* signature is renewed */
+static void rebuild_appimage(char *image, char *overlay, char *destination, const char *runtime, size_t runtime_size) {
+    struct image_source src = { image, overlay };
+    unsigned long fs_offset = appimage_get_payload_offset(image);
+    gboolean append = overlay != NULL && overlay_adds_only(image, fs_offset, overlay);
+    
+    if (!append && !mksquashfs_supports("-tar"))
+        die("mksquashfs 4.6 or newer, which can read tar archives, is required for this");
+    
+    FILE *fp = fopen(image, "rb");
+    if (fp == NULL)
+        die("Could not open the image, aborting");
+    unsigned long ui_offset = 0;
+    unsigned long ui_length = 0;
+    appimage_get_section(image, ".upd_info", &ui_offset, &ui_length);
+    if (updateinformation == NULL && ui_offset != 0 && ui_offset + ui_length <= fs_offset) {
+        gchar *old = g_malloc0(ui_length + 1);
+        fseek(fp, ui_offset, SEEK_SET);
+        if (fread(old, 1, ui_length, fp) == ui_length && old[0] != 0)
+            updateinformation = old;
+        else
+            g_free(old);
+    }
+    unsigned long sig_offset = 0;
+    unsigned long sig_length = 0;
+    char sig_byte = 0;
+    appimage_get_section(image, ".sha256_sig", &sig_offset, &sig_length);
+    if (sig_offset != 0 && sig_offset < fs_offset) {
+        fseek(fp, sig_offset, SEEK_SET);
+        if (fread(&sig_byte, 1, 1, fp) != 1)
+            sig_byte = 0;
+    }
+    fclose(fp);
+    
+    gchar *tempfile = g_strconcat(destination, ".temp", NULL);
+    gchar *newfile = g_strconcat(destination, ".new", NULL);
+    gint64 start = g_get_monotonic_time();
+    if (append) {
+        GPtrArray *sources = g_ptr_array_new();
+        g_ptr_array_add(sources, overlay);
+        fprintf (stderr, "Appending to the squashfs...\n");
+        if (append_squashfs(image, fs_offset, sources, NULL, tempfile) != 0) {
+            unlink(tempfile);
+            die("Could not append to the squashfs, aborting");
+        }
+        g_ptr_array_free(sources, TRUE);
+    } else {
+        if (overlay != NULL)
+            fprintf (stderr, "%s replaces files of the image or adds to its directories, recompressing all of it\n", overlay);
+        fprintf (stderr, "Generating squashfs...\n");
+        if (sfs_mksquashfs_from_tar(tempfile, NULL, write_image_tar, &src) != 0) {
+            unlink(tempfile);
+            die("Could not generate the squashfs, aborting");
+        }
+    }
+    if (assemble_appimage(tempfile, newfile, runtime, runtime_size) != 0) {
+        unlink(newfile);
+        die("Could not generate the AppImage, aborting");
+    }
+    if (rename(newfile, destination) != 0) {
+        unlink(newfile);
+        die("Could not replace the destination, aborting");
+    }
+    g_free(newfile);
+    g_free(tempfile);
+    
+    /* The old signature does not match the new contents, and neither do
+     * the block positions of the startup profile */
+    clear_elf_section(destination, ".sha256_sig");
+    clear_elf_section(destination, PREFETCH_SECTION);
+    if (updateinformation != NULL)
+        embed_updateinformation(destination);
+    if (sign)
+        sign_appimage(destination);
+    else if (sig_byte != 0)
+        fprintf (stderr, "WARNING: %s was signed, use --sign to sign the new AppImage again\n", image);
+    
+    struct stat old_st, new_st;
+    if (stat(image, &old_st) == 0 && stat(destination, &new_st) == 0)
+        fprintf (stderr, "%s: %lld bytes, was %lld bytes, took %.2f s\n", destination,
+                 (long long) new_st.st_size, (long long) old_st.st_size,
+                 (g_get_monotonic_time() - start) / 1000000.0);
+}
+
+/* Write image with the files in overlay added or replaced to destination,
+* using the compression, block size and runtime of the image */
+void patch_appimage(char *image, char *overlay, char *destination) {
+    sqfs fs;
+    unsigned long fs_offset = appimage_get_payload_offset(image);
+    
+    if (sqfs_open_image(&fs, image, fs_offset) != SQFS_OK)
+        die("sqfs_open_image error");
+    sqfs_comp = sqfs_compression_name(fs.sb.compression);
+    sqfs_block_size = g_strdup_printf("%u", fs.sb.block_size);
+    sqfs_fd_close(fs.fd);
+    if (sqfs_comp == NULL)
+        die("The compression of the image is not known to mksquashfs, aborting");
+    
+    /* Keep the runtime of the image, including its sections */
+    gchar *runtime = g_malloc(fs_offset);
+    FILE *fp = fopen(image, "rb");
+    if (fp == NULL || fread(runtime, 1, fs_offset, fp) != fs_offset)
+        die("Could not read the runtime of the image, aborting");
+    fclose(fp);
+    
+    fprintf (stderr, "Patching %s with the contents of %s...\n", image, overlay);
+    rebuild_appimage(image, overlay, destination, runtime, fs_offset);
+    g_free(runtime);
+    fprintf (stderr, "Success\n");
+}
+
+/* Recompress image with the compression and block size given on the command
+* line and the runtime that is embedded into this executable */
+void repack_appimage(char *image, char *destination) {
+    sqfs fs;
+    
+    if (sqfs_open_image(&fs, image, appimage_get_payload_offset(image)) != SQFS_OK)
+        die("sqfs_open_image error");
+    fprintf (stderr, "Repacking %s (%s, %u byte blocks) with %s compression...\n", image,
+             sqfs_compression_name(fs.sb.compression) ? sqfs_compression_name(fs.sb.compression) : "unknown",
+             fs.sb.block_size, sqfs_comp);
+    sqfs_fd_close(fs.fd);
+    
+    int size = (int)&_binary_runtime_size;
+    char *data = (char *)&_binary_runtime_start;
+    rebuild_appimage(image, NULL, destination, data, size);
+    fprintf (stderr, "Success\n");
+}
+
+/* Append pathname to an mksquashfs action expression, quoted */
+static void append_action_path(GString *actions, const gchar *action, const gchar *path) {
+    const gchar *p;
+    g_string_append_printf(actions, "%s @ pathname(\"", action);
+    for (p = path; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            g_string_append_c(actions, '\\');
+        g_string_append_c(actions, *p);
+    }
+    g_string_append(actions, "\")\n");
+}
+
+/* Collect the executables and shared libraries below path */
+static void find_elf_objects(const gchar *path, GPtrArray *files) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *entry;
+    if (dir == NULL)
+        return;
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        gchar *full_name = g_build_filename(path, entry, NULL);
+        struct elfinfo ei;
+        if (g_file_test(full_name, G_FILE_TEST_IS_SYMLINK)) {
+            g_free(full_name);
+        } else if (g_file_test(full_name, G_FILE_TEST_IS_DIR)) {
+            find_elf_objects(full_name, files);
+            g_free(full_name);
+        } else if (elfinfo_is_elf(full_name) && elfinfo_open(&ei, full_name) == 0) {
+            if (ei.type == ET_EXEC || ei.type == ET_DYN)
+                g_ptr_array_add(files, full_name);
+            else
+                g_free(full_name);
+            elfinfo_close(&ei);
+        } else {
+            g_free(full_name);
+        }
+    }
+    g_dir_close(dir);
+}
+
+/* Add the startup-critical files to files as paths inside source: those
+* listed one per line in list, relative to source, those read in list if
+* it is a trace of the runtime's --appimage-trace, or with "auto", the ELF
+* files that the Exec= binary and AppRun load. Returns FALSE if list
+* cannot be read. */
+static gboolean read_startup_files(char *source, char *list, char *exec, GPtrArray *files) {
+    gchar *contents;
+    gchar **lines;
+    guint i;
+    
+    if (0 == strcmp(list, "auto")) {
+        find_startup_elf_files(source, exec, files, verbose);
+        return TRUE;
+    }
+    if (!g_file_get_contents(list, &contents, NULL, NULL)) {
+        fprintf (stderr, "Could not read %s\n", list);
+        return FALSE;
+    }
+    if (is_trace(contents)) {
+        GPtrArray *traced = g_ptr_array_new_with_free_func(g_free);
+        read_trace_files(contents, traced);
+        for (i = 0; i < traced->len; i++)
+            g_ptr_array_add(files, g_build_filename(source, g_ptr_array_index(traced, i), NULL));
+        g_ptr_array_free(traced, TRUE);
+        g_free(contents);
+        return TRUE;
+    }
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        while (line[0] == '.' && line[1] == '/')
+            line += 2;
+        while (line[0] == '/')
+            line++;
+        if (line[0] != '\0' && line[0] != '#')
+            g_ptr_array_add(files, g_build_filename(source, line, NULL));
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return TRUE;
+}
+
+/* Write an mksquashfs action file that stores files of source uncompressed
+* and outside of fragments, so that the runtime reads them without
+* decompressing anything while the rest of the image keeps the ratio of the
+* chosen compression. With hot_set, these are the startup-critical files
+* that read_startup_files() finds for it. With elf_objects, all
+* executables and shared libraries, which the runtime then hands to the
+* kernel straight from the image. Returns the number of files. */
+static int write_uncompressed_actions(char *source, char *hot_set, char *exec, gboolean elf_objects, char *action_file) {
+    GPtrArray *hot = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    GString *actions = g_string_new(NULL);
+    gint64 hot_size = 0;
+    guint count = 0;
+    guint i;
+    
+    if (elf_objects)
+        find_elf_objects(source, hot);
+    if (hot_set != NULL && !read_startup_files(source, hot_set, exec, hot))
+        return(-1);
+    
+    for (i = 0; i < hot->len; i++) {
+        const gchar *path = g_ptr_array_index(hot, i);
+        struct stat st;
+        if (!g_str_has_prefix(path, source) || path[strlen(source)] != '/' || lstat(path, &st) != 0) {
+            fprintf (stderr, "WARNING: %s is not in %s, ignoring it\n", path, source);
+            continue;
+        }
+        if (g_hash_table_lookup(seen, path) != NULL)
+            continue;
+        g_hash_table_insert(seen, (gpointer) path, (gpointer) path);
+        count++;
+        if (S_ISREG(st.st_mode))
+            hot_size += st.st_size;
+        append_action_path(actions, "uncompressed", path + strlen(source) + 1);
+        append_action_path(actions, "no-fragments", path + strlen(source) + 1);
+    }
+    if (!g_file_set_contents(action_file, actions->str, actions->len, NULL)) {
+        fprintf (stderr, "Could not write %s\n", action_file);
+        return(-1);
+    }
+    fprintf (stderr, "Storing %u files (%lld bytes) uncompressed\n", count, (long long) hot_size);
+    g_hash_table_destroy(seen);
+    g_string_free(actions, TRUE);
+    g_ptr_array_free(hot, TRUE);
+    return(count);
+}
+
+/* Build the squashfs of source with xz and zstd, each in directory order and
+* ordered by similarity, print the sizes and exit */
+static void report_order_gain(char *source, char *destination, GPtrArray *extra_args) {
+    char *comps[] = { "xz", "zstd" };
+    gchar *saved_comp = sqfs_comp;
+    gchar *sort_file = br_strcat(destination, ".sort");
+    gchar *tempfile = br_strcat(destination, ".order.temp");
+    gint64 sizes[2][2];
+    guint i, j, k;
+    
+    if(write_similarity_sort(source, sort_file, verbose) < 0)
+        die("Could not write the sort file, aborting");
+    for(i = 0; i < G_N_ELEMENTS(comps); i++){
+        sqfs_comp = comps[i];
+        for(j = 0; j < 2; j++){
+            GPtrArray *args = g_ptr_array_new();
+            struct stat st;
+            for(k = 0; k < extra_args->len; k++)
+                g_ptr_array_add(args, g_ptr_array_index(extra_args, k));
+            if(j == 1){
+                g_ptr_array_add(args, "-sort");
+                g_ptr_array_add(args, sort_file);
+            }
+            fprintf (stderr, "Generating squashfs with %s, %s...\n", comps[i], j ? "ordered by similarity" : "in directory order");
+            if(sfs_mksquashfs(source, tempfile, args) != 0 || stat(tempfile, &st) != 0){
+                unlink(tempfile);
+                unlink(sort_file);
+                die("sfs_mksquashfs error");
+            }
+            sizes[i][j] = st.st_size;
+            unlink(tempfile);
+            g_ptr_array_free(args, TRUE);
+        }
+    }
+    unlink(sort_file);
+    sqfs_comp = saved_comp;
+    
+    for(i = 0; i < G_N_ELEMENTS(comps); i++)
+        fprintf (stderr, "%-4s: %lld bytes in directory order, %lld bytes ordered by similarity (%+.2f%%)\n", comps[i],
+                 (long long) sizes[i][0], (long long) sizes[i][1],
+                 100.0 * (sizes[i][1] - sizes[i][0]) / sizes[i][0]);
+    exit(0);
+}
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_ATTRIB)
+
+/* Embed the blocks of the files of --startup-profile into the AppImage at
+* path. Returns -1 if the profile cannot be read or embedded. */
+static int embed_startup_profile(char *source, char *path, gchar *exec) {
+    GPtrArray *startup = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *in_image = g_ptr_array_new();
+    gint blocks = -1;
+    guint i;
+    
+    if(read_startup_files(source, startup_profile, exec, startup)){
+        for (i = 0; i < startup->len; i++){
+            const gchar *file = g_ptr_array_index(startup, i);
+            if (g_str_has_prefix(file, source) && file[strlen(source)] == '/')
+                g_ptr_array_add(in_image, (gpointer) (file + strlen(source) + 1));
+            else
+                fprintf (stderr, "WARNING: %s is not in %s, ignoring it\n", file, source);
+        }
+        blocks = write_startup_profile(path, in_image, verbose);
+        if(blocks >= 0)
+            fprintf (stderr, "Startup profile of %u files, %d blocks\n", in_image->len, blocks);
+    }
+    g_ptr_array_free(in_image, TRUE);
+    g_ptr_array_free(startup, TRUE);
+    return blocks < 0 ? -1 : 0;
+}
+
+/* The top-level entry of source that path is in, or NULL if path is source
+* itself. *is_entry tells whether path is that entry. */
+static gchar *top_level_entry(const char *source, const char *path, gboolean *is_entry) {
+    const char *rel = path + strlen(source);
+    const char *end;
+    
+    while (*rel == '/')
+        rel++;
+    if (*rel == '\0')
+        return NULL;
+    end = strchr(rel, '/');
+    *is_entry = end == NULL || end[strspn(end, "/")] == '\0';
+    return end == NULL ? g_strdup(rel) : g_strndup(rel, end - rel);
+}
+
+static void collect_name(gpointer key, gpointer value, gpointer names) {
+    g_ptr_array_add(names, g_strdup(key));
+}
+
+/* Append the new top-level entries names of source to the squashfs of the
+* AppImage at destination and write the result to newfile */
+static int append_appimage(char *source, char *destination, GPtrArray *names, GPtrArray *mksquashfs_args, char *newfile) {
+    unsigned long fs_offset = appimage_get_payload_offset(destination);
+    GPtrArray *sources = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *args = g_ptr_array_new();
+    gchar *tempfile = g_strconcat(newfile, ".temp", NULL);
+    guint i;
+    int result = -1;
+    
+    if (fs_offset != 0 && names_are_new(destination, fs_offset, names)) {
+        for (i = 0; i < names->len; i++)
+            g_ptr_array_add(sources, g_build_filename(source, g_ptr_array_index(names, i), NULL));
+        for (i = 0; mksquashfs_args != NULL && i < mksquashfs_args->len; i++)
+            g_ptr_array_add(args, g_ptr_array_index(mksquashfs_args, i));
+        /* A single directory would otherwise be merged into the root */
+        if (sources->len == 1)
+            g_ptr_array_add(args, "-keep-as-directory");
+        fprintf (stderr, "Appending %u new entries to the squashfs...\n", names->len);
+        if (append_squashfs(destination, fs_offset, sources, args, tempfile) == 0) {
+            int size = (int)&_binary_runtime_size;
+            char *data = (char *)&_binary_runtime_start;
+            result = assemble_appimage(tempfile, newfile, data, size);
+        }
+        unlink(tempfile);
+    }
+    g_free(tempfile);
+    g_ptr_array_free(args, TRUE);
+    g_ptr_array_free(sources, TRUE);
+    return result;
+}
+
+/* Wait for changes in source and regenerate the AppImage after each burst
+* of changes, using the same inotify machinery as appimaged. A burst that
+* only creates new top-level entries is appended to the squashfs, keeping
+* the compressed blocks of everything else; any other change compresses
+* the whole tree again. The startup profile, updateinformation and
+* signature are applied to each new AppImage as to the initial build. The
+* new AppImage is written next to destination and renamed over it, so
+* that an instance that is currently running is not affected. */
+void watch_and_regenerate(char *source, char *destination, GPtrArray *mksquashfs_args, gchar *exec) {
+    struct inotify_event *event;
+    gchar *newfile = g_strconcat(destination, ".new", NULL);
+    
+    if (!inotifytools_initialize())
+        die("inotifytools_initialize error");
+    if (!inotifytools_watch_recursively(source, WATCH_EVENTS)) {
+        fprintf(stderr, "%s\n", strerror(inotifytools_error()));
+        exit(1);
+    }
+    fprintf (stderr, "Watching %s for changes, press Ctrl+C to stop\n", source);
+    
+    while ((event = inotifytools_next_event(-1)) != NULL) {
+        int changes = 0;
+        /* Top-level entries created in this burst */
+        GHashTable *added = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        gboolean only_added = TRUE;
+        /* Editors and build systems change files in bursts,
+         * so keep collecting until things have settled down */
+        do {
+            do {
+                if (verbose)
+                    inotifytools_printf(event, "%w%f %e\n");
+                gchar *path = g_build_filename(inotifytools_filename_from_wd(event->wd), event->name, NULL);
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    /* New directories need watches of their own */
+                    inotifytools_watch_recursively(path, WATCH_EVENTS);
+                }
+                gboolean is_entry = FALSE;
+                gchar *entry = top_level_entry(source, path, &is_entry);
+                if (entry != NULL && is_entry && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    g_hash_table_insert(added, entry, GINT_TO_POINTER(1));
+                } else {
+                    if (entry == NULL || g_hash_table_lookup(added, entry) == NULL)
+                        only_added = FALSE;
+                    g_free(entry);
+                }
+                g_free(path);
+                changes++;
+            } while ((event = inotifytools_next_event(0)) != NULL);
+            g_usleep(200*1000);
+        } while ((event = inotifytools_next_event(0)) != NULL);
+        
+        /* The entries that are still there after the burst */
+        GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+        g_hash_table_foreach(added, collect_name, names);
+        g_hash_table_destroy(added);
+        guint i;
+        for (i = names->len; i > 0; i--) {
+            gchar *path = g_build_filename(source, g_ptr_array_index(names, i - 1), NULL);
+            struct stat st;
+            if (lstat(path, &st) != 0)
+                g_ptr_array_remove_index(names, i - 1);
+            g_free(path);
+        }
+        
+        gint64 start = g_get_monotonic_time();
+        fprintf (stderr, "%d change(s) in %s, regenerating...\n", changes, source);
+        int result = -1;
+        if (only_added && names->len > 0)
+            result = append_appimage(source, destination, names, mksquashfs_args, newfile);
+        g_ptr_array_free(names, TRUE);
+        if (result != 0)
+            result = generate_appimage(source, newfile, mksquashfs_args);
+        /* Before signing, as the digest covers the section */
+        if (result == 0 && startup_profile != NULL)
+            result = embed_startup_profile(source, newfile, exec);
+        if (result != 0) {
+            fprintf (stderr, "Could not regenerate the AppImage, waiting for further changes\n");
+            unlink(newfile);
+            continue;
+        }
+        if (updateinformation != NULL)
+            embed_updateinformation(newfile);
+        if (sign)
+            sign_appimage(newfile);
+        if (rename(newfile, destination) != 0) {
+            fprintf (stderr, "Could not replace %s: %s\n", destination, strerror(errno));
+            continue;
+        }
+        fprintf (stderr, "Regenerated %s in %.2f s\n", destination, (g_get_monotonic_time() - start) / 1000000.0);
+    }
+    g_free(newfile);
+}
+
 gchar* find_first_matching_file(const gchar *real_path, const gchar *pattern) {
     GDir *dir;
     gchar *full_name;
@@ -227,12 +1486,188 @@ static void replacestr(char *line, const char *search, const char *replace)
     }
 }
 
+/* What build_from_tar() learns about the AppDir while it streams past */
+struct tar_appdir {
+    int in;
+    GHashTable *toplevel;   /* Names of the entries at the top level */
+    gchar *desktop_name;
+    gchar *desktop_data;
+    gchar *arch;
+    GKeyFile *kf;
+    gchar *icon_file;
+};
+
+/* Architecture names as in the output of file(1), as the directory case uses */
+static gchar *arch_from_elf_head(const guint8 *head, guint len) {
+    guint16 machine;
+    if (len < sizeof(Elf32_Ehdr) || memcmp(head, ELFMAG, SELFMAG) != 0)
+        return NULL;
+    if (head[EI_DATA] == ELFDATA2MSB)
+        machine = (head[18] << 8) | head[19];
+    else
+        machine = head[18] | (head[19] << 8);
+    switch (machine) {
+        case EM_X86_64: return "x86_64";
+        case EM_386: return "Intel_80386";
+        case EM_ARM: return "ARM";
+        case EM_AARCH64: return "ARM_aarch64";
+    }
+    return NULL;
+}
+
+static void inspect_tar_entry(const struct tar_entry *entry, void *data) {
+    struct tar_appdir *appdir = data;
+    if (entry->path[0] == '\0' || strchr(entry->path, '/') != NULL) {
+        if (appdir->arch == NULL && entry->type == '0')
+            appdir->arch = arch_from_elf_head(entry->head->data, entry->head->len);
+        return;
+    }
+    g_hash_table_insert(appdir->toplevel, g_strdup(entry->path), GINT_TO_POINTER(1));
+    if (appdir->desktop_data == NULL && entry->type == '0' && g_str_has_suffix(entry->path, ".desktop")) {
+        appdir->desktop_name = g_strdup(entry->path);
+        appdir->desktop_data = g_strndup((gchar *) entry->head->data, entry->head->len);
+    }
+    if (appdir->arch == NULL && entry->type == '0')
+        appdir->arch = arch_from_elf_head(entry->head->data, entry->head->len);
+}
+
+/* Pass the tar archive on to mksquashfs, then check the AppDir it contained
+* the same way as a directory and add the .DirIcon symlink if it is missing */
+static int write_appdir_tar(int fd, void *data) {
+    struct tar_appdir *appdir = data;
+    const char *extensions[] = { "png", "svg", "svgz", "xpm" };
+    gchar *keys[] = { "Name", "Icon", "Exec" };
+    guint i;
+    
+    if (tar_passthrough(appdir->in, fd, inspect_tar_entry, appdir) != 0)
+        return(-1);
+    
+    if (appdir->desktop_data == NULL) {
+        fprintf (stderr, "$ID.desktop file not found\n");
+        return(-1);
+    }
+    if (verbose)
+        fprintf (stdout, "Desktop file: %s\n", appdir->desktop_name);
+    appdir->kf = g_key_file_new ();
+    if (!g_key_file_load_from_data (appdir->kf, appdir->desktop_data, strlen(appdir->desktop_data), 0, NULL)) {
+        fprintf (stderr, ".desktop file cannot be parsed\n");
+        return(-1);
+    }
+    /* Not get_desktop_entry(), mksquashfs is still waiting for the end of the archive */
+    for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+        gchar *value = g_key_file_get_string (appdir->kf, "Desktop Entry", keys[i], NULL);
+        if (value == NULL) {
+            fprintf (stderr, "%s entry not found in desktop file\n", keys[i]);
+            return(-1);
+        }
+        if (verbose)
+            fprintf (stderr, "%s: %s\n", keys[i], value);
+        g_free(value);
+    }
+    
+    gchar *icon_name = g_key_file_get_string (appdir->kf, "Desktop Entry", "Icon", NULL);
+    for (i = 0; i < G_N_ELEMENTS(extensions); i++) {
+        gchar *name = g_strdup_printf("%s.%s", icon_name, extensions[i]);
+        if (g_hash_table_lookup(appdir->toplevel, name) != NULL) {
+            g_free(appdir->icon_file);
+            appdir->icon_file = name;
+        } else {
+            g_free(name);
+        }
+    }
+    if (appdir->icon_file == NULL) {
+        fprintf (stderr, "%s{.png,.svg,.svgz,.xpm} not present but defined in desktop file\n", icon_name);
+        g_free(icon_name);
+        return(-1);
+    }
+    g_free(icon_name);
+    
+    if (g_hash_table_lookup(appdir->toplevel, ".DirIcon") == NULL) {
+        struct stat st;
+        fprintf (stderr, "Creating .DirIcon symlink based on information from desktop file\n");
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFLNK | 0777;
+        st.st_mtime = time(NULL);
+        if (tar_write_header(fd, ".DirIcon", &st, appdir->icon_file) != 0)
+            return(-1);
+    }
+    return tar_write_end(fd);
+}
+
+/* Package the AppDir in the tar archive read from input ("-" for stdin) as
+* an AppImage at destination, or at a name derived from the desktop file if
+* destination is NULL. The archive is streamed into mksquashfs, so the
+* AppDir never exists on disk. */
+void build_from_tar(char *input, char *destination) {
+    struct tar_appdir appdir;
+    
+    if (!mksquashfs_supports("-tar"))
+        die("mksquashfs 4.6 or newer, which can read tar archives, is required for --from-tar");
+    memset(&appdir, 0, sizeof(appdir));
+    appdir.toplevel = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if (strcmp(input, "-") == 0) {
+        appdir.in = 0;
+    } else if ((appdir.in = open(input, O_RDONLY)) < 0) {
+        die("Could not open the tar archive, aborting");
+    }
+    
+    /* The name of the AppImage depends on what is in the archive */
+    gchar *tempfile = destination ? g_strconcat(destination, ".temp", NULL) : g_strdup_printf(".appimagetool-%d.temp", (int) getpid());
+    gint64 start = g_get_monotonic_time();
+    fprintf (stderr, "Generating squashfs...\n");
+    if (sfs_mksquashfs_from_tar(tempfile, NULL, write_appdir_tar, &appdir) != 0) {
+        unlink(tempfile);
+        die("Could not generate the squashfs, aborting");
+    }
+    if (appdir.in != 0)
+        close(appdir.in);
+    
+    if (appdir.arch == NULL) {
+        printf("The architecture could not be determined, assuming 'all'\n");
+        appdir.arch = "all";
+    }
+    fprintf (stderr, "Arch: %s\n", appdir.arch);
+    if (destination == NULL) {
+        char *version_env = getenv("VERSION");
+        char app_name_for_filename[PATH_MAX];
+        char dest_path[PATH_MAX];
+        snprintf(app_name_for_filename, sizeof(app_name_for_filename), "%s", get_desktop_entry(appdir.kf, "Name"));
+        replacestr(app_name_for_filename, " ", "_");
+        if (version_env != NULL)
+            snprintf(dest_path, sizeof(dest_path), "%s-%s-%s.AppImage", app_name_for_filename, version_env, appdir.arch);
+        else
+            snprintf(dest_path, sizeof(dest_path), "%s-%s.AppImage", app_name_for_filename, appdir.arch);
+        replacestr(dest_path, " ", "_");
+        destination = g_strdup(dest_path);
+        fprintf (stdout, "DESTINATION not specified, so assuming %s\n", destination);
+    }
+    
+    int size = (int)&_binary_runtime_size;
+    char *data = (char *)&_binary_runtime_start;
+    if (assemble_appimage(tempfile, destination, data, size) != 0)
+        die("Could not generate the AppImage, aborting");
+    g_free(tempfile);
+    
+    if (updateinformation != NULL)
+        embed_updateinformation(destination);
+    if (sign)
+        sign_appimage(destination);
+    
+    struct stat st;
+    if (stat(destination, &st) == 0)
+        fprintf (stderr, "%s: %lld bytes, took %.2f s\n", destination, (long long) st.st_size,
+                 (g_get_monotonic_time() - start) / 1000000.0);
+    g_hash_table_destroy(appdir.toplevel);
+    fprintf (stderr, "Success\n");
+}
+
 // #####################################################################
 
 static GOptionEntry entries[] =
 {
     // { "repeats", 'r', 0, G_OPTION_ARG_INT, &repeats, "Average over N repetitions", "N" },
     { "list", 'l', 0, G_OPTION_ARG_NONE, &list, "List files in SOURCE AppImage", NULL },
+    { "check", 0, 0, G_OPTION_ARG_NONE, &check, "Decompress every block of the SOURCE AppImage and report corrupt ones", NULL },
     { "updateinformation", 'u', 0, G_OPTION_ARG_STRING, &updateinformation, "Embed update information STRING; if zsyncmake is installed, generate zsync file", NULL },
     { "bintray-user", NULL, 0, G_OPTION_ARG_STRING, &bintray_user, "Bintray user name", NULL },
     { "bintray-repo", NULL, 0, G_OPTION_ARG_STRING, &bintray_repo, "Bintray repository", NULL },
@@ -240,7 +1675,25 @@ static GOptionEntry entries[] =
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Produce verbose output", NULL },
     { "sign", 's', 0, G_OPTION_ARG_NONE, &sign, "Sign with gpg2", NULL },
     { "comp", NULL, 0, G_OPTION_ARG_STRING, &sqfs_comp, "Squashfs compression", NULL }, 
+    { "variant", 0, 0, G_OPTION_ARG_STRING_ARRAY, &variant_specs, "Instead of DESTINATION, generate DESTINATION-COMP.AppImage with this compression, block size and runtime; may be repeated, the AppDir is read once for all (once per block size with --group-small-files) and they are compressed side by side, at the pace of the slowest", "COMP[:BLOCKSIZE[:RUNTIME]]" },
+    { "block-size", 'b', 0, G_OPTION_ARG_STRING, &sqfs_block_size, "Squashfs block size, e.g. 128K or 1M", NULL },
     { "no-appstream", 'n', 0, G_OPTION_ARG_NONE, &no_appstream, "Do not check AppStream metadata", NULL },
+    { "strip", 0, 0, G_OPTION_ARG_NONE, &strip_elf, "Strip ELF files in SOURCE before packaging, keeping their debug information separately", NULL },
+    { "caches", 0, 0, G_OPTION_ARG_NONE, &precompute, "Generate gschemas.compiled, loaders.cache and Python bytecode in SOURCE before packaging", NULL },
+    { "hot", 0, 0, G_OPTION_ARG_FILENAME, &hot_set, "Store the files listed in FILE or read in a trace of --appimage-trace, or with 'auto' the ELF files loaded at startup, uncompressed for a faster start", "FILE" },
+    { "startup-profile", 0, 0, G_OPTION_ARG_FILENAME, &startup_profile, "Store the blocks of the files listed in FILE or read in a trace of --appimage-trace, or with 'auto' the ELF files loaded at startup, for the runtime to prefetch while the app starts", "FILE" },
+    { "uncompressed-elf", 0, 0, G_OPTION_ARG_NONE, &uncompressed_elf, "Store executables and shared libraries uncompressed, so that the runtime can read them straight from the image", NULL },
+    { "similarity-order", 0, 0, G_OPTION_ARG_NONE, &similarity_order, "Order the files in the image by type and similarity of their contents", NULL },
+    { "group-small-files", 0, 0, G_OPTION_ARG_NONE, &group_small_files, "Put small files of the same type next to each other, so that they compress together in fragment blocks", NULL },
+    { "compression-level", 0, 0, G_OPTION_ARG_INT, &compression_level, "Compression level of gzip (1-9) or zstd (1-22); higher levels make smaller images without slowing down decompression", "N" },
+    { "order-report", 0, 0, G_OPTION_ARG_NONE, &order_report, "Report the size gained by --similarity-order with xz and zstd for SOURCE and exit", NULL },
+    { "debug-dir", 0, 0, G_OPTION_ARG_STRING, &debug_dir, "Where --strip stores debug information (default: DESTINATION.debug)", NULL },
+    { "watch", 0, 0, G_OPTION_ARG_NONE, &watch, "Keep watching SOURCE and regenerate the AppImage whenever it changes", NULL },
+    { "unused-libs", 0, 0, G_OPTION_ARG_STRING, &unused_libs, "Find bundled libraries that nothing links against and 'report' or 'exclude' them", NULL },
+    { "delta", 0, 0, G_OPTION_ARG_NONE, &delta, "Write a binary delta between the AppImages SOURCE and DESTINATION (to DESTINATION.delta or a third argument)", NULL },
+    { "apply-delta", 0, 0, G_OPTION_ARG_FILENAME, &apply_delta, "Apply the delta FILE to the AppImage SOURCE, writing DESTINATION", "FILE" },
+    { "patch", 0, 0, G_OPTION_ARG_FILENAME, &patch_image, "Add or replace the files in directory SOURCE in the existing AppImage FILE (written to DESTINATION if given); new top-level entries are appended and the image is kept as it is, but replacing any file or adding one below an existing directory recompresses the whole image", "FILE" },
+    { "from-tar", 0, 0, G_OPTION_ARG_FILENAME, &from_tar, "Package the AppDir in the tar archive FILE (- for stdin) as DESTINATION, given as the only argument", "FILE" },
     { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &remaining_args, NULL },
     { NULL }
 };
@@ -285,8 +1738,10 @@ main (int argc, char *argv[])
         exit(0);
     }
 
-    if(!((0 == strcmp(sqfs_comp, "gzip")) || (0 ==strcmp(sqfs_comp, "xz"))))
-        die("Only gzip (faster execution, larger files) and xz (slower execution, smaller files) compression is supported at the moment. Let us know if there are reasons for more, should be easy to add. You could help the project by doing some systematic size/performance measurements. Watch for size, execution speed, and zsync delta size.");
+    if(compression_level != 0 && 0 == strcmp(sqfs_comp, "xz") && variant_specs == NULL)
+        die("--compression-level needs gzip or zstd compression");
+    if(!comp_supported(sqfs_comp))
+        die("Only gzip (faster execution, larger files), xz (slower execution, smaller files) and zstd (fast execution, small files) compression is supported at the moment. Let us know if there are reasons for more, should be easy to add. You could help the project by doing some systematic size/performance measurements. Watch for size, execution speed, and zsync delta size.");
     /* Check for dependencies here. Better fail early if they are not present. */
     if(! g_find_program_in_path ("mksquashfs"))
         die("mksquashfs is missing but required, please install it");
@@ -302,10 +1757,69 @@ main (int argc, char *argv[])
         g_print("WARNING: gpg2 is missing, please install it if you want to create digital signatures\n");
     if(! g_find_program_in_path ("sha256sum"))
         g_print("WARNING: sha256sum is missing, please install it if you want to create digital signatures\n");
+    if(strip_elf)
+        if(! g_find_program_in_path ("strip") || ! g_find_program_in_path ("objcopy"))
+            die("strip and objcopy are missing but required for --strip, please install binutils");
+    if(unused_libs != NULL)
+        if(!((0 == strcmp(unused_libs, "report")) || (0 == strcmp(unused_libs, "exclude"))))
+            die("--unused-libs must be either 'report' or 'exclude'");
+    if(variant_specs != NULL){
+        guint i;
+        for (i = 0; variant_specs[i] != NULL; i++){
+            gchar *comp = g_strndup(variant_specs[i], strcspn(variant_specs[i], ":"));
+            if(!comp_supported(comp))
+                die("--variant needs gzip, xz or zstd compression, optionally followed by :BLOCKSIZE and :RUNTIME");
+            g_free(comp);
+        }
+        if(watch)
+            die("--watch cannot be combined with --variant");
+        if(!mksquashfs_supports("-tar"))
+            die("mksquashfs 4.6 or newer, which can read tar archives, is required for --variant");
+    }
     
     if(!&remaining_args[0])
         die("SOURCE is missing");
     
+    /* If in delta mode */
+    if (delta){
+        if (remaining_args == NULL || remaining_args[0] == NULL || remaining_args[1] == NULL)
+            die("--delta needs the old and the new AppImage");
+        gchar *delta_file = remaining_args[2] ? remaining_args[2] : g_strconcat(remaining_args[1], ".delta", NULL);
+        if (delta_create(remaining_args[0], remaining_args[1], delta_file, verbose) != 0)
+            die("Could not generate the delta, aborting");
+        fprintf (stderr, "Delta written to %s\n", delta_file);
+        exit(0);
+    }
+    if (apply_delta != NULL){
+        if (remaining_args == NULL || remaining_args[0] == NULL || remaining_args[1] == NULL)
+            die("--apply-delta needs the old AppImage and where to write the new one");
+        if (delta_apply(apply_delta, remaining_args[0], remaining_args[1], verbose) != 0)
+            die("Could not apply the delta, aborting");
+        fprintf (stderr, "Success\n");
+        exit(0);
+    }
+    
+    /* If in check mode */
+    if (check){
+        if (remaining_args == NULL || remaining_args[0] == NULL)
+            die("--check needs the AppImage to check");
+        exit(check_appimage(remaining_args[0], verbose) == 0 ? 0 : 1);
+    }
+    
+    /* If in patch mode */
+    if (patch_image != NULL){
+        if (remaining_args == NULL || !g_file_test(remaining_args[0], G_FILE_TEST_IS_DIR))
+            die("--patch needs SOURCE to be a directory with the files to add or replace");
+        patch_appimage(patch_image, remaining_args[0], remaining_args[1] ? remaining_args[1] : patch_image);
+        exit(0);
+    }
+    
+    /* If building from a tar archive, there is no SOURCE */
+    if (from_tar != NULL){
+        build_from_tar(from_tar, remaining_args ? remaining_args[0] : NULL);
+        exit(0);
+    }
+    
     /* If in list mode */
     if (list){
         sfs_ls(remaining_args[0]);
@@ -473,53 +1987,98 @@ main (int argc, char *argv[])
             }
         }
         
-        /* mksquashfs can currently not start writing at an offset,
-        * so we need a tempfile. https://github.com/plougher/squashfs-tools/pull/13
-        * should hopefully change that. */
-        char *tempfile;
-        fprintf (stderr, "Generating squashfs...\n");
-        tempfile = br_strcat(destination, ".temp");
-        int result = sfs_mksquashfs(source, tempfile);
-        if(result != 0)
-            die("sfs_mksquashfs error");
+        /* Strip ELF files, the debug information goes next to the AppImage */
+        if(strip_elf){
+            if(debug_dir == NULL)
+                debug_dir = g_strconcat(destination, ".debug", NULL);
+            fprintf (stderr, "Stripping ELF files...\n");
+            if(strip_elf_files(source, debug_dir, verbose) < 0)
+                die("Could not strip all ELF files, aborting");
+        }
         
-        fprintf (stderr, "Generating AppImage...\n");
-        FILE *fpsrc = fopen(tempfile, "rb");
-        if (fpsrc == NULL) {
-            die("Not able to open the tempfile for reading, aborting");
+        /* Caches that the read-only mount would otherwise make every launch build */
+        if(precompute){
+            fprintf (stderr, "Precomputing caches...\n");
+            if(precompute_caches(source, verbose) < 0)
+                die("Could not precompute the caches, aborting");
         }
-        FILE *fpdst = fopen(destination, "w");
-        if (fpdst == NULL) {
-            die("Not able to open the destination file for writing, aborting");
+        
+        /* Libraries that nothing links against only inflate the image */
+        GPtrArray *mksquashfs_args = g_ptr_array_new();
+        gchar *exclude_file = NULL;
+        if(unused_libs != NULL){
+            GPtrArray *unused = g_ptr_array_new();
+            fprintf (stderr, "Looking for unused libraries...\n");
+            find_unused_libraries(source, get_desktop_entry(kf, "Exec"), unused, verbose);
+            if(0 == strcmp(unused_libs, "exclude") && unused->len > 0){
+                guint i;
+                GString *excludes = g_string_new(NULL);
+                for (i = 0; i < unused->len; i++)
+                    g_string_append_printf(excludes, "%s\n", (gchar *) g_ptr_array_index(unused, i));
+                exclude_file = br_strcat(destination, ".exclude");
+                if (!g_file_set_contents(exclude_file, excludes->str, excludes->len, NULL))
+                    die("Could not write the list of excluded files, aborting");
+                g_string_free(excludes, TRUE);
+                fprintf (stderr, "Excluding %u unused libraries and links to them\n", unused->len);
+                g_ptr_array_add(mksquashfs_args, "-ef");
+                g_ptr_array_add(mksquashfs_args, exclude_file);
+            }
         }
         
-        /* runtime is embedded into this executable
-        * http://stupefydeveloper.blogspot.de/2008/08/cc-embed-binary-data-into-elf.html */
-        int size = (int)&_binary_runtime_size;
-        char *data = (char *)&_binary_runtime_start;
-        if (verbose)
-            printf("Size of the embedded runtime: %d bytes\n", size);
-        fwrite(data, size, 1, fpdst);
-        fseek (fpdst, 0, SEEK_END);
-        char byte;
+        if(order_report)
+            report_order_gain(source, destination, mksquashfs_args);
         
-        while (!feof(fpsrc))
-        {
-            fread(&byte, sizeof(char), 1, fpsrc);
-            fwrite(&byte, sizeof(char), 1, fpdst);
+        gchar *action_file = NULL;
+        if(hot_set != NULL || uncompressed_elf){
+            if(!mksquashfs_supports("-action-file"))
+                die("mksquashfs 4.6 or newer, which supports actions, is required for --hot and --uncompressed-elf");
+            action_file = br_strcat(destination, ".actions");
+            if(write_uncompressed_actions(source, hot_set, get_desktop_entry(kf, "Exec"), uncompressed_elf, action_file) < 0)
+                die("Could not write the action file, aborting");
+            g_ptr_array_add(mksquashfs_args, "-action-file");
+            g_ptr_array_add(mksquashfs_args, action_file);
         }
         
-        fclose(fpsrc);
-        fclose(fpdst);
-        
-        fprintf (stderr, "Marking the AppImage as executable...\n");
-        if (chmod (destination, 0755) < 0) {
-            printf("Could not set executable bit, aborting\n");
-            exit(1);
+        /* squashfs has no place for a zstd dictionary, but fragment blocks are
+        * compressed as a whole: small files of one type that share a block
+        * compress against each other. Ordering all files by similarity
+        * does the same for the data blocks within a compressor's window. */
+        gchar *sort_file = NULL;
+        if(similarity_order || (group_small_files && variant_specs == NULL)){
+            sort_file = br_strcat(destination, ".sort");
+            if(similarity_order){
+                if(write_similarity_sort(source, sort_file, verbose) < 0)
+                    die("Could not write the sort file, aborting");
+            } else if(write_small_file_sort(source, sort_file, sqfs_block_bytes(sqfs_comp, sqfs_block_size), verbose) < 0) {
+                die("Could not write the sort file, aborting");
+            }
+            g_ptr_array_add(mksquashfs_args, "-sort");
+            g_ptr_array_add(mksquashfs_args, sort_file);
         }
-        if(unlink(tempfile) != 0) {
-            die("Could not delete the tempfile, aborting");
+        
+        /* The AppImages that get generated */
+        GPtrArray *outputs = g_ptr_array_new();
+        if(variant_specs != NULL){
+            GPtrArray *variants = g_ptr_array_new();
+            guint i;
+            for (i = 0; variant_specs[i] != NULL; i++){
+                struct variant *v = parse_variant(variant_specs[i], destination);
+                g_ptr_array_add(variants, v);
+                g_ptr_array_add(outputs, v->destination);
+            }
+            if(generate_variants(source, variants, mksquashfs_args) != 0)
+                die("Could not generate all variants of the AppImage, aborting");
+        } else {
+            g_ptr_array_add(outputs, destination);
+            if(generate_appimage(source, destination, mksquashfs_args) != 0)
+                die("Could not generate the AppImage, aborting");
         }
+        if(exclude_file != NULL && !watch)
+            unlink(exclude_file);
+        if(sort_file != NULL && !watch)
+            unlink(sort_file);
+        if(action_file != NULL && !watch)
+            unlink(action_file);
         
         if(bintray_user != NULL){
             if(bintray_repo != NULL){
@@ -530,141 +2089,38 @@ main (int argc, char *argv[])
             }
         }
         
-        /* If updateinformation was provided, then we check and embed it */
-        if(updateinformation != NULL){
-            if(!g_str_has_prefix(updateinformation,"zsync|"))
-                if(!g_str_has_prefix(updateinformation,"bintray-zsync|"))
-                    die("The provided updateinformation is not in a recognized format");
-                
-            gchar **ui_type = g_strsplit_set(updateinformation, "|", -1);
-                        
-            if(verbose)
-                printf("updateinformation type: %s\n", ui_type[0]);
-            /* TODO: Further checking of the updateinformation */
-
-            /* As a courtesy, we also generate the zsync file */
-            gchar *zsyncmake_path = g_find_program_in_path ("zsyncmake");
-            if(!zsyncmake_path){
-                fprintf (stderr, "zsyncmake is not installed, skipping\n");
-            } else {
-                fprintf (stderr, "zsyncmake is installed and updateinformation is provided, "
-                "hence generating zsync file\n");
-                sprintf (command, "%s %s -u %s", zsyncmake_path, destination, basename(destination));
-                fp = popen(command, "r");
-                if (fp == NULL)
-                    die("Failed to run zsyncmake command");            
-            }
-            
-            unsigned long ui_offset = 0;
-            unsigned long ui_length = 0;
-            get_elf_section_offset_and_lenghth(destination, ".upd_info", &ui_offset, &ui_length);
-            if(verbose)
-                printf("ui_offset: %lu\n", ui_offset);
-            if(verbose)
-                printf("ui_length: %lu\n", ui_length);
-            if(ui_offset == 0) {
-                die("Could not determine offset for updateinformation");
-            } else {
-                if(strlen(updateinformation)>ui_length)
-                    die("updateinformation does not fit into segment, aborting");
-                FILE *fpdst2 = fopen(destination, "r+");
-                if (fpdst2 == NULL)
-                    die("Not able to open the destination file for writing, aborting");
-                fseek(fpdst2, ui_offset, SEEK_SET);
-                // fseek(fpdst2, ui_offset, SEEK_SET);
-                // fwrite(0x00, 1, 1024, fpdst); // FIXME: Segfaults; why?
-                // fseek(fpdst, ui_offset, SEEK_SET);
-                fwrite(updateinformation, strlen(updateinformation), 1, fpdst2);
-                fclose(fpdst2);
+        /* Before signing, as the digest covers the section */
+        if(startup_profile != NULL){
+            guint i;
+            for (i = 0; i < outputs->len; i++){
+                if(embed_startup_profile(source, g_ptr_array_index(outputs, i), get_desktop_entry(kf, "Exec")) != 0)
+                    die("Could not embed the startup profile, aborting");
             }
         }
+        
+        guint output;
+        for (output = 0; output < outputs->len; output++){
+            /* If updateinformation was provided, then we check and embed it */
+            if(updateinformation != NULL)
+                embed_updateinformation(g_ptr_array_index(outputs, output));
 
-        if(sign != NULL){
-            /* The user has indicated that he wants to sign */
-            gchar *gpg2_path = g_find_program_in_path ("gpg2");
-            gchar *sha256sum_path = g_find_program_in_path ("sha256sum");
-            if(!gpg2_path){
-                fprintf (stderr, "gpg2 is not installed, cannot sign\n");
-            }
-            else if(!sha256sum_path){
-                fprintf (stderr, "sha256sum is not installed, cannot sign\n");
-            } else {
-                fprintf (stderr, "gpg2 and sha256sum are installed and user requested to sign, "
-                "hence signing\n");
-                char *digestfile;
-                digestfile = br_strcat(destination, ".digest");
-                char *ascfile;
-                ascfile = br_strcat(destination, ".digest.asc");
-                if (g_file_test (digestfile, G_FILE_TEST_IS_REGULAR))
-                    unlink(digestfile);
-                sprintf (command, "%s %s", sha256sum_path, destination);
-                if(verbose)
-                    fprintf (stderr, "%s\n", command);
-                fp = popen(command, "r");
-                if (fp == NULL)
-                    die("sha256sum command did not succeed");
-                char output[1024];
-                fgets(output, sizeof(output)-1, fp);
-                if(verbose)
-                    printf("sha256sum: %s\n", g_strsplit_set(output, " ", -1)[0]);
-                FILE *fpx = fopen(digestfile, "w");
-                if (fpx != NULL)
-                {
-                    fputs(g_strsplit_set(output, " ", -1)[0], fpx);
-                    fclose(fpx);
-                }
-                if(WEXITSTATUS(pclose(fp)) != 0)
-                    die("sha256sum command did not succeed");
-                if (g_file_test (ascfile, G_FILE_TEST_IS_REGULAR))
-                    unlink(ascfile);
-                sprintf (command, "%s --detach-sign --armor %s", gpg2_path, digestfile);
-                if(verbose)
-                    fprintf (stderr, "%s\n", command);
-                fp = popen(command, "r");
-                if(WEXITSTATUS(pclose(fp)) != 0)
-                    die("gpg2 command did not succeed");
-                unsigned long sig_offset = 0;
-                unsigned long sig_length = 0;
-                get_elf_section_offset_and_lenghth(destination, ".sha256_sig", &sig_offset, &sig_length);
-                if(verbose)
-                    printf("sig_offset: %lu\n", sig_offset);
-                if(verbose)
-                    printf("sig_length: %lu\n", sig_length);
-                if(sig_offset == 0) {
-                    die("Could not determine offset for signature");
-                } else {
-                    FILE *fpdst3 = fopen(destination, "r+");
-                    if (fpdst3 == NULL)
-                        die("Not able to open the destination file for writing, aborting");
-//                    if(strlen(updateinformation)>sig_length)
-//                        die("signature does not fit into segment, aborting");
-                    fseek(fpdst3, sig_offset, SEEK_SET);
-                    FILE *fpsrc2 = fopen(ascfile, "rb");
-                    if (fpsrc2 == NULL) {
-                        die("Not able to open the asc file for reading, aborting");
-                    }
-                    char byte;
-                    while (!feof(fpsrc2))
-                    {
-                        fread(&byte, sizeof(char), 1, fpsrc2);
-                        fwrite(&byte, sizeof(char), 1, fpdst3);
-                    }
-                    fclose(fpsrc2);
-                    fclose(fpdst3);
-                }
-                if (g_file_test (ascfile, G_FILE_TEST_IS_REGULAR))
-                    unlink(ascfile);
-                if (g_file_test (digestfile, G_FILE_TEST_IS_REGULAR))
-                    unlink(digestfile);
-            }
-        }     
+            if(sign)
+                sign_appimage(g_ptr_array_index(outputs, output));
+        }
         fprintf (stderr, "Success\n");
+        
+        if(watch)
+            watch_and_regenerate(source, destination, mksquashfs_args, get_desktop_entry(kf, "Exec"));
         }
     
     /* If the first argument is a regular file, then we assume that we should unpack it */
     if (g_file_test (remaining_args[0], G_FILE_TEST_IS_REGULAR)){
-        fprintf (stdout, "%s is a file, assuming it is an AppImage and should be unpacked\n", remaining_args[0]);
-        die("To be implemented");
+        if (remaining_args[1] == NULL) {
+            fprintf (stdout, "%s is a file, assuming it is an AppImage and should be unpacked\n", remaining_args[0]);
+            die("To be implemented");
+        }
+        /* With a DESTINATION, we repack it with the requested compression */
+        repack_appimage(remaining_args[0], remaining_args[1]);
     }
     
     return 0;    
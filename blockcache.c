@@ -0,0 +1,428 @@
+/*
+ * 2Q cache of decompressed squashfs blocks, see blockcache.h
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "squashfuse.h"
+#include "blockcache.h"
+
+#include "ylog/ylog.h"
+
+#define CACHE_DEFAULT_SIZE (64 << 20)
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024      /* Per shard */
+
+/* Share of the budget of a shard for blocks that were read once */
+#define CACHE_IN_PERCENT 25
+
+/* Positions of evicted blocks remembered per shard, at least this many
+ * and otherwise as many as there are blocks cached in the shard */
+#define CACHE_MIN_GHOSTS 16
+
+enum entry_list { LIST_NONE, LIST_IN, LIST_MAIN, LIST_GHOST };
+
+struct cache_entry {
+    sqfs_off_t pos;
+    sqfs_block *block;          /* NULL for ghosts */
+    size_t size;
+    int refs;                   /* The shard's, while listed, and pins */
+    enum entry_list list;
+    struct cache_entry *hash_next;
+    struct cache_entry *prev, *next;
+};
+
+struct cache_list {
+    struct cache_entry *head, *tail;   /* Most recent first */
+    size_t count;
+    size_t bytes;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_list in, main, ghosts;
+    size_t budget;
+    struct blockcache_stats stats;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t cache_size;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* The block last handed to this thread. squashfuse copies out of a block
+ * before it asks for the next one, so it only has to stay alive until
+ * then, even if it was evicted in between. */
+static __thread struct cache_entry *pinned;
+
+/* Lookups of this thread, for the trace of the request it handles */
+static __thread uint64_t thread_hits, thread_misses;
+
+sqfs_err __real_sqfs_data_cache(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos, uint32_t hdr, sqfs_block **block);
+
+static size_t parse_size(const char *value)
+{
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; /* fall through */
+    case 'M': case 'm': size <<= 10; /* fall through */
+    case 'K': case 'k': size <<= 10; break;
+    case '\0': break;
+    default:
+        ywarn("Ignoring APPIMAGE_BLOCK_CACHE_SIZE=%s", value);
+        return CACHE_DEFAULT_SIZE;
+    }
+    return size;
+}
+
+static void write_stats(void)
+{
+    const char *path = getenv("APPIMAGE_BLOCK_CACHE_STATS");
+    struct blockcache_stats stats;
+    FILE *f;
+
+    if (path == NULL || (f = fopen(path, "w")) == NULL)
+        return;
+    blockcache_get_stats(&stats);
+    fprintf(f, "hits %llu\nmisses %llu\npromotions %llu\nevictions %llu\nbytes %llu\n",
+            (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+            (unsigned long long) stats.promotions, (unsigned long long) stats.evictions,
+            (unsigned long long) stats.bytes);
+    fclose(f);
+}
+
+static void cache_init(void)
+{
+    const char *env = getenv("APPIMAGE_BLOCK_CACHE_SIZE");
+    int i;
+
+    cache_size = env != NULL ? parse_size(env) : CACHE_DEFAULT_SIZE;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].budget = cache_size / CACHE_SHARDS;
+    }
+    atexit(write_stats);
+}
+
+static struct cache_shard *shard_of(sqfs_off_t pos, size_t *bucket)
+{
+    uint64_t hash = (uint64_t) pos * 0x9e3779b97f4a7c15ULL;
+    *bucket = (hash >> 32) % CACHE_BUCKETS;
+    return &shards[hash >> 60];
+}
+
+static void list_remove(struct cache_list *list, struct cache_entry *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        list->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        list->tail = entry->prev;
+    list->count--;
+    list->bytes -= entry->size;
+    entry->prev = entry->next = NULL;
+}
+
+static void list_push(struct cache_list *list, struct cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = entry;
+    else
+        list->tail = entry;
+    list->head = entry;
+    list->count++;
+    list->bytes += entry->size;
+}
+
+static struct cache_list *list_of(struct cache_shard *shard, struct cache_entry *entry)
+{
+    switch (entry->list) {
+    case LIST_IN: return &shard->in;
+    case LIST_MAIN: return &shard->main;
+    case LIST_GHOST: return &shard->ghosts;
+    default: return NULL;
+    }
+}
+
+static void move_to(struct cache_shard *shard, struct cache_entry *entry, enum entry_list list)
+{
+    if (entry->list != LIST_NONE)
+        list_remove(list_of(shard, entry), entry);
+    entry->list = list;
+    if (list != LIST_NONE)
+        list_push(list_of(shard, entry), entry);
+}
+
+static void entry_release(struct cache_entry *entry)
+{
+    if (--entry->refs > 0)
+        return;
+    if (entry->block != NULL)
+        sqfs_block_dispose(entry->block);
+    free(entry);
+}
+
+static struct cache_entry *hash_find(struct cache_shard *shard, size_t bucket, sqfs_off_t pos)
+{
+    struct cache_entry *entry;
+    for (entry = shard->buckets[bucket]; entry != NULL; entry = entry->hash_next)
+        if (entry->pos == pos)
+            return entry;
+    return NULL;
+}
+
+static void hash_remove(struct cache_shard *shard, struct cache_entry *entry)
+{
+    size_t bucket;
+    struct cache_entry **link;
+
+    shard_of(entry->pos, &bucket);
+    for (link = &shard->buckets[bucket]; *link != NULL; link = &(*link)->hash_next) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+    }
+}
+
+static void forget_ghost(struct cache_shard *shard, struct cache_entry *ghost)
+{
+    hash_remove(shard, ghost);
+    move_to(shard, ghost, LIST_NONE);
+    entry_release(ghost);
+}
+
+/* Drop the block of an entry and keep its position as a ghost. A pinned
+ * block stays alive in an entry of its own until it is unpinned. */
+static void evict_to_ghost(struct cache_shard *shard, struct cache_entry *entry)
+{
+    shard->stats.evictions++;
+    shard->stats.bytes -= entry->size;
+    move_to(shard, entry, LIST_NONE);
+    if (entry->refs > 1) {
+        struct cache_entry *ghost;
+        size_t bucket;
+        hash_remove(shard, entry);
+        entry_release(entry);
+        ghost = calloc(1, sizeof(*ghost));
+        if (ghost == NULL)
+            return;
+        ghost->pos = entry->pos;
+        ghost->refs = 1;
+        shard_of(ghost->pos, &bucket);
+        ghost->hash_next = shard->buckets[bucket];
+        shard->buckets[bucket] = ghost;
+        entry = ghost;
+    } else {
+        sqfs_block_dispose(entry->block);
+        entry->block = NULL;
+        entry->size = 0;
+    }
+    move_to(shard, entry, LIST_GHOST);
+    while (shard->ghosts.count > CACHE_MIN_GHOSTS
+           && shard->ghosts.count > shard->in.count + shard->main.count)
+        forget_ghost(shard, shard->ghosts.tail);
+}
+
+/* Make room for bytes more: blocks read once go first as long as they
+ * take more than their share */
+static void make_room(struct cache_shard *shard, size_t bytes)
+{
+    size_t in_budget = shard->budget / 100 * CACHE_IN_PERCENT;
+
+    while (shard->in.bytes + shard->main.bytes + bytes > shard->budget) {
+        if (shard->in.tail != NULL && (shard->in.bytes > in_budget || shard->main.tail == NULL))
+            evict_to_ghost(shard, shard->in.tail);
+        else if (shard->main.tail != NULL)
+            evict_to_ghost(shard, shard->main.tail);
+        else
+            break;
+    }
+}
+
+static void pin(struct cache_entry *entry)
+{
+    entry->refs++;
+    pinned = entry;
+}
+
+static void unpin(void)
+{
+    struct cache_entry *entry = pinned;
+    struct cache_shard *shard;
+    size_t bucket;
+
+    if (entry == NULL)
+        return;
+    pinned = NULL;
+    shard = shard_of(entry->pos, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    entry_release(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Add a block that was read without holding the lock, unless another
+ * thread was faster. Blocks read before go to the main list, as do the
+ * ones with ghost set. Returns the entry, or NULL if out of memory. */
+static struct cache_entry *insert(struct cache_shard *shard, size_t bucket, sqfs_off_t pos,
+                                  sqfs_block *read, enum entry_list list)
+{
+    struct cache_entry *entry = hash_find(shard, bucket, pos);
+
+    if (entry != NULL && entry->block != NULL) {
+        sqfs_block_dispose(read);
+        return entry;
+    }
+    if (entry != NULL) {
+        /* Read again after it was evicted, so it is worth keeping */
+        shard->stats.promotions++;
+        list = LIST_MAIN;
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL) {
+            sqfs_block_dispose(read);
+            return NULL;
+        }
+        entry->pos = pos;
+        entry->refs = 1;
+        entry->hash_next = shard->buckets[bucket];
+        shard->buckets[bucket] = entry;
+    }
+    /* Not in a list while making room, so that it is not evicted */
+    move_to(shard, entry, LIST_NONE);
+    make_room(shard, read->size);
+    entry->block = read;
+    entry->size = read->size;
+    shard->stats.bytes += entry->size;
+    move_to(shard, entry, list);
+    return entry;
+}
+
+sqfs_err __wrap_sqfs_data_cache(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos, uint32_t hdr, sqfs_block **block)
+{
+    struct cache_shard *shard;
+    struct cache_entry *entry;
+    sqfs_block *read;
+    size_t bucket;
+    sqfs_err err;
+
+    pthread_once(&cache_once, cache_init);
+    if (cache_size == 0)
+        return __real_sqfs_data_cache(fs, cache, pos, hdr, block);
+    unpin();
+
+    shard = shard_of(pos, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    entry = hash_find(shard, bucket, pos);
+    if (entry != NULL && entry->block != NULL) {
+        shard->stats.hits++;
+        thread_hits++;
+        if (entry->list == LIST_MAIN)
+            move_to(shard, entry, LIST_MAIN);
+        pin(entry);
+        *block = entry->block;
+        pthread_mutex_unlock(&shard->lock);
+        return SQFS_OK;
+    }
+    shard->stats.misses++;
+    thread_misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Decompress without holding the lock */
+    err = sqfs_data_block_read(fs, pos, hdr, &read);
+    if (err)
+        return err;
+
+    if (read->size > shard->budget) {
+        /* Too large to cache, pin it on its own */
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL) {
+            sqfs_block_dispose(read);
+            return SQFS_ERR;
+        }
+        entry->pos = pos;
+        entry->block = read;
+        pin(entry);
+        *block = read;
+        return SQFS_OK;
+    }
+    pthread_mutex_lock(&shard->lock);
+    entry = insert(shard, bucket, pos, read, LIST_IN);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return SQFS_ERR;
+    }
+    pin(entry);
+    *block = entry->block;
+    pthread_mutex_unlock(&shard->lock);
+    return SQFS_OK;
+}
+
+int blockcache_prefetch(sqfs *fs, sqfs_off_t pos, uint32_t hdr)
+{
+    struct cache_shard *shard;
+    struct cache_entry *entry;
+    sqfs_block *read;
+    size_t bucket;
+    int full;
+
+    pthread_once(&cache_once, cache_init);
+    if (cache_size == 0)
+        return 1;
+    shard = shard_of(pos, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    entry = hash_find(shard, bucket, pos);
+    full = shard->in.bytes + shard->main.bytes + fs->sb.block_size > shard->budget;
+    pthread_mutex_unlock(&shard->lock);
+    if (entry != NULL && entry->block != NULL)
+        return 0;
+    /* Prefetching must not push out what the app already uses */
+    if (full)
+        return 1;
+
+    if (sqfs_data_block_read(fs, pos, hdr, &read) != SQFS_OK)
+        return -1;
+    pthread_mutex_lock(&shard->lock);
+    /* The app may have filled the shard while the block was read */
+    entry = hash_find(shard, bucket, pos);
+    if ((entry == NULL || entry->block == NULL)
+        && shard->in.bytes + shard->main.bytes + read->size > shard->budget) {
+        pthread_mutex_unlock(&shard->lock);
+        sqfs_block_dispose(read);
+        return 1;
+    }
+    entry = insert(shard, bucket, pos, read, LIST_MAIN);
+    pthread_mutex_unlock(&shard->lock);
+    return entry != NULL ? 0 : -1;
+}
+
+void blockcache_get_stats(struct blockcache_stats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->hits += shards[i].stats.hits;
+        stats->misses += shards[i].stats.misses;
+        stats->promotions += shards[i].stats.promotions;
+        stats->evictions += shards[i].stats.evictions;
+        stats->bytes += shards[i].stats.bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+void blockcache_thread_counts(uint64_t *hits, uint64_t *misses)
+{
+    *hits = thread_hits;
+    *misses = thread_misses;
+}
@@ -0,0 +1,45 @@
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include <stdint.h>
+
+#include "squashfuse.h"
+
+/* Cache of decompressed data and fragment blocks shared by all squashfs
+ * handles of the runtime.
+ *
+ * squashfuse keeps a few blocks per handle, so an app that rereads its
+ * assets decompresses them again and again. The runtime is linked with
+ * -Wl,--wrap=sqfs_data_cache, which sends the block lookups of
+ * sqfs_read_range() here instead. The cache follows 2Q: blocks read once
+ * pass through a small FIFO, and only blocks that are read again after
+ * leaving it, which a list of recently evicted positions remembers, enter
+ * the main LRU list. A scan through a large file therefore cannot push out
+ * the blocks that are used over and over.
+ *
+ * APPIMAGE_BLOCK_CACHE_SIZE sets the budget in bytes (K, M and G suffixes
+ * are accepted); 0 leaves caching to squashfuse. The cache is split into
+ * shards by block position, each with a lock of its own. If
+ * APPIMAGE_BLOCK_CACHE_STATS names a file, the counters are written to it
+ * when the process exits. */
+
+struct blockcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t promotions;    /* Misses on recently evicted blocks */
+    uint64_t evictions;
+    uint64_t bytes;         /* Currently cached */
+};
+
+/* Read the block at pos with the given header into the cache unless it
+ * is there already. Returns 0 if it is cached, 1 if there is no room left
+ * for it without evicting other blocks and -1 if it cannot be read. */
+int blockcache_prefetch(sqfs *fs, sqfs_off_t pos, uint32_t hdr);
+
+/* Sum the counters of all shards into stats */
+void blockcache_get_stats(struct blockcache_stats *stats);
+
+/* The hits and misses of the lookups made by the calling thread so far */
+void blockcache_thread_counts(uint64_t *hits, uint64_t *misses);
+
+#endif /* __BLOCKCACHE_H__ */
@@ -49,7 +49,7 @@ if [ ! -e ./Makefile ] ; then
   autoreconf -fi || true # Errors out, but the following succeeds then?
   autoconf
   sed -i '/PKG_CHECK_MODULES.*/,/,:./d' configure # https://github.com/vasi/squashfuse/issues/12
-  ./configure --disable-demo --disable-high-level --without-lzo --without-lz4 --with-xz=/usr/lib/
+  ./configure --disable-demo --disable-high-level --without-lzo --without-lz4 --with-xz=/usr/lib/ --with-zstd
 fi
 
 bash --version
@@ -64,6 +64,11 @@ cd build
 # Compile runtime but do not link
 
 cc -DVERSION_NUMBER=\"$(git describe --tags --always --abbrev=7)\" -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../runtime.c
+cc -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../fusefs.c
+cc -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../extract.c
+cc -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../blockcache.c
+cc -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../prefetch.c
+cc -I../squashfuse/ -D_FILE_OFFSET_BITS=64 -g -Os -c ../trace.c
 
 # Prepare 1024 bytes of space for updateinformation
 printf '\0%.0s' {0..1023} > 1024_blank_bytes
@@ -74,11 +79,23 @@ objcopy --add-section .upd_info=1024_blank_bytes \
 objcopy --add-section .sha256_sig=1024_blank_bytes \
           --set-section-flags .sha256_sig=noload,readonly runtime2.o runtime3.o
 
+# Prepare 16384 bytes of space for the startup profile
+printf '\0%.0s' {0..16383} > 16384_blank_bytes
+
+objcopy --add-section .prefetch=16384_blank_bytes \
+          --set-section-flags .prefetch=noload,readonly runtime3.o runtime4.o
+
 # Now statically link against libsquashfuse_ll, libsquashfuse and liblzma
-# and embed .upd_info and .sha256_sig sections
-cc ../elf.c ../notify.c ../getsection.c runtime3.o ../squashfuse/.libs/libsquashfuse_ll.a ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -Wl,-Bdynamic -lfuse -lpthread -lz -Wl,-Bstatic -llzma -Wl,-Bdynamic -ldl -o runtime
+# and embed .upd_info, .sha256_sig and .prefetch sections
+cc ../elf.c ../notify.c ../getsection.c ../aiheader.c runtime4.o fusefs.o extract.o blockcache.o prefetch.o trace.o ../extractcache.c ../md5.c ../parallel.c ../squashfuse/.libs/libsquashfuse_ll.a ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -Wl,-Bdynamic -lfuse -lpthread -lz -Wl,-Bstatic -llzma -lzstd -Wl,-Bdynamic -ldl -Wl,--wrap=fuse_lowlevel_new -Wl,--wrap=fuse_session_loop -Wl,--wrap=sqfs_data_cache -Wl,--wrap=fuse_reply_entry -Wl,--wrap=fuse_reply_err -Wl,--wrap=fuse_reply_buf -Wl,--wrap=fuse_reply_data -o runtime
 strip runtime
 
+# The runtime has to fit in front of the AppImage header, see aiheader.h
+if [ $(stat -c %s runtime) -gt $((240*1024)) ] ; then
+  echo "The runtime is larger than 240 KiB and does not fit in front of the AppImage header" >&2
+  exit 1
+fi
+
 # Test if we can read it back
 readelf -x .upd_info runtime # hexdump
 readelf -p .upd_info runtime || true # string
@@ -98,13 +115,13 @@ ld -r -b binary -o data.o runtime
 
 # Compile and link digest tool
 
-cc -o digest ../getsection.c ../digest.c -lssl -lcrypto
+cc -o digest ../elf.c ../getsection.c ../aiheader.c ../digest.c -lssl -lcrypto
 # cc -o digest -Wl,-Bdynamic ../digest.c -Wl,-Bstatic -static  -lcrypto -Wl,-Bdynamic -ldl # 1.4 MB
 strip digest
 
 # Compile and link validate tool
 
-cc -o validate ../getsection.c ../validate.c -lssl -lcrypto -lglib-2.0 $(pkg-config --cflags glib-2.0)
+cc -o validate ../elf.c ../getsection.c ../aiheader.c ../validate.c -lssl -lcrypto -lglib-2.0 $(pkg-config --cflags glib-2.0)
 strip validate
 
 # Test if we can read it back
@@ -126,14 +143,14 @@ cc -DVERSION_NUMBER=\"$(git describe --tags --always --abbrev=7)\" -D_FILE_OFFSE
 
 # Now statically link against libsquashfuse and liblzma - glib version
 
-cc data.o appimagetool.o ../elf.c ../getsection.c -DENABLE_BINRELOC ../binreloc.c ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -Wl,-Bdynamic -lfuse -lpthread -lglib-2.0 $(pkg-config --cflags glib-2.0) -lz -Wl,-Bstatic -llzma -Wl,-Bdynamic -o appimagetool # liblz4
+cc data.o appimagetool.o ../elf.c ../getsection.c ../aiheader.c ../parallel.c ../elfinfo.c ../elfstrip.c ../elfdeps.c ../caches.c ../sortfile.c ../tarstream.c ../delta.c ../check.c ../profile.c -D_FILE_OFFSET_BITS=64 -I../squashfuse/ -DENABLE_BINRELOC ../binreloc.c ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -Wl,-Bdynamic -lfuse -lpthread -lglib-2.0 $(pkg-config --cflags glib-2.0) -lz -Wl,-Bstatic -llzma -lzstd -linotifytools -Wl,-Bdynamic -o appimagetool # liblz4
 
 # Version without glib
 # cc -D_FILE_OFFSET_BITS=64 -I ../squashfuse -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -g -Os -c ../appimagetoolnoglib.c
 # cc data.o appimagetoolnoglib.o -DENABLE_BINRELOC ../binreloc.c ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -Wl,-Bdynamic -lfuse -lpthread -lz -Wl,-Bstatic -llzma -Wl,-Bdynamic -o appimagetoolnoglib
 
 # appimaged, an optional component
-cc -std=gnu99 ../getsection.c -Wl,-Bdynamic -DVERSION_NUMBER=\"$(git describe --tags --always --abbrev=7)\" ../elf.c ../appimaged.c ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -I../squashfuse/ -Wl,-Bstatic -linotifytools -Wl,-Bdynamic $(pkg-config --cflags --libs glib-2.0) $(pkg-config --cflags gio-2.0) $(pkg-config --libs gio-2.0) -ldl -lpthread -lz -Wl,-Bstatic -llzma -Wl,-Bdynamic -o appimaged # liblz4
+cc -std=gnu99 ../getsection.c -Wl,-Bdynamic -DVERSION_NUMBER=\"$(git describe --tags --always --abbrev=7)\" ../elf.c ../aiheader.c ../appimaged.c ../squashfuse/.libs/libsquashfuse.a ../squashfuse/.libs/libfuseprivate.a -I../squashfuse/ -Wl,-Bstatic -linotifytools -Wl,-Bdynamic $(pkg-config --cflags --libs glib-2.0) $(pkg-config --cflags gio-2.0) $(pkg-config --libs gio-2.0) -ldl -lpthread -lz -Wl,-Bstatic -llzma -lzstd -Wl,-Bdynamic -o appimaged # liblz4
 
 # AppRun
 cc ../AppRun.c -o AppRun
@@ -142,7 +159,7 @@ cd ..
 
 # Strip and check size and dependencies
 
-rm build/*.o build/1024_blank_bytes
+rm build/*.o build/1024_blank_bytes build/16384_blank_bytes
 strip build/* 2>/dev/null
 chmod a+x build/*
 ls -lh build/*
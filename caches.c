@@ -0,0 +1,318 @@
+/*
+ * Precompute the caches that applications would otherwise build on first
+ * launch, when the AppDir is mounted read-only over FUSE
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "caches.h"
+
+/* Run a command synchronously; optionally return what it printed on stdout,
+ * and on failure, its error output */
+static gboolean run_tool(gchar **argv, gchar **output, gchar **error_message)
+{
+    GError *error = NULL;
+    gchar *stderr_buf = NULL;
+    gint exit_status = 0;
+    GSpawnFlags flags = G_SPAWN_SEARCH_PATH;
+
+    if (output == NULL)
+        flags |= G_SPAWN_STDOUT_TO_DEV_NULL;
+    if (!g_spawn_sync(NULL, argv, NULL, flags, NULL, NULL, output, &stderr_buf, &exit_status, &error)) {
+        *error_message = g_strdup_printf("%s: %s", argv[0], error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    if (!WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0) {
+        *error_message = g_strdup_printf("%s failed: %s", argv[0], g_strstrip(stderr_buf));
+        g_free(stderr_buf);
+        if (output != NULL) {
+            g_free(*output);
+            *output = NULL;
+        }
+        return FALSE;
+    }
+    g_free(stderr_buf);
+    return TRUE;
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Names in dir that end with suffix, sorted so that the output is stable */
+static GPtrArray *list_files(const gchar *dir, const gchar *suffix)
+{
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    const gchar *entry;
+    GDir *d = g_dir_open(dir, 0, NULL);
+
+    if (d == NULL)
+        return files;
+    while ((entry = g_dir_read_name(d)) != NULL)
+        if (g_str_has_suffix(entry, suffix))
+            g_ptr_array_add(files, g_build_filename(dir, entry, NULL));
+    g_dir_close(d);
+    g_ptr_array_sort(files, compare_paths);
+    return files;
+}
+
+/* GLib reads gschemas.compiled from GSETTINGS_SCHEMA_DIR, which AppRun points
+ * into the AppDir; without it, the schemas there are not usable at all */
+static int compile_schemas(const gchar *appdir, gboolean verbose)
+{
+    gchar *dir = g_build_filename(appdir, "usr/share/glib-2.0/schemas", NULL);
+    GPtrArray *schemas = list_files(dir, ".gschema.xml");
+    gchar *error = NULL;
+    int ret = 0;
+
+    if (schemas->len > 0) {
+        gchar *argv[] = { "glib-compile-schemas", dir, NULL };
+        if (!g_find_program_in_path(argv[0])) {
+            fprintf(stderr, "Skipping gschemas.compiled: glib-compile-schemas is missing\n");
+        } else if (!run_tool(argv, NULL, &error)) {
+            fprintf(stderr, "Could not compile the GSettings schemas: %s\n", error);
+            ret = -1;
+        } else {
+            fprintf(stderr, "Precomputed usr/share/glib-2.0/schemas/gschemas.compiled from %u schemas\n", schemas->len);
+            ret = 1;
+        }
+    } else if (verbose) {
+        fprintf(stderr, "No GSettings schemas found\n");
+    }
+    g_free(error);
+    g_ptr_array_free(schemas, TRUE);
+    g_free(dir);
+    return ret;
+}
+
+/* loaders.cache lists the loader modules by absolute path. They are made
+ * relative to usr/, which AppRun makes the working directory, so that the
+ * cache is valid wherever the AppImage is mounted; AppRun points
+ * GDK_PIXBUF_MODULE_FILE at it. */
+static int query_pixbuf_loaders(const gchar *appdir, const gchar *version_dir, gboolean verbose)
+{
+    gchar *loaders_dir = g_build_filename(version_dir, "loaders", NULL);
+    gchar *cache_file = g_build_filename(version_dir, "loaders.cache", NULL);
+    GPtrArray *loaders = list_files(loaders_dir, ".so");
+    gchar *output = NULL;
+    gchar *error = NULL;
+    int ret = 0;
+    guint i;
+
+    if (loaders->len == 0) {
+        if (verbose)
+            fprintf(stderr, "No gdk-pixbuf loaders in %s\n", loaders_dir);
+        goto out;
+    }
+    GPtrArray *argv = g_ptr_array_new();
+    g_ptr_array_add(argv, "gdk-pixbuf-query-loaders");
+    for (i = 0; i < loaders->len; i++)
+        g_ptr_array_add(argv, g_ptr_array_index(loaders, i));
+    g_ptr_array_add(argv, NULL);
+    if (!run_tool((gchar **) argv->pdata, &output, &error)) {
+        fprintf(stderr, "Could not query the gdk-pixbuf loaders: %s\n", error);
+        ret = -1;
+    } else {
+        gchar *usr = g_strdup_printf("\"%s/usr/", appdir);
+        gchar **parts = g_strsplit(output, usr, -1);
+        gchar *relative = g_strjoinv("\"", parts);
+        if (!g_file_set_contents(cache_file, relative, -1, NULL)) {
+            fprintf(stderr, "Could not write %s\n", cache_file);
+            ret = -1;
+        } else {
+            fprintf(stderr, "Precomputed %s for %u loaders\n", cache_file + strlen(appdir) + 1, loaders->len);
+            ret = 1;
+        }
+        g_free(relative);
+        g_strfreev(parts);
+        g_free(usr);
+    }
+    g_ptr_array_free(argv, TRUE);
+out:
+    g_free(output);
+    g_free(error);
+    g_ptr_array_free(loaders, TRUE);
+    g_free(cache_file);
+    g_free(loaders_dir);
+    return ret;
+}
+
+/* The loaders live in usr/lib{,32,64}[/<triplet>]/gdk-pixbuf-2.0/<abi>/loaders */
+static int pixbuf_loader_caches(const gchar *appdir, gboolean verbose)
+{
+    const gchar *libdirs[] = { "usr/lib", "usr/lib32", "usr/lib64" };
+    int produced = 0;
+    guint i;
+
+    if (!g_find_program_in_path("gdk-pixbuf-query-loaders")) {
+        if (verbose)
+            fprintf(stderr, "Skipping loaders.cache: gdk-pixbuf-query-loaders is missing\n");
+        return 0;
+    }
+    for (i = 0; i < G_N_ELEMENTS(libdirs); i++) {
+        gchar *libdir = g_build_filename(appdir, libdirs[i], NULL);
+        GPtrArray *candidates = g_ptr_array_new_with_free_func(g_free);
+        const gchar *entry;
+        guint j;
+        GDir *d = g_dir_open(libdir, 0, NULL);
+
+        g_ptr_array_add(candidates, g_build_filename(libdir, "gdk-pixbuf-2.0", NULL));
+        if (d != NULL) {
+            while ((entry = g_dir_read_name(d)) != NULL)
+                if (strchr(entry, '-') != NULL)
+                    g_ptr_array_add(candidates, g_build_filename(libdir, entry, "gdk-pixbuf-2.0", NULL));
+            g_dir_close(d);
+        }
+        for (j = 0; j < candidates->len; j++) {
+            const gchar *pixbuf_dir = g_ptr_array_index(candidates, j);
+            GDir *versions = g_dir_open(pixbuf_dir, 0, NULL);
+            if (versions == NULL)
+                continue;
+            while ((entry = g_dir_read_name(versions)) != NULL) {
+                gchar *version_dir = g_build_filename(pixbuf_dir, entry, NULL);
+                int ret = query_pixbuf_loaders(appdir, version_dir, verbose);
+                g_free(version_dir);
+                if (ret < 0) {
+                    g_dir_close(versions);
+                    g_ptr_array_free(candidates, TRUE);
+                    g_free(libdir);
+                    return -1;
+                }
+                produced += ret;
+            }
+            g_dir_close(versions);
+        }
+        g_ptr_array_free(candidates, TRUE);
+        g_free(libdir);
+    }
+    return produced;
+}
+
+/* Prefer the interpreter in the AppDir, the bytecode format depends on the
+ * exact Python version */
+static gchar *find_python(const gchar *appdir, const gchar *name)
+{
+    gchar *bundled = g_build_filename(appdir, "usr/bin", name, NULL);
+    if (g_file_test(bundled, G_FILE_TEST_IS_EXECUTABLE))
+        return bundled;
+    g_free(bundled);
+    return g_find_program_in_path(name);
+}
+
+/* Python cannot write __pycache__ into the mount and recompiles every module
+ * on every launch. mksquashfs keeps the mtimes that the .pyc files record. */
+static int compile_python_dir(const gchar *python, const gchar *appdir, const gchar *dir)
+{
+    gchar *error = NULL;
+    gchar *argv[7];
+    int argc = 0;
+    int ret;
+
+    argv[argc++] = (gchar *) python;
+    argv[argc++] = "-m";
+    argv[argc++] = "compileall";
+    argv[argc++] = "-q";
+    /* -j only exists in Python 3 */
+    if (strstr(python, "python3") != NULL)
+        argv[argc++] = "-j0";
+    argv[argc++] = (gchar *) dir;
+    argv[argc] = NULL;
+    if (!run_tool(argv, NULL, &error)) {
+        fprintf(stderr, "Could not compile the Python modules in %s: %s\n", dir + strlen(appdir) + 1, error);
+        ret = -1;
+    } else {
+        fprintf(stderr, "Precomputed Python bytecode in %s with %s\n", dir + strlen(appdir) + 1, python);
+        ret = 1;
+    }
+    g_free(error);
+    return ret;
+}
+
+static int python_bytecode(const gchar *appdir, gboolean verbose)
+{
+    gchar *libdir = g_build_filename(appdir, "usr/lib", NULL);
+    gchar *pyshared = g_build_filename(appdir, "usr/share/pyshared", NULL);
+    gchar *shared_python = NULL;
+    const gchar *entry;
+    int produced = 0;
+    GDir *d = g_dir_open(libdir, 0, NULL);
+
+    if (d != NULL) {
+        while ((entry = g_dir_read_name(d)) != NULL) {
+            gchar *dir, *python;
+            int ret;
+            if (!g_str_has_prefix(entry, "python2.") && !g_str_has_prefix(entry, "python3."))
+                continue;
+            dir = g_build_filename(libdir, entry, NULL);
+            python = find_python(appdir, entry);
+            if (python == NULL) {
+                fprintf(stderr, "Skipping Python bytecode in usr/lib/%s: %s is missing\n", entry, entry);
+                ret = 0;
+            } else {
+                ret = compile_python_dir(python, appdir, dir);
+                if (ret > 0 && (shared_python == NULL || g_str_has_prefix(entry, "python3."))) {
+                    g_free(shared_python);
+                    shared_python = g_strdup(python);
+                }
+            }
+            g_free(python);
+            g_free(dir);
+            if (ret < 0) {
+                produced = -1;
+                break;
+            }
+            produced += ret;
+        }
+        g_dir_close(d);
+    }
+    /* AppRun puts usr/share/pyshared on PYTHONPATH */
+    if (produced >= 0 && g_file_test(pyshared, G_FILE_TEST_IS_DIR)) {
+        if (shared_python == NULL)
+            shared_python = find_python(appdir, "python3");
+        if (shared_python == NULL) {
+            fprintf(stderr, "Skipping Python bytecode in usr/share/pyshared: no Python interpreter found\n");
+        } else {
+            int ret = compile_python_dir(shared_python, appdir, pyshared);
+            produced = ret < 0 ? -1 : produced + ret;
+        }
+    } else if (produced == 0 && verbose) {
+        fprintf(stderr, "No Python modules found\n");
+    }
+    g_free(shared_python);
+    g_free(pyshared);
+    g_free(libdir);
+    return produced;
+}
+
+int precompute_caches(const gchar *appdir, gboolean verbose)
+{
+    int produced = 0;
+    int ret;
+
+    if ((ret = compile_schemas(appdir, verbose)) < 0)
+        return -1;
+    produced += ret;
+    if ((ret = pixbuf_loader_caches(appdir, verbose)) < 0)
+        return -1;
+    produced += ret;
+    if ((ret = python_bytecode(appdir, verbose)) < 0)
+        return -1;
+    produced += ret;
+
+    /* fontconfig caches are named after and validated against the absolute
+     * path of the font directory, which changes with every mount */
+    gchar *fonts = g_build_filename(appdir, "usr/share/fonts", NULL);
+    if (g_file_test(fonts, G_FILE_TEST_IS_DIR))
+        fprintf(stderr, "Skipping the fontconfig cache: it is tied to the mount point and would never be used\n");
+    g_free(fonts);
+
+    fprintf(stderr, "Precomputed %d caches\n", produced);
+    return produced;
+}
@@ -0,0 +1,13 @@
+#ifndef __CACHES_H__
+#define __CACHES_H__
+
+#include <glib.h>
+
+/* Generate the caches that would otherwise be built or probed on every
+ * first launch, when the AppDir is a read-only FUSE mount: the compiled
+ * GSettings schemas, the gdk-pixbuf loaders.cache and Python bytecode.
+ * Each cache that is produced or skipped is reported on stderr.
+ * Returns the number of caches produced, or -1 if a tool failed. */
+int precompute_caches(const gchar *appdir, gboolean verbose);
+
+#endif /* __CACHES_H__ */
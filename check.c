@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "squashfuse.h"
+
+#include "aiheader.h"
+#include "parallel.h"
+#include "check.h"
+
+/* Files listed per corrupt block unless verbose */
+#define CHECK_MAX_FILES 20
+
+enum block_kind {
+    BLOCK_INODES,
+    BLOCK_DIRECTORIES,
+    BLOCK_DATA,
+    BLOCK_FRAGMENT,
+};
+
+static const char *block_kind_names[] = { "inode table", "directory table", "data", "fragment" };
+
+struct check_block {
+    guint64 pos;            /* Relative to the start of the squashfs */
+    guint32 header;         /* Size and compression of data and fragment blocks */
+    guint32 size;           /* Decompressed size, exact for data blocks, minimum for fragments */
+    enum block_kind kind;
+    guint64 table_pos;      /* Metadata blocks: position within their table */
+    GArray *files;          /* Indices into check_state.paths */
+    const char *error;      /* Set by the worker */
+};
+
+struct check_state {
+    sqfs fs;
+    GPtrArray *blocks;
+    GPtrArray *paths;
+    GArray *inodes;         /* Inode id of every path */
+    GArray *dirs;           /* Directory table block of every path, or -1 */
+    GHashTable *data_blocks;
+    gboolean verbose;
+};
+
+static struct check_block *add_block(struct check_state *state, enum block_kind kind, guint64 pos) {
+    struct check_block *block = g_new0(struct check_block, 1);
+    block->kind = kind;
+    block->pos = pos;
+    block->files = g_array_new(FALSE, FALSE, sizeof(guint));
+    g_ptr_array_add(state->blocks, block);
+    return block;
+}
+
+static void free_block(gpointer data) {
+    struct check_block *block = data;
+    g_array_free(block->files, TRUE);
+    g_free(block);
+}
+
+static guint add_path(struct check_state *state, const char *path, sqfs_inode_id inode, gint64 dir_block) {
+    g_ptr_array_add(state->paths, g_strdup(path));
+    g_array_append_val(state->inodes, inode);
+    g_array_append_val(state->dirs, dir_block);
+    return state->paths->len - 1;
+}
+
+/* Queue the data blocks of a regular file and attach it to its fragment.
+ * Files with identical contents share their blocks, which are checked once. */
+static int add_file_blocks(struct check_state *state, sqfs_inode *inode, guint file) {
+    sqfs *fs = &state->fs;
+    guint64 file_size = inode->xtra.reg.file_size;
+    size_t count = sqfs_blocklist_count(fs, inode);
+    sqfs_blocklist bl;
+    size_t i;
+
+    sqfs_blocklist_init(fs, inode, &bl);
+    for (i = 0; i < count; i++) {
+        struct check_block *block;
+        if (sqfs_blocklist_next(&bl) != SQFS_OK)
+            return -1;
+        /* Sparse blocks take no space */
+        if (bl.input_size == 0)
+            continue;
+        block = g_hash_table_lookup(state->data_blocks, &bl.block);
+        if (block == NULL) {
+            guint64 remaining = file_size - (guint64) i * fs->sb.block_size;
+            block = add_block(state, BLOCK_DATA, bl.block);
+            block->header = bl.header;
+            block->size = MIN(remaining, fs->sb.block_size);
+            g_hash_table_insert(state->data_blocks, &block->pos, block);
+        }
+        g_array_append_val(block->files, file);
+    }
+    if (inode->xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG) {
+        struct check_block *block;
+        guint32 tail = file_size % fs->sb.block_size;
+        if (inode->xtra.reg.frag_idx >= fs->sb.fragments)
+            return -1;
+        /* The fragments were queued first, in order */
+        block = g_ptr_array_index(state->blocks, inode->xtra.reg.frag_idx);
+        block->size = MAX(block->size, inode->xtra.reg.frag_off + tail);
+        g_array_append_val(block->files, file);
+    }
+    return 0;
+}
+
+/* Walk all inodes, which reads every reachable inode and directory listing */
+static const char *walk_inodes(struct check_state *state) {
+    sqfs *fs = &state->fs;
+    sqfs_traverse trv;
+    sqfs_err err = SQFS_OK;
+    const char *error = NULL;
+
+    if (sqfs_traverse_open(&trv, fs, sqfs_inode_root(fs)) != SQFS_OK)
+        return "the root directory cannot be read";
+    while (sqfs_traverse_next(&trv, &err)) {
+        sqfs_inode inode;
+        guint file;
+
+        if (trv.dir_end)
+            continue;
+        if (sqfs_inode_get(fs, &inode, trv.entry.inode) != SQFS_OK) {
+            error = "an inode cannot be read";
+            break;
+        }
+        file = add_path(state, trv.path, trv.entry.inode, S_ISDIR(inode.base.mode) ? inode.xtra.dir.start_block : -1);
+        if (S_ISREG(inode.base.mode) && add_file_blocks(state, &inode, file) != 0) {
+            error = "the block list of a file cannot be read";
+            break;
+        }
+    }
+    if (error == NULL && err != SQFS_OK)
+        error = "a directory cannot be read";
+    if (error != NULL)
+        fprintf(stderr, "Stopped walking the directory tree at %s: %s\n", trv.path, error);
+    sqfs_traverse_close(&trv);
+    return error;
+}
+
+/* The directory table ends where the first table after it begins */
+static guint64 directory_table_end(sqfs *fs) {
+    guint64 end = fs->sb.bytes_used;
+    if (fs->sb.fragments > 0 && fs->frag_table.blocks != NULL)
+        end = MIN(end, fs->frag_table.blocks[0]);
+    if (fs->export_table.blocks != NULL)
+        end = MIN(end, fs->export_table.blocks[0]);
+    if (fs->id_table.blocks != NULL)
+        end = MIN(end, fs->id_table.blocks[0]);
+    return end;
+}
+
+/* Queue the metadata blocks of the inode and directory tables. Only their
+ * headers are read here, to find where each block starts. */
+static void add_metadata_blocks(struct check_state *state) {
+    sqfs *fs = &state->fs;
+    guint64 pos = fs->sb.inode_table_start;
+    guint64 end = directory_table_end(fs);
+
+    while (pos < end) {
+        gboolean inodes = pos < fs->sb.directory_table_start;
+        struct check_block *block = add_block(state, inodes ? BLOCK_INODES : BLOCK_DIRECTORIES, pos);
+        guint16 header;
+        bool compressed;
+        uint16_t size;
+
+        block->table_pos = pos - (inodes ? fs->sb.inode_table_start : fs->sb.directory_table_start);
+        if (sqfs_pread(fs->fd, &header, sizeof(header), fs->offset + pos) != sizeof(header)) {
+            block->error = "cannot be read";
+            return;
+        }
+        sqfs_md_header(GUINT16_FROM_LE(header), &compressed, &size);
+        if (size == 0 || size > SQUASHFS_METADATA_SIZE || pos + sizeof(header) + size > end) {
+            block->error = "has an invalid header, the blocks after it cannot be found";
+            return;
+        }
+        pos += sizeof(header) + size;
+    }
+}
+
+static void check_one(size_t index, void *data) {
+    struct check_state *state = data;
+    struct check_block *block = g_ptr_array_index(state->blocks, index);
+    sqfs *fs = &state->fs;
+    sqfs_block *contents = NULL;
+    bool compressed;
+    uint32_t size;
+
+    if (block->error != NULL)
+        return;
+    if (block->kind == BLOCK_INODES || block->kind == BLOCK_DIRECTORIES) {
+        size_t data_size;
+        if (sqfs_md_block_read(fs, block->pos, &data_size, &contents) != SQFS_OK)
+            block->error = "does not decompress";
+        else if (contents->size == 0)
+            block->error = "is empty";
+    } else {
+        sqfs_data_header(block->header, &compressed, &size);
+        if (block->pos + size > fs->sb.bytes_used)
+            block->error = "lies beyond the end of the filesystem";
+        else if (sqfs_data_block_read(fs, block->pos, block->header, &contents) != SQFS_OK)
+            block->error = compressed ? "does not decompress" : "cannot be read";
+        else if (block->kind == BLOCK_DATA && contents->size != block->size)
+            block->error = "decompresses to the wrong size";
+        else if (block->kind == BLOCK_FRAGMENT && contents->size < block->size)
+            block->error = "is too short for the files in it";
+    }
+    if (contents != NULL)
+        sqfs_block_dispose(contents);
+}
+
+static gint compare_blocks(gconstpointer a, gconstpointer b) {
+    const struct check_block *ba = *(const struct check_block **) a;
+    const struct check_block *bb = *(const struct check_block **) b;
+    if (ba->pos != bb->pos)
+        return ba->pos < bb->pos ? -1 : 1;
+    return 0;
+}
+
+/* Metadata blocks hold the inodes whose id points into them, and the
+ * listings of the directories that start there */
+static void attach_metadata_files(struct check_state *state, struct check_block *block) {
+    guint i;
+    for (i = 0; i < state->paths->len; i++) {
+        gboolean affected;
+        if (block->kind == BLOCK_INODES)
+            affected = (g_array_index(state->inodes, sqfs_inode_id, i) >> 16) == block->table_pos;
+        else
+            affected = g_array_index(state->dirs, gint64, i) == (gint64) block->table_pos;
+        if (affected)
+            g_array_append_val(block->files, i);
+    }
+}
+
+static void report_block(struct check_state *state, struct check_block *block) {
+    guint i;
+    if (block->kind == BLOCK_INODES || block->kind == BLOCK_DIRECTORIES)
+        attach_metadata_files(state, block);
+    fprintf(stderr, "Corrupt %s block at offset %llu: it %s\n", block_kind_names[block->kind],
+            (unsigned long long) (state->fs.offset + block->pos), block->error);
+    if (block->files->len == 0) {
+        fprintf(stderr, "It affects no file that could be found\n");
+        return;
+    }
+    fprintf(stderr, "It affects %u %s:\n", block->files->len, block->files->len == 1 ? "file" : "files");
+    for (i = 0; i < block->files->len; i++) {
+        if (!state->verbose && i == CHECK_MAX_FILES) {
+            fprintf(stderr, "  ... and %u more, use --verbose to list them all\n", block->files->len - i);
+            break;
+        }
+        fprintf(stderr, "  %s\n", (char *) g_ptr_array_index(state->paths, g_array_index(block->files, guint, i)));
+    }
+}
+
+int check_appimage(const char *path, gboolean verbose) {
+    struct check_state state;
+    struct stat st;
+    const char *walk_error;
+    guint counts[4] = { 0 };
+    guint corrupt = 0;
+    guint i;
+    gint64 start = g_get_monotonic_time();
+    unsigned long fs_offset = appimage_get_payload_offset(path);
+
+    if (stat(path, &st) != 0 || fs_offset == 0) {
+        fprintf(stderr, "%s is not an AppImage\n", path);
+        return -1;
+    }
+    if (sqfs_open_image(&state.fs, path, fs_offset) != SQFS_OK) {
+        fprintf(stderr, "Could not open the squashfs filesystem in %s, its superblock or tables are corrupt\n", path);
+        return 1;
+    }
+    if ((guint64) st.st_size < fs_offset + state.fs.sb.bytes_used)
+        fprintf(stderr, "%s is truncated, %llu bytes are missing\n", path,
+                (unsigned long long) (fs_offset + state.fs.sb.bytes_used - st.st_size));
+
+    state.verbose = verbose;
+    state.blocks = g_ptr_array_new_with_free_func(free_block);
+    state.paths = g_ptr_array_new_with_free_func(g_free);
+    state.inodes = g_array_new(FALSE, FALSE, sizeof(sqfs_inode_id));
+    state.dirs = g_array_new(FALSE, FALSE, sizeof(gint64));
+    state.data_blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    for (i = 0; i < state.fs.sb.fragments; i++) {
+        struct squashfs_fragment_entry frag;
+        struct check_block *block = add_block(&state, BLOCK_FRAGMENT, 0);
+        if (sqfs_frag_entry(&state.fs, &frag, i) != SQFS_OK) {
+            block->error = "cannot be found, the fragment table is corrupt";
+            continue;
+        }
+        block->pos = frag.start_block;
+        block->header = frag.size;
+    }
+    walk_error = walk_inodes(&state);
+    add_metadata_blocks(&state);
+
+    /* Read the image front to back, as far as the threads allow */
+    g_ptr_array_sort(state.blocks, compare_blocks);
+    parallel_for(state.blocks->len, parallel_default_threads(), check_one, &state);
+
+    for (i = 0; i < state.blocks->len; i++) {
+        struct check_block *block = g_ptr_array_index(state.blocks, i);
+        counts[block->kind]++;
+        if (block->error == NULL)
+            continue;
+        if (corrupt == 0)
+            report_block(&state, block);
+        else if (verbose)
+            fprintf(stderr, "Corrupt %s block at offset %llu: it %s\n", block_kind_names[block->kind],
+                    (unsigned long long) (fs_offset + block->pos), block->error);
+        corrupt++;
+    }
+    if (corrupt > 0)
+        fprintf(stderr, "%u of %u blocks are corrupt\n", corrupt, state.blocks->len);
+    else if (walk_error != NULL)
+        fprintf(stderr, "No block failed to decompress, but %s\n", walk_error);
+    else
+        fprintf(stderr, "%s: %u metadata, %u data and %u fragment blocks of %u files are intact (%.2f s)\n", path,
+                counts[BLOCK_INODES] + counts[BLOCK_DIRECTORIES], counts[BLOCK_DATA], counts[BLOCK_FRAGMENT],
+                state.paths->len, (g_get_monotonic_time() - start) / 1000000.0);
+
+    g_hash_table_destroy(state.data_blocks);
+    g_array_free(state.dirs, TRUE);
+    g_array_free(state.inodes, TRUE);
+    g_ptr_array_free(state.paths, TRUE);
+    g_ptr_array_free(state.blocks, TRUE);
+    sqfs_fd_close(state.fs.fd);
+    return corrupt > 0 || walk_error != NULL ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <glib.h>
+
+/* Integrity check of the squashfs filesystem in an AppImage.
+ *
+ * squashfs has no checksums, so a corrupt download only shows up once a
+ * damaged block is read at runtime. The check walks all inodes and then
+ * decompresses every metadata, data and fragment block on all cores,
+ * verifying that each one decompresses to the size the filesystem expects.
+ * Blocks stored uncompressed can only be checked for being within the
+ * image; the digest in .sha256_sig covers them where it is present. */
+
+/* Check the AppImage at path and print the first corrupt block together
+ * with the files that it affects. Returns 0 if the image is intact, 1 if
+ * it is corrupt and -1 if it could not be read at all. */
+int check_appimage(const char *path, gboolean verbose);
+
+#endif /* __CHECK_H__ */
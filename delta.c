@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include "squashfuse.h"
+
+#include "aiheader.h"
+#include "delta.h"
+
+#define DELTA_MAGIC "AIDELTA1"
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_DATA 'D'
+#define DELTA_OP_END 'E'
+#define SHA256_LEN 32
+
+/* Granularity at which the runtimes of both images are compared */
+#define RUNTIME_PAGE 4096
+
+/* A compressed block of the new image, and where it can be found in the old one */
+struct region {
+    guint64 offset;
+    guint64 size;
+    guint64 old_offset;
+    gboolean matched;
+};
+
+typedef void (*block_fn)(guint64 offset, guint64 size, void *data);
+
+/* Call fn with the file offset and size of every data block and fragment
+ * block of the squashfs image at fs_offset in path */
+static int for_each_block(const char *path, unsigned long fs_offset, block_fn fn, void *data) {
+    sqfs fs;
+    sqfs_traverse trv;
+    sqfs_err err = SQFS_OK;
+    guint32 i;
+
+    if (sqfs_open_image(&fs, path, fs_offset) != SQFS_OK) {
+        fprintf(stderr, "Could not open the squashfs filesystem in %s\n", path);
+        return -1;
+    }
+    if (sqfs_traverse_open(&trv, &fs, sqfs_inode_root(&fs)) != SQFS_OK) {
+        sqfs_fd_close(fs.fd);
+        return -1;
+    }
+    while (sqfs_traverse_next(&trv, &err)) {
+        sqfs_inode inode;
+        sqfs_blocklist bl;
+        size_t count;
+
+        if (trv.dir_end)
+            continue;
+        if (sqfs_inode_get(&fs, &inode, trv.entry.inode) != SQFS_OK) {
+            err = SQFS_ERR;
+            break;
+        }
+        if (!S_ISREG(inode.base.mode))
+            continue;
+        count = sqfs_blocklist_count(&fs, &inode);
+        sqfs_blocklist_init(&fs, &inode, &bl);
+        while (count-- > 0) {
+            if (sqfs_blocklist_next(&bl) != SQFS_OK) {
+                err = SQFS_ERR;
+                break;
+            }
+            /* Sparse blocks take no space */
+            if (bl.input_size > 0)
+                fn(fs_offset + bl.block, bl.input_size, data);
+        }
+        if (err != SQFS_OK)
+            break;
+    }
+    sqfs_traverse_close(&trv);
+
+    for (i = 0; err == SQFS_OK && i < fs.sb.fragments; i++) {
+        struct squashfs_fragment_entry frag;
+        bool compressed;
+        uint32_t size;
+        if (sqfs_frag_entry(&fs, &frag, i) != SQFS_OK) {
+            err = SQFS_ERR;
+            break;
+        }
+        sqfs_data_header(frag.size, &compressed, &size);
+        if (size > 0)
+            fn(fs_offset + frag.start_block, size, data);
+    }
+    sqfs_fd_close(fs.fd);
+    if (err != SQFS_OK) {
+        fprintf(stderr, "Could not read the block lists of %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+struct old_index {
+    const guchar *data;
+    gsize size;
+    GHashTable *blocks;     /* sha1 of the block contents -> offset */
+};
+
+static void index_old_block(guint64 offset, guint64 size, void *data) {
+    struct old_index *idx = data;
+    guint64 *value;
+    if (offset + size > idx->size)
+        return;
+    value = g_new(guint64, 1);
+    *value = offset;
+    g_hash_table_insert(idx->blocks, g_compute_checksum_for_data(G_CHECKSUM_SHA1, idx->data + offset, size), value);
+}
+
+struct new_blocks {
+    const guchar *data;
+    gsize size;
+    GHashTable *seen;       /* Offsets of the blocks recorded already */
+    GArray *regions;
+};
+
+static void record_new_block(guint64 offset, guint64 size, void *data) {
+    struct new_blocks *nb = data;
+    struct region r;
+    guint64 *key;
+    /* mksquashfs deduplicates files, so blocks can be shared */
+    if (offset + size > nb->size || g_hash_table_lookup(nb->seen, &offset) != NULL)
+        return;
+    r.offset = offset;
+    r.size = size;
+    r.old_offset = 0;
+    r.matched = FALSE;
+    g_array_append_val(nb->regions, r);
+    key = g_new(guint64, 1);
+    *key = offset;
+    g_hash_table_insert(nb->seen, key, GINT_TO_POINTER(1));
+}
+
+static gint compare_regions(gconstpointer a, gconstpointer b) {
+    const struct region *ra = a;
+    const struct region *rb = b;
+    if (ra->offset < rb->offset)
+        return -1;
+    return ra->offset > rb->offset;
+}
+
+/* Estimate the bytes zsync would download to turn old into new: the
+ * blocks of new that cannot be found anywhere in old with the rsync
+ * rolling checksum zsync uses, plus the .zsync control file */
+static guint64 zsync_estimate(const guchar *old, gsize old_size, const guchar *new, gsize new_size) {
+    /* Like zsyncmake */
+    gsize bs = new_size < 100000000 ? 2048 : 4096;
+    gsize nblocks = (new_size + bs - 1) / bs;
+    GHashTable *weak = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gint *next = g_new(gint, nblocks);
+    gboolean *needed = g_new(gboolean, nblocks);
+    guint16 a, b;
+    guint64 needed_bytes = 0;
+    gsize i, j;
+
+    for (j = 0; j < nblocks; j++) {
+        guint32 key;
+        needed[j] = TRUE;
+        next[j] = -1;
+        /* The last block is partial and never matched here */
+        if ((j + 1) * bs > new_size)
+            continue;
+        a = b = 0;
+        for (i = 0; i < bs; i++) {
+            a += new[j * bs + i];
+            b += a;
+        }
+        key = ((guint32) a << 16) | b;
+        next[j] = GPOINTER_TO_INT(g_hash_table_lookup(weak, GUINT_TO_POINTER(key))) - 1;
+        g_hash_table_insert(weak, GUINT_TO_POINTER(key), GINT_TO_POINTER(j + 1));
+    }
+
+    if (old_size >= bs) {
+        a = b = 0;
+        for (i = 0; i < bs; i++) {
+            a += old[i];
+            b += a;
+        }
+        for (i = 0; ; i++) {
+            guint32 key = ((guint32) a << 16) | b;
+            gint candidate = GPOINTER_TO_INT(g_hash_table_lookup(weak, GUINT_TO_POINTER(key))) - 1;
+            for (; candidate >= 0; candidate = next[candidate])
+                if (needed[candidate] && memcmp(old + i, new + (gsize) candidate * bs, bs) == 0)
+                    needed[candidate] = FALSE;
+            if (i + bs >= old_size)
+                break;
+            a = a - old[i] + old[i + bs];
+            b = b - (guint16) (bs * old[i]) + a;
+        }
+    }
+
+    for (j = 0; j < nblocks; j++)
+        if (needed[j])
+            needed_bytes += (j + 1) * bs > new_size ? new_size - j * bs : bs;
+
+    g_free(next);
+    g_free(needed);
+    g_hash_table_destroy(weak);
+    /* Typical hash lengths in .zsync files are 2 bytes of rolling and
+     * 5 bytes of strong checksum per block, plus a header */
+    return needed_bytes + nblocks * 7 + 512;
+}
+
+static int write_u64(gzFile out, guint64 value) {
+    guchar buf[8];
+    int i;
+    for (i = 0; i < 8; i++)
+        buf[i] = (value >> (8 * i)) & 0xff;
+    return gzwrite(out, buf, 8) == 8 ? 0 : -1;
+}
+
+static int read_u64(gzFile in, guint64 *value) {
+    guchar buf[8];
+    int i;
+    if (gzread(in, buf, 8) != 8)
+        return -1;
+    *value = 0;
+    for (i = 0; i < 8; i++)
+        *value |= (guint64) buf[i] << (8 * i);
+    return 0;
+}
+
+static void sha256(const guchar *data, gsize size, guint8 *digest) {
+    GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA256);
+    gsize len = SHA256_LEN;
+    g_checksum_update(cs, data, size);
+    g_checksum_get_digest(cs, digest, &len);
+    g_checksum_free(cs);
+}
+
+static int write_copy(gzFile out, guint64 offset, guint64 size) {
+    if (size == 0)
+        return 0;
+    if (gzputc(out, DELTA_OP_COPY) < 0 || write_u64(out, offset) != 0 || write_u64(out, size) != 0)
+        return -1;
+    return 0;
+}
+
+static int write_data(gzFile out, const guchar *data, guint64 size) {
+    if (size == 0)
+        return 0;
+    if (gzputc(out, DELTA_OP_DATA) < 0 || write_u64(out, size) != 0)
+        return -1;
+    while (size > 0) {
+        unsigned int chunk = size > 1024*1024 ? 1024*1024 : size;
+        if (gzwrite(out, data, chunk) != (int) chunk)
+            return -1;
+        data += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+int delta_create(const char *old_path, const char *new_path, const char *delta_path, gboolean verbose) {
+    GMappedFile *old_map, *new_map;
+    const guchar *old, *new;
+    gsize old_size, new_size;
+    unsigned long old_fs_offset = appimage_get_payload_offset(old_path);
+    unsigned long new_fs_offset = appimage_get_payload_offset(new_path);
+    struct old_index idx;
+    struct new_blocks nb;
+    guint8 digest[SHA256_LEN];
+    guint64 pos = 0, copy_offset = 0, copy_size = 0, copied = 0, literal = 0, zsync;
+    guint reused = 0;
+    gzFile out;
+    guint i;
+    int ret = 0;
+    struct stat st;
+
+    old_map = g_mapped_file_new(old_path, FALSE, NULL);
+    new_map = g_mapped_file_new(new_path, FALSE, NULL);
+    if (old_map == NULL || new_map == NULL) {
+        fprintf(stderr, "Could not open %s\n", old_map == NULL ? old_path : new_path);
+        return -1;
+    }
+    old = (const guchar *) g_mapped_file_get_contents(old_map);
+    old_size = g_mapped_file_get_length(old_map);
+    new = (const guchar *) g_mapped_file_get_contents(new_map);
+    new_size = g_mapped_file_get_length(new_map);
+
+    idx.data = old;
+    idx.size = old_size;
+    idx.blocks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    nb.data = new;
+    nb.size = new_size;
+    nb.seen = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    nb.regions = g_array_new(FALSE, FALSE, sizeof(struct region));
+
+    if (for_each_block(old_path, old_fs_offset, index_old_block, &idx) != 0
+        || for_each_block(new_path, new_fs_offset, record_new_block, &nb) != 0) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < nb.regions->len; i++) {
+        struct region *r = &g_array_index(nb.regions, struct region, i);
+        gchar *key = g_compute_checksum_for_data(G_CHECKSUM_SHA1, new + r->offset, r->size);
+        guint64 *old_offset = g_hash_table_lookup(idx.blocks, key);
+        if (old_offset != NULL) {
+            r->old_offset = *old_offset;
+            r->matched = TRUE;
+            reused++;
+        }
+        g_free(key);
+    }
+    if (verbose)
+        fprintf(stderr, "%u of %u blocks of %s found in %s\n", reused, nb.regions->len, new_path, old_path);
+
+    /* Usually only the sections of the runtime differ */
+    for (pos = 0; pos < new_fs_offset; pos += RUNTIME_PAGE) {
+        struct region r;
+        r.offset = pos;
+        r.size = MIN(RUNTIME_PAGE, new_fs_offset - pos);
+        r.old_offset = pos;
+        r.matched = pos + r.size <= old_fs_offset && memcmp(old + pos, new + pos, r.size) == 0;
+        if (r.matched)
+            g_array_append_val(nb.regions, r);
+    }
+    g_array_sort(nb.regions, compare_regions);
+
+    out = gzopen(delta_path, "wb9");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", delta_path);
+        ret = -1;
+        goto out;
+    }
+    gzwrite(out, DELTA_MAGIC, strlen(DELTA_MAGIC));
+    write_u64(out, old_size);
+    write_u64(out, new_size);
+    sha256(old, old_size, digest);
+    gzwrite(out, digest, SHA256_LEN);
+    sha256(new, new_size, digest);
+    gzwrite(out, digest, SHA256_LEN);
+
+    pos = 0;
+    for (i = 0; ret == 0 && i < nb.regions->len; i++) {
+        struct region *r = &g_array_index(nb.regions, struct region, i);
+        if (!r->matched || r->offset < pos)
+            continue;
+        if (r->offset > pos) {
+            ret |= write_copy(out, copy_offset, copy_size);
+            copy_size = 0;
+            ret |= write_data(out, new + pos, r->offset - pos);
+            literal += r->offset - pos;
+        }
+        /* Consecutive blocks are usually consecutive in the old image too */
+        if (copy_size > 0 && copy_offset + copy_size == r->old_offset) {
+            copy_size += r->size;
+        } else {
+            ret |= write_copy(out, copy_offset, copy_size);
+            copy_offset = r->old_offset;
+            copy_size = r->size;
+        }
+        copied += r->size;
+        pos = r->offset + r->size;
+    }
+    ret |= write_copy(out, copy_offset, copy_size);
+    ret |= write_data(out, new + pos, new_size - pos);
+    literal += new_size - pos;
+    if (gzputc(out, DELTA_OP_END) < 0)
+        ret = -1;
+    if (gzclose(out) != Z_OK)
+        ret = -1;
+    if (ret != 0) {
+        fprintf(stderr, "Could not write %s\n", delta_path);
+        unlink(delta_path);
+        goto out;
+    }
+
+    zsync = zsync_estimate(old, old_size, new, new_size);
+    if (stat(delta_path, &st) == 0) {
+        fprintf(stderr, "Delta: %lld bytes (%" G_GUINT64_FORMAT " bytes reused, %" G_GUINT64_FORMAT " bytes new)\n",
+                (long long) st.st_size, copied, literal);
+        fprintf(stderr, "zsync would transfer about %" G_GUINT64_FORMAT " bytes, the full AppImage is %lu bytes\n",
+                zsync, (unsigned long) new_size);
+    }
+
+out:
+    g_hash_table_destroy(nb.seen);
+    g_array_free(nb.regions, TRUE);
+    g_hash_table_destroy(idx.blocks);
+    g_mapped_file_unref(old_map);
+    g_mapped_file_unref(new_map);
+    return ret;
+}
+
+int delta_apply(const char *delta_path, const char *old_path, const char *new_path, gboolean verbose) {
+    GMappedFile *old_map;
+    const guchar *old;
+    gsize old_size;
+    char magic[sizeof(DELTA_MAGIC) - 1];
+    guint64 expected_old_size, new_size, written = 0;
+    guint8 old_digest[SHA256_LEN], new_digest[SHA256_LEN], digest[SHA256_LEN];
+    gsize digest_len = SHA256_LEN;
+    GChecksum *cs;
+    gchar *tempfile;
+    FILE *fp;
+    gzFile in;
+    int op;
+    int ret = 0;
+
+    in = gzopen(delta_path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", delta_path);
+        return -1;
+    }
+    if (gzread(in, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, DELTA_MAGIC, sizeof(magic)) != 0
+        || read_u64(in, &expected_old_size) != 0 || read_u64(in, &new_size) != 0
+        || gzread(in, old_digest, SHA256_LEN) != SHA256_LEN || gzread(in, new_digest, SHA256_LEN) != SHA256_LEN) {
+        fprintf(stderr, "%s is not an AppImage delta\n", delta_path);
+        gzclose(in);
+        return -1;
+    }
+
+    old_map = g_mapped_file_new(old_path, FALSE, NULL);
+    if (old_map == NULL) {
+        fprintf(stderr, "Could not open %s\n", old_path);
+        gzclose(in);
+        return -1;
+    }
+    old = (const guchar *) g_mapped_file_get_contents(old_map);
+    old_size = g_mapped_file_get_length(old_map);
+    sha256(old, old_size, digest);
+    if (old_size != expected_old_size || memcmp(digest, old_digest, SHA256_LEN) != 0) {
+        fprintf(stderr, "The delta %s was not made for %s\n", delta_path, old_path);
+        g_mapped_file_unref(old_map);
+        gzclose(in);
+        return -1;
+    }
+
+    tempfile = g_strconcat(new_path, ".temp", NULL);
+    fp = fopen(tempfile, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", tempfile);
+        g_free(tempfile);
+        g_mapped_file_unref(old_map);
+        gzclose(in);
+        return -1;
+    }
+    cs = g_checksum_new(G_CHECKSUM_SHA256);
+    while (ret == 0 && (op = gzgetc(in)) != DELTA_OP_END) {
+        guint64 offset, size;
+        if (op == DELTA_OP_COPY) {
+            /* Written so that a crafted offset cannot wrap around */
+            if (read_u64(in, &offset) != 0 || read_u64(in, &size) != 0
+                || offset > old_size || size > old_size - offset || size > new_size - written) {
+                ret = -1;
+                break;
+            }
+            if (verbose)
+                fprintf(stderr, "Copying %" G_GUINT64_FORMAT " bytes from offset %" G_GUINT64_FORMAT "\n", size, offset);
+            if (fwrite(old + offset, 1, size, fp) != size)
+                ret = -1;
+            g_checksum_update(cs, old + offset, size);
+            written += size;
+        } else if (op == DELTA_OP_DATA) {
+            guchar buf[64*1024];
+            if (read_u64(in, &size) != 0 || size > new_size - written) {
+                ret = -1;
+                break;
+            }
+            if (verbose)
+                fprintf(stderr, "Writing %" G_GUINT64_FORMAT " new bytes\n", size);
+            written += size;
+            while (ret == 0 && size > 0) {
+                int chunk = size > sizeof(buf) ? sizeof(buf) : size;
+                if (gzread(in, buf, chunk) != chunk || fwrite(buf, 1, chunk, fp) != (size_t) chunk)
+                    ret = -1;
+                g_checksum_update(cs, buf, chunk);
+                size -= chunk;
+            }
+        } else {
+            ret = -1;
+        }
+    }
+    if (ret != 0)
+        fprintf(stderr, "%s is truncated or corrupt\n", delta_path);
+    if (fclose(fp) != 0)
+        ret = -1;
+    g_checksum_get_digest(cs, digest, &digest_len);
+    if (ret == 0 && (written != new_size || memcmp(digest, new_digest, SHA256_LEN) != 0)) {
+        fprintf(stderr, "The result of applying %s does not match the expected checksum\n", delta_path);
+        ret = -1;
+    }
+    if (ret == 0 && (chmod(tempfile, 0755) != 0 || rename(tempfile, new_path) != 0)) {
+        fprintf(stderr, "Could not write %s: %s\n", new_path, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0)
+        unlink(tempfile);
+
+    g_checksum_free(cs);
+    g_free(tempfile);
+    g_mapped_file_unref(old_map);
+    gzclose(in);
+    return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <glib.h>
+
+/* Binary deltas between two releases of an AppImage.
+ *
+ * Unlike zsync, which has to discover reusable blocks on the client, the
+ * delta is computed with knowledge of both squashfs images: compressed
+ * data and fragment blocks of the new image that also exist in the old
+ * one are copied from there, and so are unchanged pages of the runtime.
+ * Everything else travels as literal data. The delta file is gzip
+ * compressed and records the sha256 of both images, so that applying it
+ * to the wrong old image or producing a corrupt new one is detected. */
+
+/* Write a delta that turns old_path into new_path to delta_path and
+ * print its size next to an estimate of what zsync would transfer.
+ * Returns 0 on success, -1 on error. */
+int delta_create(const char *old_path, const char *new_path, const char *delta_path, gboolean verbose);
+
+/* Apply the delta in delta_path to old_path and write the result to
+ * new_path. Returns 0 on success, -1 on error. */
+int delta_apply(const char *delta_path, const char *old_path, const char *new_path, gboolean verbose);
+
+#endif /* __DELTA_H__ */
@@ -1,5 +1,5 @@
 /*
-	cc -o digest getsection.c digest.c -lssl -lcrypto
+	cc -o digest elf.c getsection.c aiheader.c digest.c -lssl -lcrypto
 */
 
 #include <stdio.h>
@@ -11,6 +11,7 @@
 #include <linux/limits.h>
 
 #include "getsection.h"
+#include "aiheader.h"
 
 typedef unsigned char byte;      
 
@@ -107,7 +108,7 @@ int main(int argc,char **argv)	{
         char *filename = argv[1];   
         
         if(argc < 4){
-            get_elf_section_offset_and_lenghth(filename, ".sha256_sig", &skip_offset, &skip_length);
+            appimage_get_section(filename, ".sha256_sig", &skip_offset, &skip_length);
             if(skip_length > 0)
                 fprintf(stderr, "Skipping ELF section %s with offset %lu, length %lu\n", segment_name, skip_offset, skip_length);
         } else if(argc == 4) {
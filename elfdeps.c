@@ -0,0 +1,384 @@
+/*
+ * Find the shared libraries in an AppDir that nothing loads, and the ones
+ * loaded at startup, by following DT_NEEDED from the entry points of the
+ * application
+ */
+
+#include <glib.h>
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "elfinfo.h"
+#include "elfdeps.h"
+
+struct elf_node {
+    gchar *path;          /* Canonical path of the file */
+    gboolean is_library;
+    gboolean reached;
+    gint64 size;
+    gboolean ambiguous;   /* Another file goes by one of its names */
+    GPtrArray *needed;    /* DT_NEEDED entries */
+    GPtrArray *search;    /* DT_RUNPATH, or else DT_RPATH, with $ORIGIN expanded */
+    GPtrArray *links;     /* Symlinks in the AppDir pointing to this file */
+};
+
+struct elf_graph {
+    GHashTable *nodes;    /* Canonical path -> struct elf_node */
+    GHashTable *names;    /* File name, symlink name or DT_SONAME -> struct elf_node */
+    const gchar *appdir;
+    gsize prefix_len;
+};
+
+/* Where AppRun points LD_LIBRARY_PATH */
+static const gchar *library_dirs[] = {
+    "usr/lib", "usr/lib/i386-linux-gnu", "usr/lib/x86_64-linux-gnu", "usr/lib32", "usr/lib64",
+    "lib", "lib/i386-linux-gnu", "lib/x86_64-linux-gnu", "lib32", "lib64", NULL
+};
+
+static void add_needed(const char *value, void *data)
+{
+    g_ptr_array_add((GPtrArray *) data, g_strdup(value));
+}
+
+/* Add the directories of a DT_RUNPATH or DT_RPATH value of the file in
+ * origin to search */
+static void add_search_path(const gchar *value, const gchar *origin, GPtrArray *search)
+{
+    gchar **dirs = g_strsplit(value, ":", -1);
+    guint i;
+
+    for (i = 0; dirs[i] != NULL; i++) {
+        gchar **parts;
+        gchar *dir;
+        if (dirs[i][0] == '\0')
+            continue;
+        parts = g_strsplit(dirs[i], "${ORIGIN}", -1);
+        dir = g_strjoinv("$ORIGIN", parts);
+        g_strfreev(parts);
+        parts = g_strsplit(dir, "$ORIGIN", -1);
+        g_free(dir);
+        g_ptr_array_add(search, g_strjoinv(origin, parts));
+        g_strfreev(parts);
+    }
+    g_strfreev(dirs);
+}
+
+/* Index node under name. A name that more than one file goes by makes
+ * them all ambiguous, as which of them gets loaded depends on the search
+ * path at runtime. */
+static void index_name(struct elf_graph *graph, const gchar *name, struct elf_node *node)
+{
+    struct elf_node *other = g_hash_table_lookup(graph->names, name);
+
+    if (other == NULL) {
+        g_hash_table_insert(graph->names, g_strdup(name), node);
+    } else if (other != node) {
+        other->ambiguous = TRUE;
+        node->ambiguous = TRUE;
+    }
+}
+
+static gboolean is_library_name(const gchar *name)
+{
+    return g_str_has_suffix(name, ".so") || strstr(name, ".so.") != NULL;
+}
+
+/* Return the node for the ELF file at canonical path, reading it on first use */
+static struct elf_node *graph_node(struct elf_graph *graph, const gchar *path)
+{
+    struct elf_node *node = g_hash_table_lookup(graph->nodes, path);
+    struct elfinfo ei;
+    struct stat st;
+
+    if (node)
+        return node;
+    if (elfinfo_open(&ei, path) != 0)
+        return NULL;
+    node = g_new0(struct elf_node, 1);
+    node->path = g_strdup(path);
+    node->needed = g_ptr_array_new();
+    node->search = g_ptr_array_new();
+    node->links = g_ptr_array_new();
+    node->is_library = ei.type == ET_DYN && is_library_name(path);
+    if (stat(path, &st) == 0)
+        node->size = st.st_size;
+    elfinfo_dynamic_strings(&ei, DT_NEEDED, add_needed, node->needed);
+    GPtrArray *sonames = g_ptr_array_new_with_free_func(g_free);
+    elfinfo_dynamic_strings(&ei, DT_SONAME, add_needed, sonames);
+    /* The dynamic loader ignores DT_RPATH if there is a DT_RUNPATH */
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    elfinfo_dynamic_strings(&ei, DT_RUNPATH, add_needed, paths);
+    if (paths->len == 0)
+        elfinfo_dynamic_strings(&ei, DT_RPATH, add_needed, paths);
+    elfinfo_close(&ei);
+
+    gchar *origin = g_path_get_dirname(path);
+    guint i;
+    for (i = 0; i < paths->len; i++)
+        add_search_path(g_ptr_array_index(paths, i), origin, node->search);
+    g_free(origin);
+    g_ptr_array_free(paths, TRUE);
+
+    g_hash_table_insert(graph->nodes, node->path, node);
+    gchar *name = g_path_get_basename(path);
+    index_name(graph, name, node);
+    g_free(name);
+    for (i = 0; i < sonames->len; i++)
+        index_name(graph, g_ptr_array_index(sonames, i), node);
+    g_ptr_array_free(sonames, TRUE);
+    return node;
+}
+
+/* Index all ELF files in the AppDir by name; symlinks are indexed under
+ * their own name so that a DT_NEEDED on libfoo.so.1 finds libfoo.so.1.2.3 */
+static void scan_appdir(struct elf_graph *graph, const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *entry;
+
+    if (dir == NULL) {
+        g_warning("%s: %s", path, g_strerror(errno));
+        return;
+    }
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        gchar *full_name = g_build_filename(path, entry, NULL);
+        if (g_file_test(full_name, G_FILE_TEST_IS_SYMLINK)) {
+            char resolved[PATH_MAX];
+            if (realpath(full_name, resolved) && g_file_test(resolved, G_FILE_TEST_IS_REGULAR)
+                && elfinfo_is_elf(resolved)) {
+                struct elf_node *node = graph_node(graph, resolved);
+                if (node) {
+                    g_ptr_array_add(node->links, g_strdup(full_name));
+                    index_name(graph, entry, node);
+                }
+            }
+        } else if (g_file_test(full_name, G_FILE_TEST_IS_DIR)) {
+            scan_appdir(graph, full_name);
+        } else if (elfinfo_is_elf(full_name)) {
+            char resolved[PATH_MAX];
+            if (realpath(full_name, resolved))
+                graph_node(graph, resolved);
+        }
+        g_free(full_name);
+    }
+    g_dir_close(dir);
+}
+
+/* The node of the ELF file at path if it is inside the AppDir */
+static struct elf_node *appdir_node(struct elf_graph *graph, const gchar *path)
+{
+    char resolved[PATH_MAX];
+
+    if (!realpath(path, resolved) || strncmp(resolved, graph->appdir, graph->prefix_len - 1) != 0
+        || resolved[graph->prefix_len - 1] != '/' || !g_file_test(resolved, G_FILE_TEST_IS_REGULAR)
+        || !elfinfo_is_elf(resolved))
+        return NULL;
+    return graph_node(graph, resolved);
+}
+
+/* Find the library that the dynamic loader would load for the DT_NEEDED
+ * entry name of node: in its DT_RUNPATH or DT_RPATH, then in the library
+ * directories of the AppDir, and else any file by that name */
+static struct elf_node *resolve_needed(struct elf_graph *graph, struct elf_node *node, const gchar *name)
+{
+    struct elf_node *dep = NULL;
+    guint i;
+
+    if (strchr(name, '/') != NULL)
+        return g_hash_table_lookup(graph->names, name);
+    for (i = 0; dep == NULL && i < node->search->len; i++) {
+        gchar *candidate = g_build_filename(g_ptr_array_index(node->search, i), name, NULL);
+        dep = appdir_node(graph, candidate);
+        g_free(candidate);
+    }
+    for (i = 0; dep == NULL && library_dirs[i] != NULL; i++) {
+        gchar *candidate = g_build_filename(graph->appdir, library_dirs[i], name, NULL);
+        dep = appdir_node(graph, candidate);
+        g_free(candidate);
+    }
+    if (dep == NULL)
+        dep = g_hash_table_lookup(graph->names, name);
+    return dep;
+}
+
+static void reach(struct elf_graph *graph, struct elf_node *root)
+{
+    GPtrArray *queue = g_ptr_array_new();
+    guint head = 0;
+
+    if (root == NULL || root->reached)
+        return;
+    root->reached = TRUE;
+    g_ptr_array_add(queue, root);
+    while (head < queue->len) {
+        struct elf_node *node = g_ptr_array_index(queue, head++);
+        guint i;
+        for (i = 0; i < node->needed->len; i++) {
+            struct elf_node *dep = resolve_needed(graph, node, g_ptr_array_index(node->needed, i));
+            if (dep && !dep->reached) {
+                dep->reached = TRUE;
+                g_ptr_array_add(queue, dep);
+            }
+        }
+    }
+    g_ptr_array_free(queue, TRUE);
+}
+
+static void reach_path(struct elf_graph *graph, const gchar *path, gboolean verbose)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved) || !elfinfo_is_elf(resolved))
+        return;
+    struct elf_node *node = graph_node(graph, resolved);
+    if (node && verbose)
+        fprintf(stderr, "Dependency root: %s\n", resolved + graph->prefix_len);
+    reach(graph, node);
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+static void collect_node(gpointer key, gpointer value, gpointer data)
+{
+    g_ptr_array_add((GPtrArray *) data, value);
+}
+
+/* Index the ELF files in appdir_resolved and mark what the main executable
+ * and AppRun load, and with plugins, also what the toolkit plugins load.
+ * Returns all nodes. */
+static GPtrArray *resolve_graph(struct elf_graph *graph_out, const gchar *appdir_resolved, const gchar *exec, gboolean plugins, gboolean verbose)
+{
+    struct elf_graph graph;
+    GPtrArray *nodes = g_ptr_array_new();
+    guint i;
+
+    graph.nodes = g_hash_table_new(g_str_hash, g_str_equal);
+    graph.names = g_hash_table_new(g_str_hash, g_str_equal);
+    graph.appdir = appdir_resolved;
+    graph.prefix_len = strlen(appdir_resolved) + 1;
+    scan_appdir(&graph, appdir_resolved);
+
+    /* The main executable; Exec= may or may not carry a path */
+    if (exec) {
+        gchar **exec_argv = NULL;
+        if (g_shell_parse_argv(exec, NULL, &exec_argv, NULL) && exec_argv[0]) {
+            gchar *name = g_path_get_basename(exec_argv[0]);
+            const gchar *bindirs[] = { "usr/bin", "usr/sbin", "usr/games", "bin", "sbin", "", NULL };
+            const gchar **bindir;
+            for (bindir = bindirs; *bindir; bindir++) {
+                gchar *candidate = g_build_filename(appdir_resolved, *bindir, name, NULL);
+                if (g_file_test(candidate, G_FILE_TEST_IS_REGULAR))
+                    reach_path(&graph, candidate, verbose);
+                g_free(candidate);
+            }
+            if (!g_path_is_absolute(exec_argv[0]) && strchr(exec_argv[0], '/')) {
+                gchar *candidate = g_build_filename(appdir_resolved, exec_argv[0], NULL);
+                reach_path(&graph, candidate, verbose);
+                g_free(candidate);
+            }
+            g_free(name);
+        }
+        g_strfreev(exec_argv);
+    }
+
+    gchar *apprun = g_build_filename(appdir_resolved, "AppRun", NULL);
+    reach_path(&graph, apprun, verbose);
+    g_free(apprun);
+
+    /* Toolkit plugins such as Qt's are loaded by path at runtime,
+     * so they are roots as well */
+    g_hash_table_foreach(graph.nodes, collect_node, nodes);
+    for (i = 0; plugins && i < nodes->len; i++) {
+        struct elf_node *node = g_ptr_array_index(nodes, i);
+        if (g_pattern_match_simple("usr/lib/*/plugins/*", node->path + graph.prefix_len)) {
+            if (verbose && !node->reached)
+                fprintf(stderr, "Dependency root: %s\n", node->path + graph.prefix_len);
+            reach(&graph, node);
+        }
+    }
+    *graph_out = graph;
+    return nodes;
+}
+
+gint64 find_unused_libraries(const gchar *appdir, const gchar *exec, GPtrArray *unused, gboolean verbose)
+{
+    struct elf_graph graph;
+    GPtrArray *nodes;
+    char appdir_resolved[PATH_MAX];
+    gint64 unused_size = 0;
+    guint i;
+
+    if (!realpath(appdir, appdir_resolved))
+        return 0;
+    nodes = resolve_graph(&graph, appdir_resolved, exec, TRUE, verbose);
+
+    /* Report in a stable order */
+    GPtrArray *unused_nodes = g_ptr_array_new();
+    for (i = 0; i < nodes->len; i++) {
+        struct elf_node *node = g_ptr_array_index(nodes, i);
+        if (!node->is_library || node->reached)
+            continue;
+        /* A file by the same name may be the one that gets loaded */
+        if (node->ambiguous) {
+            if (verbose)
+                fprintf(stderr, "Keeping %s, another library goes by its name\n", node->path + graph.prefix_len);
+            continue;
+        }
+        g_ptr_array_add(unused_nodes, node->path);
+    }
+    g_ptr_array_sort(unused_nodes, compare_paths);
+    for (i = 0; i < unused_nodes->len; i++) {
+        struct elf_node *node = g_hash_table_lookup(graph.nodes, g_ptr_array_index(unused_nodes, i));
+        guint k;
+        fprintf(stderr, "Unused library: %s (%" G_GINT64_FORMAT " bytes)\n", node->path + graph.prefix_len, node->size);
+        unused_size += node->size;
+        g_ptr_array_add(unused, g_strdup(node->path));
+        for (k = 0; k < node->links->len; k++)
+            g_ptr_array_add(unused, g_strdup(g_ptr_array_index(node->links, k)));
+    }
+    fprintf(stderr, "%u of %u ELF files are libraries that nothing links against, %" G_GINT64_FORMAT " bytes\n",
+            unused_nodes->len, nodes->len, unused_size);
+
+    g_ptr_array_free(unused_nodes, TRUE);
+    g_ptr_array_free(nodes, TRUE);
+    return unused_size;
+}
+
+gint64 find_startup_elf_files(const gchar *appdir, const gchar *exec, GPtrArray *startup, gboolean verbose)
+{
+    struct elf_graph graph;
+    GPtrArray *nodes;
+    GPtrArray *reached = g_ptr_array_new();
+    char appdir_resolved[PATH_MAX];
+    gint64 startup_size = 0;
+    guint i;
+
+    if (!realpath(appdir, appdir_resolved))
+        return 0;
+    /* Plugins are loaded later, if at all */
+    nodes = resolve_graph(&graph, appdir_resolved, exec, FALSE, verbose);
+    for (i = 0; i < nodes->len; i++) {
+        struct elf_node *node = g_ptr_array_index(nodes, i);
+        if (node->reached)
+            g_ptr_array_add(reached, node->path);
+    }
+    g_ptr_array_sort(reached, compare_paths);
+    for (i = 0; i < reached->len; i++) {
+        struct elf_node *node = g_hash_table_lookup(graph.nodes, g_ptr_array_index(reached, i));
+        if (verbose)
+            fprintf(stderr, "Startup file: %s (%" G_GINT64_FORMAT " bytes)\n", node->path + graph.prefix_len, node->size);
+        startup_size += node->size;
+        g_ptr_array_add(startup, g_strdup(node->path));
+    }
+
+    g_ptr_array_free(reached, TRUE);
+    g_ptr_array_free(nodes, TRUE);
+    return startup_size;
+}
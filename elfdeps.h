@@ -0,0 +1,19 @@
+#ifndef __ELFDEPS_H__
+#define __ELFDEPS_H__
+
+#include <glib.h>
+
+/* Resolve the DT_NEEDED graph of the ELF files in appdir, starting from the
+ * binary named in the Exec= line of the desktop file, AppRun and the toolkit
+ * plugins in usr/lib/<toolkit>/plugins. Libraries that are not reachable from there are
+ * added to unused together with the symlinks pointing to them; libraries
+ * that are only ever dlopen()ed by name cannot be seen this way.
+ * Returns the number of bytes the unused libraries take up. */
+gint64 find_unused_libraries(const gchar *appdir, const gchar *exec, GPtrArray *unused, gboolean verbose);
+
+/* Add the ELF files that the binary named in the Exec= line and AppRun load
+ * at startup, following DT_NEEDED, to startup as paths inside appdir.
+ * Returns the number of bytes they take up. */
+gint64 find_startup_elf_files(const gchar *appdir, const gchar *exec, GPtrArray *startup, gboolean verbose);
+
+#endif /* __ELFDEPS_H__ */
@@ -0,0 +1,260 @@
+#include <elf.h>
+#include <byteswap.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "elfinfo.h"
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define ELFDATANATIVE ELFDATA2LSB
+#else
+#define ELFDATANATIVE ELFDATA2MSB
+#endif
+
+/* Section header fields we care about, independent of the ELF class */
+struct elfinfo_shdr {
+    uint32_t name;
+    uint32_t type;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+};
+
+static uint16_t ei16(struct elfinfo *ei, uint16_t val)
+{
+    return ei->swap ? bswap_16(val) : val;
+}
+
+static uint32_t ei32(struct elfinfo *ei, uint32_t val)
+{
+    return ei->swap ? bswap_32(val) : val;
+}
+
+static uint64_t ei64(struct elfinfo *ei, uint64_t val)
+{
+    return ei->swap ? bswap_64(val) : val;
+}
+
+int elfinfo_is_elf(const char *path)
+{
+    unsigned char ident[SELFMAG];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t ret = pread(fd, ident, SELFMAG, 0);
+    close(fd);
+    return ret == SELFMAG && memcmp(ident, ELFMAG, SELFMAG) == 0;
+}
+
+int elfinfo_open(struct elfinfo *ei, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(ei, 0, sizeof(*ei));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Elf32_Ehdr)) {
+        close(fd);
+        return -1;
+    }
+    ei->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ei->data == MAP_FAILED) {
+        ei->data = NULL;
+        return -1;
+    }
+    ei->size = st.st_size;
+
+    if (memcmp(ei->data, ELFMAG, SELFMAG) != 0
+        || (ei->data[EI_CLASS] != ELFCLASS32 && ei->data[EI_CLASS] != ELFCLASS64)
+        || (ei->data[EI_DATA] != ELFDATA2LSB && ei->data[EI_DATA] != ELFDATA2MSB)
+        || (ei->data[EI_CLASS] == ELFCLASS64 && ei->size < sizeof(Elf64_Ehdr))) {
+        elfinfo_close(ei);
+        return -1;
+    }
+    ei->is64 = ei->data[EI_CLASS] == ELFCLASS64;
+    ei->swap = ei->data[EI_DATA] != ELFDATANATIVE;
+    if (ei->is64) {
+        Elf64_Ehdr *ehdr = (Elf64_Ehdr *) ei->data;
+        ei->type = ei16(ei, ehdr->e_type);
+        ei->machine = ei16(ei, ehdr->e_machine);
+    } else {
+        Elf32_Ehdr *ehdr = (Elf32_Ehdr *) ei->data;
+        ei->type = ei16(ei, ehdr->e_type);
+        ei->machine = ei16(ei, ehdr->e_machine);
+    }
+    return 0;
+}
+
+void elfinfo_close(struct elfinfo *ei)
+{
+    if (ei->data)
+        munmap(ei->data, ei->size);
+    ei->data = NULL;
+    ei->size = 0;
+}
+
+/* Read section header number i; returns -1 if it lies outside of the file */
+static int elfinfo_shdr(struct elfinfo *ei, unsigned int i, struct elfinfo_shdr *sh)
+{
+    uint64_t shoff;
+    unsigned int shentsize, shnum;
+
+    if (ei->is64) {
+        Elf64_Ehdr *ehdr = (Elf64_Ehdr *) ei->data;
+        shoff = ei64(ei, ehdr->e_shoff);
+        shentsize = ei16(ei, ehdr->e_shentsize);
+        shnum = ei16(ei, ehdr->e_shnum);
+    } else {
+        Elf32_Ehdr *ehdr = (Elf32_Ehdr *) ei->data;
+        shoff = ei32(ei, ehdr->e_shoff);
+        shentsize = ei16(ei, ehdr->e_shentsize);
+        shnum = ei16(ei, ehdr->e_shnum);
+    }
+    if (i >= shnum || shoff == 0)
+        return -1;
+    if (shoff + (uint64_t)(i + 1) * shentsize > ei->size)
+        return -1;
+
+    if (ei->is64) {
+        Elf64_Shdr *s = (Elf64_Shdr *) (ei->data + shoff + (uint64_t) i * shentsize);
+        sh->name = ei32(ei, s->sh_name);
+        sh->type = ei32(ei, s->sh_type);
+        sh->offset = ei64(ei, s->sh_offset);
+        sh->size = ei64(ei, s->sh_size);
+        sh->link = ei32(ei, s->sh_link);
+    } else {
+        Elf32_Shdr *s = (Elf32_Shdr *) (ei->data + shoff + (uint64_t) i * shentsize);
+        sh->name = ei32(ei, s->sh_name);
+        sh->type = ei32(ei, s->sh_type);
+        sh->offset = ei32(ei, s->sh_offset);
+        sh->size = ei32(ei, s->sh_size);
+        sh->link = ei32(ei, s->sh_link);
+    }
+    if (sh->type != SHT_NOBITS && sh->offset + sh->size > ei->size)
+        return -1;
+    return 0;
+}
+
+/* Name of section header sh, or NULL if the string table is unusable */
+static const char *elfinfo_section_name(struct elfinfo *ei, struct elfinfo_shdr *sh)
+{
+    struct elfinfo_shdr strtab;
+    unsigned int shstrndx;
+
+    if (ei->is64)
+        shstrndx = ei16(ei, ((Elf64_Ehdr *) ei->data)->e_shstrndx);
+    else
+        shstrndx = ei16(ei, ((Elf32_Ehdr *) ei->data)->e_shstrndx);
+    if (elfinfo_shdr(ei, shstrndx, &strtab) != 0 || sh->name >= strtab.size)
+        return NULL;
+    const char *name = (const char *) ei->data + strtab.offset + sh->name;
+    if (memchr(name, '\0', strtab.size - sh->name) == NULL)
+        return NULL;
+    return name;
+}
+
+int elfinfo_find_section(struct elfinfo *ei, const char *name, uint64_t *offset, uint64_t *size)
+{
+    struct elfinfo_shdr sh;
+    unsigned int i;
+
+    for (i = 1; elfinfo_shdr(ei, i, &sh) == 0; i++) {
+        const char *secname = elfinfo_section_name(ei, &sh);
+        if (secname && strcmp(secname, name) == 0) {
+            *offset = sh.offset;
+            *size = sh.size;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int elfinfo_has_debug_info(struct elfinfo *ei)
+{
+    struct elfinfo_shdr sh;
+    unsigned int i;
+
+    for (i = 1; elfinfo_shdr(ei, i, &sh) == 0; i++) {
+        if (sh.type == SHT_SYMTAB)
+            return 1;
+        const char *secname = elfinfo_section_name(ei, &sh);
+        if (secname && (strncmp(secname, ".debug_", 7) == 0 || strncmp(secname, ".zdebug_", 8) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+int elfinfo_build_id(struct elfinfo *ei, char *hex, size_t hexlen)
+{
+    uint64_t offset, size, pos;
+
+    if (elfinfo_find_section(ei, ".note.gnu.build-id", &offset, &size) != 0)
+        return -1;
+
+    /* Notes have the same layout in both ELF classes */
+    pos = 0;
+    while (pos + sizeof(Elf32_Nhdr) <= size) {
+        Elf32_Nhdr *nhdr = (Elf32_Nhdr *) (ei->data + offset + pos);
+        uint32_t namesz = ei32(ei, nhdr->n_namesz);
+        uint32_t descsz = ei32(ei, nhdr->n_descsz);
+        uint32_t type = ei32(ei, nhdr->n_type);
+        uint64_t name_pos = pos + sizeof(Elf32_Nhdr);
+        uint64_t desc_pos = name_pos + ((namesz + 3) & ~3U);
+        if (desc_pos + descsz > size)
+            return -1;
+        if (type == NT_GNU_BUILD_ID && namesz == 4
+            && memcmp(ei->data + offset + name_pos, "GNU", 4) == 0) {
+            uint32_t k;
+            if (descsz == 0 || hexlen < 2 * (size_t) descsz + 1)
+                return -1;
+            for (k = 0; k < descsz; k++)
+                sprintf(hex + 2 * k, "%02x", ei->data[offset + desc_pos + k]);
+            return 0;
+        }
+        pos = desc_pos + ((descsz + 3) & ~3U);
+    }
+    return -1;
+}
+
+int elfinfo_dynamic_strings(struct elfinfo *ei, int64_t tag, void (*cb)(const char *value, void *data), void *data)
+{
+    struct elfinfo_shdr sh, strtab;
+    unsigned int i;
+    int found = 0;
+
+    for (i = 1; !found && elfinfo_shdr(ei, i, &sh) == 0; i++)
+        found = sh.type == SHT_DYNAMIC;
+    if (!found || elfinfo_shdr(ei, sh.link, &strtab) != 0)
+        return -1;
+
+    size_t entsize = ei->is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+    uint64_t pos;
+    for (pos = 0; pos + entsize <= sh.size; pos += entsize) {
+        int64_t d_tag;
+        uint64_t d_val;
+        if (ei->is64) {
+            Elf64_Dyn *dyn = (Elf64_Dyn *) (ei->data + sh.offset + pos);
+            d_tag = (int64_t) ei64(ei, dyn->d_tag);
+            d_val = ei64(ei, dyn->d_un.d_val);
+        } else {
+            Elf32_Dyn *dyn = (Elf32_Dyn *) (ei->data + sh.offset + pos);
+            d_tag = (int32_t) ei32(ei, dyn->d_tag);
+            d_val = ei32(ei, dyn->d_un.d_val);
+        }
+        if (d_tag == DT_NULL)
+            break;
+        if (d_tag != tag || d_val >= strtab.size)
+            continue;
+        const char *value = (const char *) ei->data + strtab.offset + d_val;
+        if (memchr(value, '\0', strtab.size - d_val) != NULL)
+            cb(value, data);
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __ELFINFO_H__
+#define __ELFINFO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Read-only view of an ELF file of either class and byte order,
+ * used to inspect the binaries inside an AppDir */
+struct elfinfo {
+    unsigned char *data;
+    size_t size;
+    int is64;
+    int swap;            /* File byte order differs from ours */
+    uint16_t type;       /* e_type, e.g. ET_EXEC or ET_DYN */
+    uint16_t machine;    /* e_machine, e.g. EM_X86_64 */
+};
+
+/* Returns 1 if the file starts with the ELF magic, 0 otherwise */
+int elfinfo_is_elf(const char *path);
+
+/* Map the file; returns 0 on success, -1 if it cannot be read or is not ELF */
+int elfinfo_open(struct elfinfo *ei, const char *path);
+
+void elfinfo_close(struct elfinfo *ei);
+
+/* Return the offset and size of the section with the given name */
+int elfinfo_find_section(struct elfinfo *ei, const char *name, uint64_t *offset, uint64_t *size);
+
+/* Returns 1 if the file carries a symbol table or DWARF debug information */
+int elfinfo_has_debug_info(struct elfinfo *ei);
+
+/* Write the GNU build-id as a lowercase hex string into hex;
+ * returns 0 on success, -1 if there is no build-id */
+int elfinfo_build_id(struct elfinfo *ei, char *hex, size_t hexlen);
+
+/* Call cb with every string value of the given dynamic tag,
+ * e.g. DT_NEEDED or DT_SONAME; returns -1 if there is no dynamic section */
+int elfinfo_dynamic_strings(struct elfinfo *ei, int64_t tag, void (*cb)(const char *value, void *data), void *data);
+
+#endif /* __ELFINFO_H__ */
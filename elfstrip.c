@@ -0,0 +1,226 @@
+/*
+ * Strip the ELF files in an AppDir before it is packaged and keep their
+ * debug information in a separate directory next to the AppImage
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <elf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "elfinfo.h"
+#include "elfstrip.h"
+#include "parallel.h"
+
+struct strip_item {
+    gchar *path;             /* Absolute path of the ELF file */
+    const gchar *relpath;    /* Path inside the AppDir, points into path */
+    gchar *build_id;
+    gint64 size_before;
+    gint64 size_after;
+    gboolean shares_debug;   /* Another file with its build-id writes the debug file */
+    gchar *error;
+};
+
+struct strip_job {
+    GPtrArray *items;
+    const gchar *debug_dir;
+};
+
+/* Collect the ELF files that still carry debug information, each hard
+ * linked file once, as inodes remembers */
+static void find_unstripped_elf_files(const gchar *path, gsize prefix_len, GPtrArray *items, GHashTable *inodes)
+{
+    GDir *dir;
+    const gchar *entry;
+
+    dir = g_dir_open(path, 0, NULL);
+    if (dir == NULL) {
+        g_warning("%s: %s", path, g_strerror(errno));
+        return;
+    }
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        gchar *full_name = g_build_filename(path, entry, NULL);
+        if (g_file_test(full_name, G_FILE_TEST_IS_SYMLINK)) {
+            g_free(full_name);
+        } else if (g_file_test(full_name, G_FILE_TEST_IS_DIR)) {
+            find_unstripped_elf_files(full_name, prefix_len, items, inodes);
+            g_free(full_name);
+        } else if (elfinfo_is_elf(full_name)) {
+            struct elfinfo ei;
+            struct strip_item *item = NULL;
+            struct stat st;
+            gchar *inode = NULL;
+            if (stat(full_name, &st) == 0) {
+                inode = g_strdup_printf("%llu:%llu", (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+                if (g_hash_table_lookup(inodes, inode) != NULL) {
+                    g_free(inode);
+                    g_free(full_name);
+                    continue;
+                }
+                g_hash_table_insert(inodes, inode, inode);
+            }
+            if (elfinfo_open(&ei, full_name) == 0) {
+                /* Relocatable objects and kernel modules need their symbols */
+                if ((ei.type == ET_EXEC || ei.type == ET_DYN) && elfinfo_has_debug_info(&ei)) {
+                    char build_id[2 * 64 + 1];
+                    item = g_new0(struct strip_item, 1);
+                    item->path = full_name;
+                    item->relpath = full_name + prefix_len;
+                    if (elfinfo_build_id(&ei, build_id, sizeof(build_id)) == 0)
+                        item->build_id = g_strdup(build_id);
+                    g_ptr_array_add(items, item);
+                }
+                elfinfo_close(&ei);
+            }
+            if (item == NULL)
+                g_free(full_name);
+        } else {
+            g_free(full_name);
+        }
+    }
+    g_dir_close(dir);
+}
+
+static gint64 file_size(const gchar *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+/* Run a command synchronously; on failure, return its error output */
+static gboolean run_tool(gchar **argv, gchar **error_message)
+{
+    GError *error = NULL;
+    gchar *stderr_buf = NULL;
+    gint exit_status = 0;
+
+    if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                      NULL, NULL, NULL, &stderr_buf, &exit_status, &error)) {
+        *error_message = g_strdup_printf("%s: %s", argv[0], error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    if (!WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0) {
+        *error_message = g_strdup_printf("%s failed: %s", argv[0], g_strstrip(stderr_buf));
+        g_free(stderr_buf);
+        return FALSE;
+    }
+    g_free(stderr_buf);
+    return TRUE;
+}
+
+static void strip_one(size_t index, void *data)
+{
+    struct strip_job *job = data;
+    struct strip_item *item = g_ptr_array_index(job->items, index);
+    gchar *debug_file;
+    gchar *debug_parent;
+
+    item->size_before = file_size(item->path);
+
+    /* Name the debug file after the build-id if there is one, as gdb
+     * looks it up there; otherwise mirror the path inside the AppDir */
+    if (item->build_id && strlen(item->build_id) > 2) {
+        gchar *name = g_strdup_printf("%s.debug", item->build_id + 2);
+        gchar *prefix = g_strndup(item->build_id, 2);
+        debug_file = g_build_filename(job->debug_dir, ".build-id", prefix, name, NULL);
+        g_free(prefix);
+        g_free(name);
+    } else {
+        gchar *name = g_strdup_printf("%s.debug", item->relpath);
+        debug_file = g_build_filename(job->debug_dir, name, NULL);
+        g_free(name);
+    }
+    debug_parent = g_path_get_dirname(debug_file);
+    if (g_mkdir_with_parents(debug_parent, 0755) != 0) {
+        item->error = g_strdup_printf("Could not create %s: %s", debug_parent, g_strerror(errno));
+        goto out;
+    }
+
+    gchar *keep_debug[] = { "objcopy", "--only-keep-debug", item->path, debug_file, NULL };
+    if (!item->shares_debug && !run_tool(keep_debug, &item->error))
+        goto out;
+    gchar *strip[] = { "strip", "--strip-unneeded", item->path, NULL };
+    if (!run_tool(strip, &item->error))
+        goto out;
+    gchar *debuglink_arg = g_strdup_printf("--add-gnu-debuglink=%s", debug_file);
+    gchar *debuglink[] = { "objcopy", debuglink_arg, item->path, NULL };
+    run_tool(debuglink, &item->error);
+    g_free(debuglink_arg);
+
+out:
+    item->size_after = file_size(item->path);
+    g_free(debug_parent);
+    g_free(debug_file);
+}
+
+gint64 strip_elf_files(const gchar *appdir, const gchar *debug_dir, gboolean verbose)
+{
+    struct strip_job job;
+    GPtrArray *items = g_ptr_array_new();
+    GPtrArray *sharing = g_ptr_array_new();
+    GHashTable *inodes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *build_ids = g_hash_table_new(g_str_hash, g_str_equal);
+    gint64 saved_total = 0;
+    gboolean failed = FALSE;
+    guint i;
+
+    find_unstripped_elf_files(appdir, strlen(appdir) + 1, items, inodes);
+    if (verbose)
+        fprintf(stderr, "Found %u unstripped ELF files\n", items->len);
+
+    /* Copies of a file share its build-id and with it the debug file. Only
+     * the first one writes it, and the others, which link to it, are
+     * stripped once it is there. */
+    job.items = g_ptr_array_new();
+    job.debug_dir = debug_dir;
+    for (i = 0; i < items->len; i++) {
+        struct strip_item *item = g_ptr_array_index(items, i);
+        if (item->build_id != NULL && g_hash_table_lookup(build_ids, item->build_id) != NULL) {
+            item->shares_debug = TRUE;
+            g_ptr_array_add(sharing, item);
+        } else {
+            if (item->build_id != NULL)
+                g_hash_table_insert(build_ids, item->build_id, item);
+            g_ptr_array_add(job.items, item);
+        }
+    }
+    parallel_for(job.items->len, parallel_default_threads(), strip_one, &job);
+    g_ptr_array_free(job.items, TRUE);
+    job.items = sharing;
+    parallel_for(job.items->len, parallel_default_threads(), strip_one, &job);
+    g_ptr_array_free(sharing, TRUE);
+    g_hash_table_destroy(build_ids);
+    g_hash_table_destroy(inodes);
+
+    /* Report in a stable order once all workers are done */
+    for (i = 0; i < items->len; i++) {
+        struct strip_item *item = g_ptr_array_index(items, i);
+        if (item->error) {
+            fprintf(stderr, "Could not strip %s: %s\n", item->relpath, item->error);
+            failed = TRUE;
+        } else {
+            gint64 saved = item->size_before - item->size_after;
+            fprintf(stderr, "Stripped %s: %" G_GINT64_FORMAT " -> %" G_GINT64_FORMAT " bytes (saved %" G_GINT64_FORMAT ")\n",
+                    item->relpath, item->size_before, item->size_after, saved);
+            saved_total += saved;
+        }
+        g_free(item->path);
+        g_free(item->build_id);
+        g_free(item->error);
+        g_free(item);
+    }
+    fprintf(stderr, "Stripping saved %" G_GINT64_FORMAT " bytes in %u files, debug information is in %s\n",
+            saved_total, items->len, debug_dir);
+    g_ptr_array_free(items, TRUE);
+
+    return failed ? -1 : saved_total;
+}
@@ -0,0 +1,14 @@
+#ifndef __ELFSTRIP_H__
+#define __ELFSTRIP_H__
+
+#include <glib.h>
+
+/* Strip all unstripped ELF executables and shared libraries in appdir in
+ * parallel. The debug information of each file is kept in debug_dir,
+ * named after its build-id (.build-id/xx/yyyy.debug) so that debuggers can
+ * find it, and linked from the stripped file with a .gnu_debuglink section.
+ * Prints the bytes saved per file; returns the total number of bytes saved
+ * or -1 if a file could not be stripped. */
+gint64 strip_elf_files(const gchar *appdir, const gchar *debug_dir, gboolean verbose);
+
+#endif /* __ELFSTRIP_H__ */
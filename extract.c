@@ -0,0 +1,456 @@
+/*
+ * Parallel extraction of the squashfs filesystem in an AppImage, used by
+ * --appimage-extract
+ */
+
+#define _GNU_SOURCE
+
+#include "squashfuse.h"
+#include <squashfs_fs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "parallel.h"
+#include "extract.h"
+
+#include "ylog/ylog.h"
+
+/* Redraw the progress line at most this often */
+#define PROGRESS_INTERVAL_MS 100
+
+struct extract_file {
+    char *path;                 /* Including the prefix */
+    sqfs_inode inode;
+};
+
+struct extract_job {
+    const char *image;
+    unsigned long offset;
+    struct extract_file *files;
+    size_t count;
+    size_t allocated;
+    sqfs **handles;             /* One per worker, closed at the end */
+    int handle_count;
+    int threads;
+    pthread_mutex_t lock;       /* Protects everything below */
+    int failed;
+    size_t done_files;
+    uint64_t done_bytes;
+    uint64_t total_bytes;
+    int progress;               /* Draw the progress line */
+    long last_progress_ms;
+};
+
+/* The handle of the worker thread and the job it was opened for */
+static __thread struct extract_job *worker_job;
+static __thread sqfs *worker_fs;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called with job->lock held */
+static void draw_progress(struct extract_job *job, int force)
+{
+    long now = now_ms();
+    int percent;
+
+    if (!job->progress || (!force && now - job->last_progress_ms < PROGRESS_INTERVAL_MS))
+        return;
+    job->last_progress_ms = now;
+    percent = job->total_bytes > 0 ? (int) (job->done_bytes * 100 / job->total_bytes) : 100;
+    fprintf(stderr, "\rExtracting %zu/%zu files, %3d%%", job->done_files, job->count, percent);
+    if (force)
+        fprintf(stderr, "\n");
+}
+
+static void mark_failed(struct extract_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Create the missing directories leading to path, for entries that match
+ * a pattern while their parents do not */
+static int make_parents(const char *path, size_t skip)
+{
+    char *copy = strdup(path);
+    char *slash;
+    int ret = 0;
+
+    if (copy == NULL)
+        return -1;
+    for (slash = strchr(copy + skip, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(copy, 0777) == -1 && errno != EEXIST) {
+            perror(copy);
+            ret = -1;
+            break;
+        }
+        *slash = '/';
+    }
+    free(copy);
+    return ret;
+}
+
+static int add_file(struct extract_job *job, const char *path, const sqfs_inode *inode)
+{
+    if (job->count == job->allocated) {
+        size_t allocated = job->allocated ? job->allocated * 2 : 256;
+        struct extract_file *files = realloc(job->files, allocated * sizeof(*files));
+        if (files == NULL)
+            return -1;
+        job->files = files;
+        job->allocated = allocated;
+    }
+    job->files[job->count].path = strdup(path);
+    if (job->files[job->count].path == NULL)
+        return -1;
+    job->files[job->count].inode = *inode;
+    job->total_bytes += inode->xtra.reg.file_size;
+    job->count++;
+    return 0;
+}
+
+static int extract_symlink(sqfs *fs, sqfs_inode *inode, const char *path)
+{
+    size_t size = inode->xtra.symlink_size + 1;
+    char *target = malloc(size);
+    int ret = -1;
+
+    if (target == NULL)
+        return -1;
+    if (sqfs_readlink(fs, inode, target, &size) == SQFS_OK) {
+        ytrace("Symlink: %s to %s", path, target);
+        unlink(path);
+        ret = symlink(target, path);
+        if (ret != 0)
+            perror(path);
+    }
+    free(target);
+    return ret;
+}
+
+/* Walk the tree, create the directories and symlinks and queue the
+ * regular files for the workers */
+static int build_skeleton(struct extract_job *job, sqfs *fs, const char *prefix, const char *pattern)
+{
+    sqfs_err err = SQFS_OK;
+    sqfs_traverse trv;
+    size_t prefix_len = strlen(prefix);
+    char *path = NULL;
+    size_t path_size = 0;
+    int ret = 0;
+
+    if (sqfs_traverse_open(&trv, fs, sqfs_inode_root(fs)))
+        return -1;
+    while (ret == 0 && sqfs_traverse_next(&trv, &err)) {
+        sqfs_inode inode;
+        size_t len;
+
+        if (trv.dir_end)
+            continue;
+        if (pattern != NULL && fnmatch(pattern, trv.path, FNM_PATHNAME) != 0)
+            continue;
+        if (sqfs_inode_get(fs, &inode, trv.entry.inode)) {
+            ret = -1;
+            break;
+        }
+        len = prefix_len + strlen(trv.path) + 1;
+        if (len > path_size) {
+            char *grown = realloc(path, len);
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            path = grown;
+            path_size = len;
+        }
+        strcpy(path, prefix);
+        strcpy(path + prefix_len, trv.path);
+        if (pattern != NULL && make_parents(path, prefix_len) != 0) {
+            ret = -1;
+            break;
+        }
+
+        switch (inode.base.inode_type) {
+        case SQUASHFS_DIR_TYPE:
+        case SQUASHFS_LDIR_TYPE:
+            ytrace("mkdir: %s/", path);
+            if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+                perror(path);
+                ret = -1;
+            }
+            break;
+        case SQUASHFS_REG_TYPE:
+        case SQUASHFS_LREG_TYPE:
+            ret = add_file(job, path, &inode);
+            break;
+        case SQUASHFS_SYMLINK_TYPE:
+        case SQUASHFS_LSYMLINK_TYPE:
+            ret = extract_symlink(fs, &inode, path);
+            break;
+        default:
+            ywarn("Not extracting %s of inode type %i", path, inode.base.inode_type);
+            break;
+        }
+    }
+    if (err)
+        ret = -1;
+    sqfs_traverse_close(&trv);
+    free(path);
+    return ret;
+}
+
+static sqfs *open_worker_fs(struct extract_job *job)
+{
+    sqfs *fs;
+
+    if (worker_job == job)
+        return worker_fs;
+    fs = calloc(1, sizeof(*fs));
+    if (fs == NULL || sqfs_open_image(fs, job->image, job->offset) != SQFS_OK) {
+        free(fs);
+        return NULL;
+    }
+    pthread_mutex_lock(&job->lock);
+    /* parallel_for() runs no more than job->threads workers */
+    if (job->handle_count == job->threads) {
+        pthread_mutex_unlock(&job->lock);
+        sqfs_destroy(fs);
+        sqfs_fd_close(fs->fd);
+        free(fs);
+        return NULL;
+    }
+    job->handles[job->handle_count++] = fs;
+    pthread_mutex_unlock(&job->lock);
+    worker_job = job;
+    worker_fs = fs;
+    return fs;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int is_zero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/* Let the kernel copy len bytes at pos in the image to off in fd, which
+ * saves reading them into userspace and lets NFS copy on the server.
+ * Returns -1 if it cannot for this pair of files, e.g. before Linux 5.3
+ * across filesystems; the caller then writes the range itself. */
+static int copy_range(int from, off_t pos, int to, off_t off, size_t len)
+{
+#ifdef SYS_copy_file_range
+    while (len > 0) {
+        loff_t in = pos;
+        loff_t out = off;
+        ssize_t n = syscall(SYS_copy_file_range, from, &in, to, &out, len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        pos += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Zeros are left as a hole. The file is already len bytes long, so
+ * there is nothing to do unless its blocks were preallocated. */
+static int write_range(int fd, const char *buf, size_t len, off_t off, int preallocated)
+{
+    if (!is_zero(buf, len))
+        return pwrite_all(fd, buf, len, off);
+    if (preallocated)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+    return 0;
+}
+
+static void add_progress(struct extract_job *job, uint64_t bytes)
+{
+    pthread_mutex_lock(&job->lock);
+    job->done_bytes += bytes;
+    draw_progress(job, 0);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Write the blocks of a file one by one: sparse blocks become holes,
+ * uncompressed ones are copied from the image by the kernel and only the
+ * compressed ones and the tail in a fragment are decompressed */
+static int extract_blocks(struct extract_job *job, sqfs *fs, sqfs_inode *inode, int fd)
+{
+    uint64_t size = inode->xtra.reg.file_size;
+    uint64_t off = 0;
+    size_t blocks = sqfs_blocklist_count(fs, inode);
+    int preallocated;
+    int can_copy = 1;
+    sqfs_blocklist bl;
+
+    /* Keep the file in one piece where the filesystem can */
+    preallocated = size > 0 && fallocate(fd, 0, 0, size) == 0;
+    if (!preallocated && ftruncate(fd, size) != 0)
+        return -1;
+
+    sqfs_blocklist_init(fs, inode, &bl);
+    for (; blocks > 0 && off < size; blocks--) {
+        size_t len = size - off < fs->sb.block_size ? size - off : fs->sb.block_size;
+        bool compressed;
+        uint32_t stored;
+
+        if (sqfs_blocklist_next(&bl) != SQFS_OK)
+            return -1;
+        if (bl.header == 0) {
+            if (preallocated)
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+        } else {
+            sqfs_data_header(bl.header, &compressed, &stored);
+            if (compressed || !can_copy || copy_range(fs->fd, fs->offset + bl.block, fd, off, len) != 0) {
+                sqfs_block *block;
+                if (!compressed)
+                    can_copy = 0;
+                if (sqfs_data_block_read(fs, bl.block, bl.header, &block) != SQFS_OK)
+                    return -1;
+                if (block->size != len || write_range(fd, block->data, len, off, preallocated) != 0) {
+                    sqfs_block_dispose(block);
+                    return -1;
+                }
+                sqfs_block_dispose(block);
+            }
+        }
+        off += len;
+        add_progress(job, len);
+    }
+
+    if (off < size) {
+        sqfs_off_t len = size - off;
+        char *buf = malloc(len);
+        int ret = -1;
+        if (buf != NULL && sqfs_read_range(fs, inode, off, &len, buf) == SQFS_OK
+            && (uint64_t) len == size - off)
+            ret = write_range(fd, buf, len, off, preallocated);
+        free(buf);
+        if (ret != 0)
+            return -1;
+        add_progress(job, len);
+    }
+    return 0;
+}
+
+static void extract_one(size_t index, void *data)
+{
+    struct extract_job *job = data;
+    struct extract_file *file = &job->files[index];
+    sqfs *fs;
+    int fd;
+
+    ytrace("Extract to: %s", file->path);
+    fs = open_worker_fs(job);
+    if (fs == NULL) {
+        mark_failed(job);
+        return;
+    }
+    fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror(file->path);
+        mark_failed(job);
+        return;
+    }
+    if (extract_blocks(job, fs, &file->inode, fd) != 0) {
+        yerror("Could not extract %s", file->path);
+        close(fd);
+        mark_failed(job);
+        return;
+    }
+    if (fchmod(fd, file->inode.base.mode & 07777) != 0 || close(fd) != 0) {
+        perror(file->path);
+        mark_failed(job);
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->done_files++;
+    draw_progress(job, 0);
+    pthread_mutex_unlock(&job->lock);
+}
+
+int appimage_extract(const char *image, unsigned long offset, const char *prefix, const char *pattern, int threads)
+{
+    struct extract_job job;
+    sqfs fs;
+    size_t i;
+    int h;
+
+    memset(&job, 0, sizeof(job));
+    job.image = image;
+    job.offset = offset;
+    job.threads = threads < 1 ? 1 : threads;
+    job.progress = isatty(STDERR_FILENO);
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (mkdir(prefix, 0777) == -1 && errno != EEXIST) {
+        perror("mkdir error");
+        return -1;
+    }
+    if (sqfs_open_image(&fs, image, offset))
+        return -1;
+    if (build_skeleton(&job, &fs, prefix, pattern) != 0)
+        job.failed = 1;
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    if (!job.failed) {
+        job.handles = calloc(job.threads, sizeof(*job.handles));
+        if (job.handles == NULL)
+            job.failed = 1;
+        else
+            parallel_for(job.count, job.threads, extract_one, &job);
+        worker_job = NULL;
+    }
+    draw_progress(&job, 1);
+
+    for (h = 0; h < job.handle_count; h++) {
+        sqfs_destroy(job.handles[h]);
+        sqfs_fd_close(job.handles[h]->fd);
+        free(job.handles[h]);
+    }
+    free(job.handles);
+    for (i = 0; i < job.count; i++)
+        free(job.files[i].path);
+    free(job.files);
+    pthread_mutex_destroy(&job.lock);
+    return job.failed ? -1 : 0;
+}
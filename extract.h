@@ -0,0 +1,20 @@
+#ifndef __EXTRACT_H__
+#define __EXTRACT_H__
+
+/* Extraction of the squashfs filesystem in an AppImage.
+ *
+ * The tree is walked once on the calling thread, which creates the
+ * directories and symlinks right away. The regular files are then written
+ * by a pool of workers, each reading through a squashfs handle of its own
+ * so that decompression runs on all cores. Sparse and all-zero blocks are
+ * left as holes and uncompressed blocks are copied by the kernel, so only
+ * compressed data passes through the workers. */
+
+/* Extract the filesystem at offset in image below prefix, or only the
+ * entries whose path matches the fnmatch() pattern if it is not NULL.
+ * A progress line is shown while stderr is a terminal; the individual
+ * entries are logged at trace level. Returns 0 on success and -1 if any
+ * entry could not be extracted. */
+int appimage_extract(const char *image, unsigned long offset, const char *prefix, const char *pattern, int threads);
+
+#endif /* __EXTRACT_H__ */
@@ -0,0 +1,336 @@
+/*
+ * Cache of extracted AppImages for extract-and-run, keyed by the digest of
+ * the image
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "md5.h"
+#include "parallel.h"
+#include "extract.h"
+#include "extractcache.h"
+
+#include "ylog/ylog.h"
+
+#define CACHE_DEFAULT_SIZE (2ULL << 30)
+
+/* Stamps map the identity of an image file to its digest */
+#define STAMPS_DIR "stamps"
+
+struct cache_entry {
+    char name[33];
+    time_t used;
+    uint64_t size;
+};
+
+static uint64_t cache_limit(void)
+{
+    const char *value = getenv("APPIMAGE_EXTRACT_CACHE_SIZE");
+    char *end;
+    uint64_t limit;
+
+    if (value == NULL || *value == '\0')
+        return CACHE_DEFAULT_SIZE;
+    limit = strtoull(value, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': limit <<= 10; /* fall through */
+    case 'M': case 'm': limit <<= 10; /* fall through */
+    case 'K': case 'k': limit <<= 10; break;
+    case '\0': break;
+    default:
+        ywarn("Ignoring APPIMAGE_EXTRACT_CACHE_SIZE=%s", value);
+        return CACHE_DEFAULT_SIZE;
+    }
+    return limit;
+}
+
+static char *cache_base(void)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *base;
+
+    if (xdg != NULL && *xdg == '/') {
+        if (asprintf(&base, "%s/appimage-extract", xdg) == -1)
+            return NULL;
+    } else if (home != NULL) {
+        if (asprintf(&base, "%s/.cache/appimage-extract", home) == -1)
+            return NULL;
+    } else {
+        return NULL;
+    }
+    return base;
+}
+
+static int make_dirs(const char *path)
+{
+    char *copy = strdup(path);
+    char *slash;
+    int ret = 0;
+
+    if (copy == NULL)
+        return -1;
+    for (slash = strchr(copy + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL)
+            *slash = '\0';
+        if (mkdir(copy, 0700) == -1 && errno != EEXIST) {
+            perror(copy);
+            ret = -1;
+            break;
+        }
+        if (slash == NULL)
+            break;
+        *slash = '/';
+    }
+    free(copy);
+    return ret;
+}
+
+/* MD5 as in the thumbnail names of appimaged */
+static int image_digest(const char *image, char hex[33])
+{
+    unsigned char digest[16];
+    FILE *f = fopen(image, "rb");
+    int i;
+
+    if (f == NULL)
+        return -1;
+    if (md5_stream(f, digest) != 0) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    for (i = 0; i < 16; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    return 0;
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+static void remove_tree(const char *path)
+{
+    nftw(path, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static uint64_t read_size(const char *entry)
+{
+    char path[PATH_MAX];
+    unsigned long long size = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/size", entry);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%llu", &size) != 1)
+        size = 0;
+    fclose(f);
+    return size;
+}
+
+static int write_size(const char *entry, uint64_t size)
+{
+    char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/size", entry);
+    f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "%llu\n", (unsigned long long) size);
+    return fclose(f);
+}
+
+/* nftw() has no way to pass state to its callback */
+static uint64_t tree_size;
+
+static int add_size(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    tree_size += (uint64_t) st->st_blocks * 512;
+    return 0;
+}
+
+static int compare_used(const void *a, const void *b)
+{
+    const struct cache_entry *ea = a;
+    const struct cache_entry *eb = b;
+    return ea->used < eb->used ? -1 : ea->used > eb->used;
+}
+
+/* Remove the entries that were used longest ago until the cache fits its
+ * limit. Entries locked by a running app and the current one are kept. */
+static void evict(const char *base, const char *current)
+{
+    uint64_t limit = cache_limit();
+    struct cache_entry *entries = NULL;
+    size_t count = 0, allocated = 0, i;
+    uint64_t total = 0;
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+
+    dir = opendir(base);
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen(de->d_name) != 32)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", base, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        if (count == allocated) {
+            struct cache_entry *grown;
+            allocated = allocated ? allocated * 2 : 16;
+            grown = realloc(entries, allocated * sizeof(*entries));
+            if (grown == NULL)
+                break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, de->d_name);
+        entries[count].used = st.st_mtime;
+        entries[count].size = read_size(path);
+        total += entries[count].size;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(*entries), compare_used);
+    for (i = 0; i < count && total > limit; i++) {
+        int fd;
+        if (strcmp(entries[i].name, current) == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/lock", base, entries[i].name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            close(fd);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", base, entries[i].name);
+        ydebug("Evicting %s", path);
+        remove_tree(path);
+        total -= entries[i].size;
+        if (fd != -1)
+            close(fd);
+    }
+    free(entries);
+
+    /* Drop the stamps of evicted entries */
+    snprintf(path, sizeof(path), "%s/" STAMPS_DIR, base);
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/" STAMPS_DIR "/%s", base, de->d_name);
+        if (stat(path, &st) != 0)
+            unlink(path);
+    }
+    closedir(dir);
+}
+
+char *extract_cache_get(const char *image, unsigned long offset, int *lock_fd)
+{
+    char *base = cache_base();
+    char stamp[PATH_MAX], entry[PATH_MAX], path[PATH_MAX], staging[PATH_MAX];
+    char key[33];
+    char *root = NULL;
+    struct stat st;
+    ssize_t len;
+    int fd = -1;
+    int extract_fd = -1;
+
+    if (base == NULL || stat(image, &st) != 0)
+        goto out;
+    snprintf(path, sizeof(path), "%s/" STAMPS_DIR, base);
+    if (make_dirs(path) != 0)
+        goto out;
+
+    snprintf(stamp, sizeof(stamp), "%s/" STAMPS_DIR "/%llx-%llx-%llx-%lld.%09ld", base,
+             (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+             (unsigned long long) st.st_size, (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    /* Stamps are symlinks to ../<digest> */
+    len = readlink(stamp, path, sizeof(path));
+    if (len == 35 && strncmp(path, "../", 3) == 0) {
+        memcpy(key, path + 3, 32);
+        key[32] = '\0';
+    } else if (image_digest(image, key) != 0) {
+        goto out;
+    }
+
+    snprintf(entry, sizeof(entry), "%s/%s", base, key);
+    if (mkdir(entry, 0700) == -1 && errno != EEXIST)
+        goto out;
+    snprintf(path, sizeof(path), "%s/lock", entry);
+    fd = open(path, O_RDONLY | O_CREAT, 0600);
+    /* Running apps hold the lock shared, which keeps the entry, see
+     * evict(). It is never taken exclusively here, so a launch does not
+     * wait for the apps of other launches to exit. */
+    if (fd == -1 || flock(fd, LOCK_SH) != 0)
+        goto out;
+
+    snprintf(path, sizeof(path), "%s/root", entry);
+    if (access(path, F_OK) != 0) {
+        /* Only one launch extracts, and the others wait for it */
+        snprintf(staging, sizeof(staging), "%s/extract.lock", entry);
+        extract_fd = open(staging, O_RDONLY | O_CREAT, 0600);
+        if (extract_fd == -1 || flock(extract_fd, LOCK_EX) != 0)
+            goto out;
+    }
+    if (access(path, F_OK) != 0) {
+        snprintf(staging, sizeof(staging), "%s/root.partial/", entry);
+        remove_tree(staging);
+        fprintf(stderr, "Cannot mount the AppImage, extracting it to %s\n", path);
+        if (appimage_extract(image, offset, staging, NULL, parallel_default_threads()) != 0
+            || rename(staging, path) != 0) {
+            remove_tree(staging);
+            goto out;
+        }
+        tree_size = 0;
+        nftw(path, add_size, 16, FTW_PHYS);
+        write_size(entry, tree_size);
+    }
+    if (extract_fd != -1)
+        close(extract_fd);
+    extract_fd = -1;
+
+    unlink(stamp);
+    snprintf(staging, sizeof(staging), "../%s", key);
+    if (symlink(staging, stamp) != 0)
+        ywarn("Could not write %s", stamp);
+    /* The directory's mtime is the time of last use */
+    utimes(entry, NULL);
+    evict(base, key);
+
+    root = strdup(path);
+    *lock_fd = fd;
+    fd = -1;
+out:
+    if (extract_fd != -1)
+        close(extract_fd);
+    if (fd != -1)
+        close(fd);
+    free(base);
+    return root;
+}
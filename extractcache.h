@@ -0,0 +1,21 @@
+#ifndef __EXTRACTCACHE_H__
+#define __EXTRACTCACHE_H__
+
+/* Extract-and-run for hosts without FUSE.
+ *
+ * AppImages are extracted below $XDG_CACHE_HOME/appimage-extract into a
+ * directory named after the MD5 digest of the image, so that the same
+ * image is extracted only once however it is named or wherever it is.
+ * Hashing the image on every launch would take as long as reading it, so
+ * the digest is remembered in a stamp named after the device, inode, size
+ * and mtime of the file. Entries that have not been used for the longest
+ * time are removed once the cache grows beyond APPIMAGE_EXTRACT_CACHE_SIZE
+ * bytes (K, M and G suffixes are accepted), 2G by default. */
+
+/* Return the malloc()ed path of the extracted tree of the filesystem at
+ * offset in image, extracting it unless an earlier launch did. lock_fd
+ * receives a descriptor that is inherited across exec() and keeps the
+ * entry from being evicted while the app runs. Returns NULL on error. */
+char *extract_cache_get(const char *image, unsigned long offset, int *lock_fd);
+
+#endif /* __EXTRACTCACHE_H__ */
@@ -0,0 +1,441 @@
+/*
+ * FUSE request handling that the runtime adds on top of squashfuse
+ *
+ * The runtime is linked with -Wl,--wrap=fuse_lowlevel_new and
+ * -Wl,--wrap=fuse_session_loop, so that the operations squashfuse registers
+ * and the loop it runs pass through here, without patching squashfuse
+ * itself:
+ *
+ * - Reads that fall into blocks stored uncompressed, such as those of the
+ *   files of appimagetool --hot and --uncompressed-elf, are answered with
+ *   a buffer that points into the image file, which libfuse splices into
+ *   /dev/fuse without copying it through the runtime, instead of through
+ *   the squashfuse block cache.
+ * - Requests are handled by APPIMAGE_FUSE_THREADS worker threads. The
+ *   squashfuse caches and inode table are not thread-safe, so reads, where
+ *   the decompression happens, go through a squashfs handle of each
+ *   worker's own with its own metadata caches, and all other operations
+ *   are serialized on the shared one. Decompressed data blocks are shared
+ *   by all workers, see blockcache.h.
+ * - Once mounted, the blocks in the startup profile of the image are read
+ *   into that cache in the background, see prefetch.h.
+ * - With --appimage-trace, lookups, getattrs, opens, reads and readdirs
+ *   are recorded, see trace.h.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "squashfuse.h"
+#include "ll.h"
+#include "prefetch.h"
+#include "trace.h"
+
+#define DIRECT_SLOTS 1024
+
+/* Without APPIMAGE_FUSE_THREADS, one worker per CPU up to this many */
+#define FUSE_DEFAULT_MAX_THREADS 8
+#define FUSE_MAX_THREADS 64
+
+/* Blocks that are compressed, sparse or not full size */
+#define DIRECT_NONE UINT64_MAX
+
+struct direct_slot {
+    fuse_ino_t ino;
+    int known;
+    size_t count;
+    uint64_t *blocks;   /* Where each block starts, relative to the squashfs image, or DIRECT_NONE */
+};
+
+static struct direct_slot direct_slots[DIRECT_SLOTS];
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards the squashfs handle and inode table of squashfuse */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static int multithreaded;
+static __thread sqfs *worker_fs;
+
+static struct fuse_lowlevel_ops ops;
+static struct fuse_lowlevel_ops real_ops;
+
+/* The squashfs handle of the calling worker, or NULL if there is none and
+ * the shared one has to be used under fs_lock. The handles live as long as
+ * the process, which ends with the session. */
+static sqfs *request_fs(sqfs_ll *ll)
+{
+    if (!multithreaded)
+        return NULL;
+    if (worker_fs == NULL) {
+        sqfs *fs = malloc(sizeof(sqfs));
+        if (fs == NULL)
+            return NULL;
+        if (sqfs_init(fs, ll->fs.fd, ll->fs.offset) != SQFS_OK) {
+            free(fs);
+            return NULL;
+        }
+        worker_fs = fs;
+    }
+    return worker_fs;
+}
+
+/* Map the data blocks of a file that are stored uncompressed in full size.
+ * blocks is NULL if there are none, and the file is always read through
+ * squashfuse. The tail of a file in a fragment is not mapped. */
+static void map_blocks(sqfs *fs, sqfs_inode *inode, struct direct_slot *slot)
+{
+    sqfs_blocklist bl;
+    uint64_t remaining = inode->xtra.reg.file_size;
+    size_t count = sqfs_blocklist_count(fs, inode);
+    size_t i, direct = 0;
+
+    slot->count = 0;
+    slot->blocks = NULL;
+    if (count == 0 || (slot->blocks = malloc(count * sizeof(uint64_t))) == NULL)
+        return;
+    sqfs_blocklist_init(fs, inode, &bl);
+    for (i = 0; i < count; i++) {
+        bool compressed;
+        uint32_t size;
+        uint32_t expected_size = remaining < fs->sb.block_size ? remaining : fs->sb.block_size;
+
+        if (sqfs_blocklist_next(&bl) != SQFS_OK)
+            break;
+        slot->blocks[i] = DIRECT_NONE;
+        remaining -= expected_size;
+        if (bl.header == 0)
+            continue;
+        sqfs_data_header(bl.header, &compressed, &size);
+        if (compressed || size != expected_size)
+            continue;
+        slot->blocks[i] = bl.block;
+        direct++;
+    }
+    if (direct == 0) {
+        free(slot->blocks);
+        slot->blocks = NULL;
+        return;
+    }
+    slot->count = i;
+}
+
+/* Whether the size bytes at off in the file are all in uncompressed blocks
+ * that follow each other in the image, and if so, where they start */
+static int lookup_direct(sqfs *fs, fuse_ino_t ino, sqfs_inode *inode, off_t off, size_t size, uint64_t *pos)
+{
+    struct direct_slot *slot = &direct_slots[ino % DIRECT_SLOTS];
+    size_t block_size = fs->sb.block_size;
+    size_t first = off / block_size;
+    size_t last = (off + size - 1) / block_size;
+    size_t i;
+    int direct = 0;
+
+    pthread_mutex_lock(&direct_lock);
+    if (!slot->known || slot->ino != ino) {
+        free(slot->blocks);
+        map_blocks(fs, inode, slot);
+        slot->ino = ino;
+        slot->known = 1;
+    }
+    if (last < slot->count && slot->blocks[first] != DIRECT_NONE) {
+        direct = 1;
+        for (i = first + 1; i <= last && direct; i++)
+            direct = slot->blocks[i] == slot->blocks[i - 1] + block_size;
+        *pos = slot->blocks[first] + off % block_size;
+    }
+    pthread_mutex_unlock(&direct_lock);
+    return direct;
+}
+
+/* What squashfuse does for a read, with the squashfs handle of the worker */
+static void worker_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    sqfs_ll *ll = fuse_req_userdata(req);
+    sqfs_inode *inode = (sqfs_inode *) (intptr_t) fi->fh;
+    sqfs *fs = request_fs(ll);
+    sqfs_off_t osize = size;
+    char *buf;
+
+    if (fs == NULL) {
+        pthread_mutex_lock(&fs_lock);
+        real_ops.read(req, ino, size, off, fi);
+        pthread_mutex_unlock(&fs_lock);
+        return;
+    }
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if (sqfs_read_range(fs, inode, off, &osize, buf) != SQFS_OK)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_buf(req, osize > 0 ? buf : NULL, osize);
+    free(buf);
+}
+
+static void direct_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    sqfs_ll *ll = fuse_req_userdata(req);
+    sqfs_inode *inode = (sqfs_inode *) (intptr_t) fi->fh;
+    sqfs *fs = request_fs(ll);
+    uint64_t pos;
+    int direct;
+
+    if ((uint64_t) off >= inode->xtra.reg.file_size || size == 0) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (size > inode->xtra.reg.file_size - off)
+        size = inode->xtra.reg.file_size - off;
+    if (fs != NULL) {
+        direct = lookup_direct(fs, ino, inode, off, size, &pos);
+    } else {
+        pthread_mutex_lock(&fs_lock);
+        direct = lookup_direct(&ll->fs, ino, inode, off, size, &pos);
+        pthread_mutex_unlock(&fs_lock);
+    }
+    if (!direct) {
+        worker_read(req, ino, size, off, fi);
+        return;
+    }
+
+    /* libfuse splices from the image file into /dev/fuse where the kernel
+     * allows it, so the data never leaves the page cache of the image */
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    buf.buf[0].fd = ll->fs.fd;
+    buf.buf[0].pos = ll->fs.offset + pos;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void traced_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct trace_op t;
+
+    trace_begin(&t, "read", ino);
+    t.off = off;
+    t.size = size;
+    direct_read(req, ino, size, off, fi);
+    trace_end(&t);
+}
+
+static void direct_init(void *userdata, struct fuse_conn_info *conn)
+{
+    sqfs_ll *ll = userdata;
+    if (real_ops.init != NULL)
+        real_ops.init(userdata, conn);
+    /* Splice requests out of and replies into /dev/fuse, see direct_read() */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    prefetch_start(ll->fs.fd, ll->fs.offset);
+}
+
+/* The squashfuse operations other than read, one at a time */
+#define LOCKED(call) do { \
+        pthread_mutex_lock(&fs_lock); \
+        call; \
+        pthread_mutex_unlock(&fs_lock); \
+    } while (0)
+
+static void locked_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct trace_op t;
+
+    trace_begin(&t, "lookup", 0);
+    t.parent = parent;
+    t.name = name;
+    LOCKED(real_ops.lookup(req, parent, name));
+    trace_end(&t);
+}
+
+static void locked_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    LOCKED(real_ops.forget(req, ino, nlookup));
+}
+
+static void locked_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct trace_op t;
+
+    trace_begin(&t, "getattr", ino);
+    LOCKED(real_ops.getattr(req, ino, fi));
+    trace_end(&t);
+}
+
+static void locked_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    LOCKED(real_ops.readlink(req, ino));
+}
+
+static void locked_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct trace_op t;
+
+    trace_begin(&t, "open", ino);
+    LOCKED(real_ops.open(req, ino, fi));
+    trace_end(&t);
+}
+
+static void locked_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOCKED(real_ops.release(req, ino, fi));
+}
+
+static void locked_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOCKED(real_ops.opendir(req, ino, fi));
+}
+
+static void locked_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct trace_op t;
+
+    trace_begin(&t, "readdir", ino);
+    t.off = off;
+    t.size = size;
+    LOCKED(real_ops.readdir(req, ino, size, off, fi));
+    trace_end(&t);
+}
+
+static void locked_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOCKED(real_ops.releasedir(req, ino, fi));
+}
+
+static void locked_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    LOCKED(real_ops.statfs(req, ino));
+}
+
+static void locked_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    LOCKED(real_ops.getxattr(req, ino, name, size));
+}
+
+static void locked_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    LOCKED(real_ops.listxattr(req, ino, size));
+}
+
+struct fuse_session *__real_fuse_lowlevel_new(struct fuse_args *args, const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata);
+
+struct fuse_session *__wrap_fuse_lowlevel_new(struct fuse_args *args, const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata)
+{
+    memset(&real_ops, 0, sizeof(real_ops));
+    memcpy(&real_ops, op, op_size < sizeof(real_ops) ? op_size : sizeof(real_ops));
+    ops = real_ops;
+    if (ops.read != NULL)
+        ops.read = traced_read;
+    ops.init = direct_init;
+#define WRAP(name) if (ops.name != NULL) ops.name = locked_##name
+    WRAP(lookup);
+    WRAP(forget);
+    WRAP(getattr);
+    WRAP(readlink);
+    WRAP(open);
+    WRAP(release);
+    WRAP(opendir);
+    WRAP(readdir);
+    WRAP(releasedir);
+    WRAP(statfs);
+    WRAP(getxattr);
+    WRAP(listxattr);
+#undef WRAP
+    return __real_fuse_lowlevel_new(args, &ops, sizeof(ops), userdata);
+}
+
+static int fuse_threads(void)
+{
+    const char *env = getenv("APPIMAGE_FUSE_THREADS");
+    long threads;
+
+    if (env != NULL && *env != '\0') {
+        threads = strtol(env, NULL, 10);
+    } else {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > FUSE_DEFAULT_MAX_THREADS)
+            threads = FUSE_DEFAULT_MAX_THREADS;
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > FUSE_MAX_THREADS)
+        threads = FUSE_MAX_THREADS;
+    return threads;
+}
+
+/* What fuse_session_loop() does, on every worker */
+static void *session_worker(void *arg)
+{
+    struct fuse_session *se = arg;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = malloc(bufsize);
+    int res = 0;
+    int oldstate;
+
+    if (buf == NULL) {
+        fuse_session_exit(se);
+        return (void *) (intptr_t) -ENOMEM;
+    }
+    /* As in fuse_loop_mt(), a worker can only be cancelled while it waits
+     * for a request, never while it holds fs_lock, direct_lock or the lock
+     * of a cache shard */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_cleanup_push(free, buf);
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf = { .mem = buf, .size = bufsize };
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        fuse_session_process_buf(se, &fbuf, tmpch);
+    }
+    pthread_cleanup_pop(1);
+    pthread_setcancelstate(oldstate, NULL);
+    fuse_session_exit(se);
+    return (void *) (intptr_t) (res < 0 ? res : 0);
+}
+
+int __real_fuse_session_loop(struct fuse_session *se);
+
+int __wrap_fuse_session_loop(struct fuse_session *se)
+{
+    pthread_t workers[FUSE_MAX_THREADS];
+    int threads = fuse_threads();
+    int started = 0;
+    sigset_t all, old;
+    intptr_t res;
+    int i;
+
+    if (threads == 1)
+        return __real_fuse_session_loop(se);
+    multithreaded = 1;
+
+    /* The signal handlers that end the session run on the calling thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 1; i < threads; i++)
+        if (pthread_create(&workers[started], NULL, session_worker, se) == 0)
+            started++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    res = (intptr_t) session_worker(se);
+    for (i = 0; i < started; i++) {
+        pthread_cancel(workers[i]);
+        pthread_join(workers[i], NULL);
+    }
+    fuse_session_reset(se);
+    return res < 0 ? -1 : 0;
+}
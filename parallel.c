@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+/* Shared state of one parallel_for() run; workers pull the next index
+ * under the mutex until the range is exhausted */
+struct parallel_job {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t count;
+    void (*fn)(size_t index, void *data);
+    void *data;
+};
+
+int parallel_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+    return (int) n;
+}
+
+static void *parallel_worker(void *arg)
+{
+    struct parallel_job *job = arg;
+    size_t index;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        index = job->next;
+        if (index < job->count)
+            job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (index >= job->count)
+            break;
+        job->fn(index, job->data);
+    }
+    return NULL;
+}
+
+int parallel_for(size_t count, int threads, void (*fn)(size_t index, void *data), void *data)
+{
+    struct parallel_job job;
+    pthread_t *tids;
+    int started = 0;
+    int i;
+
+    if (count == 0)
+        return 0;
+    if (threads < 1)
+        threads = parallel_default_threads();
+    if ((size_t) threads > count)
+        threads = (int) count;
+
+    job.next = 0;
+    job.count = count;
+    job.fn = fn;
+    job.data = data;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* A single worker runs on the calling thread, no need to spawn one */
+    if (threads == 1) {
+        parallel_worker(&job);
+        pthread_mutex_destroy(&job.lock);
+        return 0;
+    }
+
+    /* The calling thread is one of the workers, spawn the others. It also
+     * covers the case in which not a single one could be started. */
+    tids = malloc(sizeof(pthread_t) * (threads - 1));
+    if (tids == NULL) {
+        parallel_worker(&job);
+        pthread_mutex_destroy(&job.lock);
+        return 0;
+    }
+    for (i = 0; i < threads - 1; i++) {
+        if (pthread_create(&tids[i], NULL, parallel_worker, &job) == 0)
+            started++;
+        else
+            break;
+    }
+    parallel_worker(&job);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    pthread_mutex_destroy(&job.lock);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <stddef.h>
+
+/* Number of worker threads to use when the caller has no preference */
+int parallel_default_threads(void);
+
+/* Call fn(index, data) for every index in [0, count) on up to threads
+ * worker threads, the calling thread included. Indices are handed out in
+ * ascending order. Returns 0 once all calls have finished. */
+int parallel_for(size_t count, int threads, void (*fn)(size_t index, void *data), void *data);
+
+#endif /* __PARALLEL_H__ */
@@ -0,0 +1,117 @@
+/*
+ * Background prefetch of the startup profile, see prefetch.h
+ */
+
+#include "squashfuse.h"
+#include <squashfs_fs.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aiheader.h"
+#include "blockcache.h"
+#include "prefetch.h"
+
+#include "ylog/ylog.h"
+
+struct prefetch_job {
+    int fd;
+    size_t offset;
+};
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char *p)
+{
+    return le32(p) | ((uint64_t) le32(p + 4) << 32);
+}
+
+/* Read the entries of the profile, or return NULL if there is none */
+static unsigned char *read_profile(int fd, uint32_t *count)
+{
+    char path[64];
+    unsigned long offset = 0;
+    unsigned long length = 0;
+    unsigned char head[sizeof(struct prefetch_header)];
+    unsigned char *entries;
+    size_t size;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    appimage_get_section(path, PREFETCH_SECTION, &offset, &length);
+    if (offset == 0 || length < sizeof(head))
+        return NULL;
+    if (pread(fd, head, sizeof(head), offset) != sizeof(head)
+        || memcmp(head, PREFETCH_MAGIC, 8) != 0 || le32(head + 8) != PREFETCH_VERSION)
+        return NULL;
+    *count = le32(head + 12);
+    if (*count == 0 || *count > (length - sizeof(head)) / PREFETCH_ENTRY_SIZE)
+        return NULL;
+    size = (size_t) *count * PREFETCH_ENTRY_SIZE;
+    entries = malloc(size);
+    if (entries == NULL || pread(fd, entries, size, offset + sizeof(head)) != (ssize_t) size) {
+        free(entries);
+        return NULL;
+    }
+    return entries;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    struct prefetch_job *job = arg;
+    unsigned char *entries;
+    uint32_t count = 0;
+    uint32_t i, cached = 0, full = 0;
+    sqfs fs;
+
+    entries = read_profile(job->fd, &count);
+    if (entries == NULL || sqfs_init(&fs, job->fd, job->offset) != SQFS_OK) {
+        free(entries);
+        free(job);
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        uint64_t pos = le64(entries + i * PREFETCH_ENTRY_SIZE);
+        uint32_t hdr = le32(entries + i * PREFETCH_ENTRY_SIZE + 8);
+        uint32_t size = hdr & ~SQUASHFS_COMPRESSED_BIT_BLOCK;
+
+        if (hdr & SQUASHFS_COMPRESSED_BIT_BLOCK) {
+            /* Stored uncompressed, the page cache is all it needs */
+            posix_fadvise(job->fd, job->offset + pos, size, POSIX_FADV_WILLNEED);
+            continue;
+        }
+        switch (blockcache_prefetch(&fs, pos, hdr)) {
+        case 0: cached++; break;
+        case 1: full++; break;
+        default: break;
+        }
+    }
+    ydebug("Prefetched %u of %u startup blocks, %u did not fit", cached, count, full);
+    sqfs_destroy(&fs);
+    free(entries);
+    free(job);
+    return NULL;
+}
+
+void prefetch_start(int fd, size_t offset)
+{
+    struct prefetch_job *job = malloc(sizeof(*job));
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (job == NULL)
+        return;
+    job->fd = fd;
+    job->offset = offset;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetch_thread, job) != 0)
+        free(job);
+    pthread_attr_destroy(&attr);
+}
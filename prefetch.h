@@ -0,0 +1,35 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Startup profile in the .prefetch section of the runtime
+ *
+ * appimagetool --startup-profile lists the blocks of the squashfs that an
+ * app reads while it starts, in the order in which it reads the files.
+ * Once mounted, the runtime reads and decompresses them into the block
+ * cache on a thread of its own, so that the app finds them there instead
+ * of waiting for each one while the dynamic loader is busy.
+ *
+ * The section starts with this header, followed by count entries of a
+ * 64-bit position relative to the start of the squashfs and the 32-bit
+ * header of the block as stored in the inode or fragment table. All
+ * fields are little endian. */
+
+#define PREFETCH_SECTION ".prefetch"
+#define PREFETCH_MAGIC "AIPREFCH"
+#define PREFETCH_VERSION 1
+#define PREFETCH_ENTRY_SIZE 12
+
+struct prefetch_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+/* Start reading the blocks listed in the .prefetch section of the AppImage
+ * open as fd, with the squashfs at offset, on a thread of its own */
+void prefetch_start(int fd, size_t offset);
+
+#endif /* __PREFETCH_H__ */
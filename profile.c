@@ -0,0 +1,217 @@
+/*
+ * Startup profiles for the runtime to prefetch, see prefetch.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "squashfuse.h"
+
+#include "aiheader.h"
+#include "prefetch.h"
+#include "profile.h"
+
+static void put_le32(guint8 *p, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    memcpy(p, &value, 4);
+}
+
+static void put_le64(guint8 *p, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    memcpy(p, &value, 8);
+}
+
+/* Returns TRUE the first time it is called for pos */
+static gboolean first_seen(GHashTable *seen, guint64 pos)
+{
+    guint64 *key;
+    if (g_hash_table_lookup(seen, &pos) != NULL)
+        return FALSE;
+    key = g_new(guint64, 1);
+    *key = pos;
+    g_hash_table_insert(seen, key, key);
+    return TRUE;
+}
+
+/* Append the blocks of the file at path that are not in seen yet */
+static void add_file(sqfs *fs, const gchar *path, GByteArray *entries, GHashTable *seen, gboolean verbose)
+{
+    sqfs_inode inode;
+    sqfs_blocklist bl;
+    bool found = false;
+    size_t count, i;
+    guint8 entry[PREFETCH_ENTRY_SIZE];
+
+    if (sqfs_inode_get(fs, &inode, sqfs_inode_root(fs)) != SQFS_OK
+        || sqfs_lookup_path(fs, &inode, path, &found) != SQFS_OK || !found) {
+        fprintf(stderr, "WARNING: %s is not in the AppImage, ignoring it\n", path);
+        return;
+    }
+    if (!S_ISREG(inode.base.mode))
+        return;
+
+    count = sqfs_blocklist_count(fs, &inode);
+    sqfs_blocklist_init(fs, &inode, &bl);
+    for (i = 0; i < count; i++) {
+        if (sqfs_blocklist_next(&bl) != SQFS_OK)
+            return;
+        /* Sparse blocks take no space */
+        if (bl.input_size == 0 || !first_seen(seen, bl.block))
+            continue;
+        put_le64(entry, bl.block);
+        put_le32(entry + 8, bl.header);
+        g_byte_array_append(entries, entry, sizeof(entry));
+    }
+    if (inode.xtra.reg.frag_idx != SQUASHFS_INVALID_FRAG) {
+        struct squashfs_fragment_entry frag;
+        if (sqfs_frag_entry(fs, &frag, inode.xtra.reg.frag_idx) != SQFS_OK)
+            return;
+        if (!first_seen(seen, frag.start_block))
+            return;
+        put_le64(entry, frag.start_block);
+        put_le32(entry + 8, frag.size);
+        g_byte_array_append(entries, entry, sizeof(entry));
+    }
+    if (verbose)
+        fprintf(stderr, "Startup profile: %s\n", path);
+}
+
+gint write_startup_profile(const gchar *destination, GPtrArray *paths, gboolean verbose)
+{
+    unsigned long fs_offset = appimage_get_payload_offset(destination);
+    unsigned long offset = 0;
+    unsigned long length = 0;
+    GByteArray *entries = g_byte_array_new();
+    GHashTable *seen = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    guint8 *section;
+    guint count, capacity, i;
+    FILE *fp;
+    sqfs fs;
+
+    appimage_get_section(destination, PREFETCH_SECTION, &offset, &length);
+    if (offset == 0 || length < sizeof(struct prefetch_header)) {
+        fprintf(stderr, "The runtime has no %s section for the startup profile\n", PREFETCH_SECTION);
+        return -1;
+    }
+    if (fs_offset == 0 || sqfs_open_image(&fs, destination, fs_offset) != SQFS_OK)
+        return -1;
+    for (i = 0; i < paths->len; i++)
+        add_file(&fs, g_ptr_array_index(paths, i), entries, seen, verbose);
+    sqfs_destroy(&fs);
+    sqfs_fd_close(fs.fd);
+
+    count = entries->len / PREFETCH_ENTRY_SIZE;
+    capacity = (length - sizeof(struct prefetch_header)) / PREFETCH_ENTRY_SIZE;
+    if (count > capacity) {
+        fprintf(stderr, "WARNING: Only the first %u of %u startup blocks fit into the %s section\n",
+                capacity, count, PREFETCH_SECTION);
+        count = capacity;
+    }
+    section = g_malloc0(length);
+    memcpy(section, PREFETCH_MAGIC, 8);
+    put_le32(section + 8, PREFETCH_VERSION);
+    put_le32(section + 12, count);
+    memcpy(section + sizeof(struct prefetch_header), entries->data, count * PREFETCH_ENTRY_SIZE);
+
+    fp = fopen(destination, "r+");
+    if (fp == NULL || fseek(fp, offset, SEEK_SET) != 0 || fwrite(section, length, 1, fp) != 1) {
+        fprintf(stderr, "Could not write the startup profile to %s\n", destination);
+        count = -1;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    g_free(section);
+    g_byte_array_free(entries, TRUE);
+    g_hash_table_destroy(seen);
+    return (gint) count;
+}
+
+/* The number after "key": in a line of the trace */
+static gboolean trace_number(const gchar *line, const gchar *key, guint64 *value)
+{
+    gchar *pattern = g_strdup_printf("\"%s\":", key);
+    const gchar *found = strstr(line, pattern);
+    gsize len = strlen(pattern);
+
+    g_free(pattern);
+    if (found == NULL || !g_ascii_isdigit(found[len]))
+        return FALSE;
+    *value = g_ascii_strtoull(found + len, NULL, 10);
+    return TRUE;
+}
+
+/* The string after "name": in a line of the trace, unescaped */
+static gchar *trace_name(const gchar *line)
+{
+    const gchar *p = strstr(line, "\"name\":\"");
+    GString *name;
+
+    if (p == NULL)
+        return NULL;
+    name = g_string_new(NULL);
+    for (p += 8; *p != '\0' && *p != '"'; p++) {
+        if (*p != '\\') {
+            g_string_append_c(name, *p);
+        } else if (p[1] == 'u' && g_ascii_isxdigit(p[2]) && g_ascii_isxdigit(p[3])
+                   && g_ascii_isxdigit(p[4]) && g_ascii_isxdigit(p[5])) {
+            gchar hex[5] = { p[2], p[3], p[4], p[5], '\0' };
+            g_string_append_c(name, (gchar) g_ascii_strtoull(hex, NULL, 16));
+            p += 5;
+        } else if (p[1] != '\0') {
+            g_string_append_c(name, *++p);
+        }
+    }
+    return g_string_free(name, FALSE);
+}
+
+gboolean is_trace(const gchar *contents)
+{
+    while (g_ascii_isspace(*contents))
+        contents++;
+    return *contents == '{';
+}
+
+void read_trace_files(const gchar *contents, GPtrArray *paths)
+{
+    /* Inode numbers to paths, as the lookups resolve them */
+    GHashTable *inodes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+    GHashTable *seen = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    guint64 *root = g_new(guint64, 1);
+    guint i;
+
+    *root = 1;
+    g_hash_table_insert(inodes, root, g_strdup(""));
+    for (i = 0; lines[i] != NULL; i++) {
+        const gchar *line = lines[i];
+        guint64 ino, parent;
+        const gchar *path;
+
+        if (!trace_number(line, "ino", &ino))
+            continue;
+        if (strstr(line, "\"op\":\"lookup\"") != NULL) {
+            gchar *name = trace_name(line);
+            guint64 *key;
+            if (name != NULL && trace_number(line, "parent", &parent)
+                && (path = g_hash_table_lookup(inodes, &parent)) != NULL) {
+                key = g_new(guint64, 1);
+                *key = ino;
+                g_hash_table_replace(inodes, key, *path == '\0' ? g_strdup(name)
+                                     : g_build_filename(path, name, NULL));
+            }
+            g_free(name);
+        } else if (strstr(line, "\"op\":\"read\"") != NULL) {
+            path = g_hash_table_lookup(inodes, &ino);
+            if (path != NULL && first_seen(seen, ino))
+                g_ptr_array_add(paths, g_strdup(path));
+        }
+    }
+    g_strfreev(lines);
+    g_hash_table_destroy(seen);
+    g_hash_table_destroy(inodes);
+}
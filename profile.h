@@ -0,0 +1,21 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <glib.h>
+
+/* Write the startup profile of the AppImage at destination into its
+ * .prefetch section, see prefetch.h: the data and fragment blocks of the
+ * files in paths, relative to the root of the squashfs, in that order.
+ * Blocks that do not fit into the section are left out. Returns the number
+ * of blocks written, or -1 if the image or its section cannot be read. */
+gint write_startup_profile(const gchar *destination, GPtrArray *paths, gboolean verbose);
+
+/* Whether contents is a trace written by the runtime with
+ * --appimage-trace, see trace.h, rather than a list of files */
+gboolean is_trace(const gchar *contents);
+
+/* Add the files that the trace in contents reads to paths, relative to
+ * the root of the AppImage, in the order in which they were first read */
+void read_trace_files(const gchar *contents, GPtrArray *paths);
+
+#endif /* __PROFILE_H__ */
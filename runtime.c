@@ -45,9 +45,18 @@
 #include <pthread.h>
 #include <errno.h>
 #include <wait.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 
 #include "elf.h"
 #include "getsection.h"
+#include "aiheader.h"
+#include "extract.h"
+#include "extractcache.h"
+#include "parallel.h"
+#include "trace.h"
 
 #include <fnmatch.h>
 
@@ -113,23 +122,53 @@ extern int fusefs_main(int argc, char *argv[], void (*mounted) (void));
 // extern void ext2_quit(void);
 
 static pid_t fuse_pid;
+static int ready_fd;    /* eventfd that fuse_mounted() signals exactly once */
 static int keepalive_pipe[2];
 
+/* Instances of the same AppImage share one mount, see shared_mount_open ().
+ * Each instance and its app hold a shared lock on the users file; the
+ * FUSE daemon unmounts once it can take it exclusively. */
+static char users_lock_path[PATH_MAX];
+static int users_fd = -1;
+static int setup_fd = -1;   /* Serializes instances while they mount */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* A file descriptor that becomes readable when pid exits, or -1 if the
+ * kernel is older than 5.3 */
+static int pidfd_open(pid_t pid)
+{
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/* Unmount once no instance of the AppImage is left. The lock is held
+ * until the daemon exits, so a new instance waits until the mount is gone
+ * and then mounts afresh. */
 static void *
-write_pipe_thread (void *arg)
+watch_users_thread (void *arg)
 {
-    char c[32];
-    int res;
-    //  sprintf(stderr, "Called write_pipe_thread");
-    memset (c, 'x', sizeof (c));
-    while (1) {
-        /* Write until we block, on broken pipe, exit */
-        res = write (keepalive_pipe[1], c, sizeof (c));
-        if (res == -1) {
-            kill (fuse_pid, SIGHUP);
-            break;
-        }
-    }
+    int fd = open (users_lock_path, O_RDONLY | O_CLOEXEC);
+    /* Without the lock there is no telling when to unmount, so stay */
+    if (fd == -1)
+        return NULL;
+    while (flock (fd, LOCK_EX) == -1 && errno == EINTR)
+        ;
+    kill (fuse_pid, SIGHUP);
+    return NULL;
+}
+
+/* Unmount once the app and everything it started have exited, which
+ * closes the last read end of the keepalive pipe and shows as POLLERR on
+ * ours; SIGHUP makes libfuse end the session */
+static void *
+watch_app_thread (void *arg)
+{
+    struct pollfd pfd = { .fd = keepalive_pipe[1], .events = 0 };
+    while (poll (&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+    kill (fuse_pid, SIGHUP);
     return NULL;
 }
 
@@ -137,8 +176,204 @@ void
 fuse_mounted (void)
 {
     pthread_t thread;
+    uint64_t mounted = 1;
     fuse_pid = getpid();
-    pthread_create(&thread, NULL, write_pipe_thread, keepalive_pipe);
+    pthread_create(&thread, NULL, users_lock_path[0] ? watch_users_thread : watch_app_thread, NULL);
+    write (ready_fd, &mounted, sizeof (mounted));
+    close (ready_fd);
+}
+
+/* Wait until the FUSE process started as child has mounted the AppImage.
+ * The child exits with 0 once it has turned into a daemon, which then
+ * signals ready_fd, and with an error if mounting failed. The daemon holds
+ * the write end of the keepalive pipe, so if it exits without signalling,
+ * our read end hangs up. Returns -1 if mounting failed. */
+static int
+wait_until_mounted (pid_t child)
+{
+    struct pollfd pfds[3];
+    int child_fd = pidfd_open (child);
+    int status;
+    int ret;
+
+    pfds[0].fd = ready_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = keepalive_pipe[0];
+    pfds[1].events = 0;
+    pfds[2].fd = child_fd;
+    pfds[2].events = POLLIN;
+    for (;;) {
+        /* Without pidfds, look at the child every 10 ms while it runs */
+        int n = poll (pfds, 3, child_fd != -1 || child == -1 ? -1 : 10);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            ret = -1;
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            ret = 0;
+            break;
+        }
+        if (pfds[1].revents & (POLLHUP | POLLERR)) {
+            ret = -1;
+            break;
+        }
+        if (child_fd != -1 && !(pfds[2].revents & POLLIN))
+            continue;
+        if (child != -1 && waitpid (child, &status, child_fd != -1 ? 0 : WNOHANG) == child) {
+            if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+                ret = -1;
+                break;
+            }
+            /* The daemon carries on and signals when it is ready */
+            child = -1;
+            if (child_fd != -1)
+                close (child_fd);
+            child_fd = -1;
+            pfds[2].fd = -1;
+        }
+    }
+    if (child_fd != -1)
+        close (child_fd);
+    return ret;
+}
+
+/* A FUSE mount whose daemon died, which fails with ENOTCONN */
+static void
+unmount_stale (const char *dir)
+{
+    pid_t pid = fork ();
+    if (pid == 0) {
+        execlp ("fusermount", "fusermount", "-u", "-z", dir, (char *) NULL);
+        _exit (1);
+    }
+    if (pid > 0)
+        waitpid (pid, NULL, 0);
+}
+
+/* Find the mount shared by all instances of the AppImage at path, in
+ * $XDG_RUNTIME_DIR/appimage-mounts/<dev>-<inode>-<mtime>/mnt. Returns 1 if
+ * it is mounted and 0 if the caller has to mount it; setup_fd is then
+ * locked until it has. Returns -1 if mounts cannot be shared. Either way
+ * users_fd is left locked and is inherited by the app. */
+static int
+shared_mount_open (const char *path, char *mount_dir, size_t size)
+{
+    const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+    char dir[PATH_MAX];
+    struct stat image, mnt, parent;
+
+    if (runtime_dir == NULL || *runtime_dir != '/' || stat (path, &image) != 0)
+        return -1;
+    snprintf (dir, sizeof (dir), "%s/appimage-mounts", runtime_dir);
+    if (mkdir (dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+    snprintf (dir, sizeof (dir), "%s/appimage-mounts/%llx-%llx-%lld.%09ld", runtime_dir,
+              (unsigned long long) image.st_dev, (unsigned long long) image.st_ino,
+              (long long) image.st_mtim.tv_sec, image.st_mtim.tv_nsec);
+    if (mkdir (dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    snprintf (mount_dir, size, "%s/setup", dir);
+    setup_fd = open (mount_dir, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (setup_fd == -1 || flock (setup_fd, LOCK_EX) != 0)
+        return -1;
+    snprintf (users_lock_path, sizeof (users_lock_path), "%s/users", dir);
+    users_fd = open (users_lock_path, O_RDONLY | O_CREAT, 0600);
+    /* Waits while a daemon is unmounting */
+    if (users_fd == -1 || flock (users_fd, LOCK_SH) != 0) {
+        close (setup_fd);
+        users_lock_path[0] = '\0';
+        return -1;
+    }
+
+    snprintf (mount_dir, size, "%s/mnt", dir);
+    if (mkdir (mount_dir, 0700) == -1 && errno != EEXIST) {
+        close (setup_fd);
+        close (users_fd);
+        users_lock_path[0] = '\0';
+        return -1;
+    }
+    if (stat (mount_dir, &mnt) != 0) {
+        if (errno == ENOTCONN)
+            unmount_stale (mount_dir);
+        return 0;
+    }
+    if (stat (dir, &parent) == 0 && mnt.st_dev != parent.st_dev) {
+        ydebug ("Sharing the mount at %s", mount_dir);
+        close (setup_fd);
+        setup_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Mount the AppImage on mount_dir in a FUSE daemon. Returns 0 once it is
+ * mounted and -1 if mounting failed. */
+static int
+mount_appimage (const char *appimage_path, char *mount_dir)
+{
+    pid_t pid;
+    int ret;
+    
+    ready_fd = eventfd (0, EFD_CLOEXEC);
+    if (ready_fd == -1) {
+        perror ("eventfd error");
+        exit (1);
+    }
+    
+    if (pipe (keepalive_pipe) == -1) {
+        perror ("pipe error");
+        exit (1);
+    }
+    
+    pid = fork ();
+    if (pid == -1) {
+        perror ("fork error");
+        exit (1);
+    }
+    
+    if (pid == 0) {
+        /* in child */
+        
+        char *child_argv[5];
+        
+        /* close read pipe */
+        close (keepalive_pipe[0]);
+        
+        /* The daemon takes the users lock itself, see watch_users_thread () */
+        if (users_fd != -1)
+            close (users_fd);
+        if (setup_fd != -1)
+            close (setup_fd);
+        
+        char *dir = realpath(appimage_path, NULL );
+        
+        char options[100];
+        sprintf(options, "ro,offset=%lu", fs_offset);
+        
+        child_argv[0] = dir;
+        child_argv[1] = "-o";
+        child_argv[2] = options;
+        child_argv[3] = dir;
+        child_argv[4] = mount_dir;
+        
+        /* The parent falls back to extracting the AppImage */
+        if(0 != fusefs_main (5, child_argv, fuse_mounted))
+            exit (1);
+        exit (0);
+    }
+    
+    /* in parent, child is $pid */
+    
+    /* close write pipe */
+    close (keepalive_pipe[1]);
+    
+    /* Pause until mounted */
+    ret = wait_until_mounted (pid);
+    close (ready_fd);
+    return ret;
 }
 
 char* getArg(int argc, char *argv[],char chr)
@@ -172,7 +407,7 @@ main (int argc, char *argv[])
         printf("Using TARGET_APPIMAGE %s\n", appimage_path);
     }
     
-    fs_offset = get_elf_size(appimage_path);
+    fs_offset = appimage_get_payload_offset(appimage_path);
     
     /* Just print the offset and then exit */
     arg=getArg(argc,argv,'-');
@@ -184,95 +419,13 @@ main (int argc, char *argv[])
     /* Exract the AppImage */
     arg=getArg(argc,argv,'-');
     if(arg && strcmp(arg,"appimage-extract")==0) {
-        sqfs_err err = SQFS_OK;
-        sqfs_traverse trv;
-        sqfs fs;
-        char *pattern;
-        char *prefix;
-        char prefixed_path_to_extract[1024];
-        
-        prefix = "squashfs-root/";
-        
-        if(access(prefix, F_OK ) == -1 ) {
-            if (mkdir(prefix, 0777) == -1) {
-                perror("mkdir error");
-                exit(EXIT_FAILURE);
-            }
-        }
+        char *pattern = NULL;
         
         if(argc == 3)
             pattern = argv[2];
         
-        if ((err = sqfs_open_image(&fs, appimage_path, fs_offset)))
+        if (appimage_extract(appimage_path, fs_offset, "squashfs-root/", pattern, parallel_default_threads()) != 0)
             exit(1);
-        
-        if ((err = sqfs_traverse_open(&trv, &fs, sqfs_inode_root(&fs))))
-            die("sqfs_traverse_open error");
-        while (sqfs_traverse_next(&trv, &err)) {
-            if (!trv.dir_end) {
-                if((argc != 3) || (fnmatch (pattern, trv.path, FNM_FILE_NAME) == 0)){
-                    fprintf(stderr, "trv.path: %s\n", trv.path);
-                    fprintf(stderr, "sqfs_inode_id: %lu\n", trv.entry.inode);
-                    sqfs_inode inode;
-                    if (sqfs_inode_get(&fs, &inode, trv.entry.inode))
-                        die("sqfs_inode_get error");
-                    fprintf(stderr, "inode.base.inode_type: %i\n", inode.base.inode_type);
-                    fprintf(stderr, "inode.xtra.reg.file_size: %lu\n", inode.xtra.reg.file_size);
-                    strcpy(prefixed_path_to_extract, "");
-                    strcat(strcat(prefixed_path_to_extract, prefix), trv.path);
-                    if(inode.base.inode_type == SQUASHFS_DIR_TYPE){
-                        fprintf(stderr, "inode.xtra.dir.parent_inode: %ui\n", inode.xtra.dir.parent_inode);
-                        fprintf(stderr, "mkdir: %s/\n", prefixed_path_to_extract);
-                        if(access(prefixed_path_to_extract, F_OK ) == -1 ) {
-                            if (mkdir(prefixed_path_to_extract, 0777) == -1) {
-                                perror("mkdir error");
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                    } else if(inode.base.inode_type == SQUASHFS_REG_TYPE){
-                        fprintf(stderr, "Extract to: %s\n", prefixed_path_to_extract);
-                        if(private_sqfs_stat(&fs, &inode, &st) != 0)
-                            die("private_sqfs_stat error");
-                        // Read the file in chunks
-                        off_t bytes_already_read = 0;
-                        sqfs_off_t bytes_at_a_time = 64*1024;
-                        FILE * f;
-                        f = fopen (prefixed_path_to_extract, "w+");
-                        if (f == NULL)
-                            die("fopen error");
-                        while (bytes_already_read < inode.xtra.reg.file_size)
-                        {
-                            char buf[bytes_at_a_time];
-                            if (sqfs_read_range(&fs, &inode, (sqfs_off_t) bytes_already_read, &bytes_at_a_time, buf))
-                                die("sqfs_read_range error");
-                            // fwrite(buf, 1, bytes_at_a_time, stdout);
-                            fwrite(buf, 1, bytes_at_a_time, f);
-                            bytes_already_read = bytes_already_read + bytes_at_a_time;
-                        }
-                        fclose(f);
-                        chmod (prefixed_path_to_extract, st.st_mode);
-                    } else if(inode.base.inode_type == SQUASHFS_SYMLINK_TYPE){
-                        size_t size = strlen(trv.path)+1;
-                        char buf[size];
-                        int ret = sqfs_readlink(&fs, &inode, buf, &size);
-                        if (ret != 0)
-                            die("symlink error");
-                        fprintf(stderr, "Symlink: %s to %s \n", prefixed_path_to_extract, buf);
-                        unlink(prefixed_path_to_extract);
-                        ret = symlink(buf, prefixed_path_to_extract);
-                        if (ret != 0)
-                            die("symlink error");
-                    } else {
-                        fprintf(stderr, "TODO: Implement inode.base.inode_type %i\n", inode.base.inode_type);
-                    }
-                    fprintf(stderr, "\n");
-                }
-            }
-        }
-        if (err)
-            die("sqfs_traverse_next error");
-        sqfs_traverse_close(&trv);
-        sqfs_fd_close(fs.fd);
         exit(0);
     }
     
@@ -284,7 +437,7 @@ main (int argc, char *argv[])
     if(arg && strcmp(arg,"appimage-updateinformation")==0) {
         unsigned long offset = 0;
         unsigned long length = 0;
-        get_elf_section_offset_and_lenghth(appimage_path, ".upd_info", &offset, &length);
+        appimage_get_section(appimage_path, ".upd_info", &offset, &length);
         // printf("offset: %lu\n", offset);
         // printf("length: %lu\n", length);
         // print_hex(appimage_path, offset, length);
@@ -295,7 +448,7 @@ main (int argc, char *argv[])
     if(arg && strcmp(arg,"appimage-signature")==0) {
         unsigned long offset = 0;
         unsigned long length = 0;
-        get_elf_section_offset_and_lenghth(appimage_path, ".sha256_sig", &offset, &length);
+        appimage_get_section(appimage_path, ".sha256_sig", &offset, &length);
         // printf("offset: %lu\n", offset);
         // printf("length: %lu\n", length);
         // print_hex(appimage_path, offset, length);
@@ -303,48 +456,47 @@ main (int argc, char *argv[])
         exit(0);
     }
     
+    /* Record the requests of the app to the mounted AppImage */
+    int trace = 0;  /* The index of the option in argv */
+    if(arg && strncmp(arg,"appimage-trace=",15)==0) {
+        if (trace_open(arg + 15) != 0)
+            exit(1);
+        for (trace = 1; argv[trace] + 2 != arg; trace++)
+            ;
+    }
+    
     int dir_fd, res;
-    char mount_dir[] = "/tmp/.mount_XXXXXX";  /* create mountpoint */
-    char filename[100]; /* enough for mount_dir + "/AppRun" */
-    pid_t pid;
+    char mount_dir[PATH_MAX];
+    char filename[PATH_MAX];
+    char *appdir = NULL; /* mount_dir, or the extracted AppImage */
+    int lock_fd = -1;
+    int shared;
     char **real_argv;
     int i;
     
-    if (mkdtemp(mount_dir) == NULL) {
-        exit (1);
-    }
-    
-    if (pipe (keepalive_pipe) == -1) {
-        perror ("pipe error");
-        exit (1);
-    }
-    
-    pid = fork ();
-    if (pid == -1) {
-        perror ("fork error");
-        exit (1);
+    /* The requests to a shared mount go to the daemon of another instance */
+    shared = trace ? -1 : shared_mount_open (appimage_path, mount_dir, sizeof (mount_dir));
+    if (shared == -1) {
+        strcpy (mount_dir, "/tmp/.mount_XXXXXX");  /* create mountpoint */
+        if (mkdtemp(mount_dir) == NULL) {
+            exit (1);
+        }
     }
     
-    if (pid == 0) {
-        /* in child */
-        
-        char *child_argv[5];
-        
-        /* close read pipe */
-        close (keepalive_pipe[0]);
-        
-        char *dir = realpath(appimage_path, NULL );
-        
-        char options[100];
-        sprintf(options, "ro,offset=%lu", fs_offset);
-        
-        child_argv[0] = dir;
-        child_argv[1] = "-o";
-        child_argv[2] = options;
-        child_argv[3] = dir;
-        child_argv[4] = mount_dir;
-        
-        if(0 != fusefs_main (5, child_argv, fuse_mounted)){
+    /* Mount unless another instance already did, or run the AppImage from
+     * the extract cache where there is no FUSE */
+    if (shared == 1) {
+        appdir = mount_dir;
+    } else if (mount_appimage (appimage_path, mount_dir) == 0) {
+        appdir = mount_dir;
+        if (setup_fd != -1)
+            close (setup_fd);
+    } else {
+        if (shared == -1)
+            rmdir (mount_dir);
+        if (getenv("TARGET_APPIMAGE") == NULL && !(arg && strcmp(arg,"appimage-mount")==0) && !trace)
+            appdir = extract_cache_get(appimage_path, fs_offset, &lock_fd);
+        if (appdir == NULL) {
             char *title;
             char *body;
             title = "Cannot mount AppImage, please check your FUSE setup.";
@@ -352,81 +504,78 @@ main (int argc, char *argv[])
             "if you run it with the --appimage-extract option. \n"
             "See https://github.com/probonopd/AppImageKit/wiki/FUSE \n"
             "for more information";
-	    notify(title, body, 0); // 3 seconds timeout
-        };
-    } else {
-        /* in parent, child is $pid */
-        int c;
-        
-        /* close write pipe */
-        close (keepalive_pipe[1]);
-        
-        /* Pause until mounted */
-        read (keepalive_pipe[0], &c, 1);
-        
-        
-        dir_fd = open (mount_dir, O_RDONLY);
-        if (dir_fd == -1) {
-            perror ("open dir error");
-            /* TODO: dlopen() libfuse and be nice if it is not there, e.g., offer
-             * to extract the files to a temp location and run AppRun */
+            notify(title, body, 0); // 3 seconds timeout
             exit (1);
         }
-        
-        res = dup2 (dir_fd, 1023);
-        if (res == -1) {
-            perror ("dup2 error");
-            exit (1);
-        }
-        close (dir_fd);
-        
-        strcpy (filename, mount_dir);
-        strcat (filename, "/AppRun");
-        
-        real_argv = malloc (sizeof (char *) * (argc + 1));
-        for (i = 0; i < argc; i++) {
-            real_argv[i] = argv[i];
-        }
-        real_argv[i] = NULL;
-        
-        if(arg && strcmp(arg,"appimage-mount")==0) {
-            printf("%s\n", mount_dir);
-            for (;;) pause();
+    }
+    
+    dir_fd = open (appdir, O_RDONLY);
+    if (dir_fd == -1) {
+        perror ("open dir error");
+        /* TODO: dlopen() libfuse so that the extract cache is also used
+         * when libfuse is not there */
+        exit (1);
+    }
+    
+    res = dup2 (dir_fd, 1023);
+    if (res == -1) {
+        perror ("dup2 error");
+        exit (1);
+    }
+    close (dir_fd);
+    
+    snprintf (filename, sizeof (filename), "%s/AppRun", appdir);
+    
+    real_argv = malloc (sizeof (char *) * (argc + 1));
+    for (i = 0; i < argc; i++) {
+        real_argv[i] = argv[i];
+    }
+    real_argv[i] = NULL;
+    
+    /* The app does not know --appimage-trace */
+    if (trace) {
+        for (i = trace; i < argc; i++) {
+            real_argv[i] = real_argv[i + 1];
         }
+    }
+    
+    if(arg && strcmp(arg,"appimage-mount")==0) {
+        printf("%s\n", mount_dir);
+        for (;;) pause();
+    }
 
-        int length;
-        char fullpath[PATH_MAX];
-        
-        if(getenv("TARGET_APPIMAGE") == NULL){
-            // If we are operating on this file itself
-            length = readlink(appimage_path, fullpath, sizeof(fullpath));
-            fullpath[length] = '\0'; 
-        } else {
-            // If we are operating on a different AppImage than this file
-            sprintf(fullpath, "%s", appimage_path); // TODO: Make absolute
-        }
-                
-        /* Setting some environment variables that the app "inside" might use */
-        setenv( "APPIMAGE", fullpath, 1 );
-        setenv( "APPDIR", mount_dir, 1 );
-        
-        /* Original working directory */
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            setenv( "OWD", cwd, 1 );
-        }
-        
-        /* If we are operating on an AppImage different from this file,
-         * then we do not execute the payload */
-        if(getenv("TARGET_APPIMAGE") == NULL){
-            yinfo("mount_dir : %s", mount_dir);
-            /* TODO: Find a way to get the exit status and/or output of this */
-            execv (filename, real_argv);
-            /* Error if we continue here */
-            perror ("execv error");
-            exit (1);
-        }
+    int length;
+    char fullpath[PATH_MAX];
+    
+    if(getenv("TARGET_APPIMAGE") == NULL){
+        // If we are operating on this file itself
+        length = readlink(appimage_path, fullpath, sizeof(fullpath));
+        fullpath[length] = '\0'; 
+    } else {
+        // If we are operating on a different AppImage than this file
+        sprintf(fullpath, "%s", appimage_path); // TODO: Make absolute
+    }
+            
+    /* Setting some environment variables that the app "inside" might use */
+    setenv( "APPIMAGE", fullpath, 1 );
+    setenv( "APPDIR", appdir, 1 );
+    
+    /* Original working directory */
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        setenv( "OWD", cwd, 1 );
     }
     
+    /* If we are operating on an AppImage different from this file,
+     * then we do not execute the payload */
+    if(getenv("TARGET_APPIMAGE") == NULL){
+        yinfo("mount_dir : %s", appdir);
+        /* TODO: Find a way to get the exit status and/or output of this */
+        execv (filename, real_argv);
+        /* Error if we continue here */
+        perror ("execv error");
+        exit (1);
+    }
+
     return EXIT_SUCCESS;
 }
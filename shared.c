@@ -45,6 +45,7 @@
 
 #include "elf.h"
 #include "getsection.h"
+#include "aiheader.h"
 
 #include <regex.h>
 
@@ -334,7 +335,7 @@ void write_edited_desktop_file(GKeyFile *key_file_structure, char* appimage_path
     if(g_find_program_in_path ("AppImageUpdate")){
         unsigned long offset = 0;
         unsigned long length = 0;
-        get_elf_section_offset_and_lenghth(appimage_path, ".upd_info", &offset, &length);
+        appimage_get_section(appimage_path, ".upd_info", &offset, &length);
         fprintf(stderr, ".upd_info offset: %lu\n", offset);
         fprintf(stderr, ".upd_info length: %lu\n", length);
         if(length != 1024)
@@ -486,7 +487,7 @@ bool appimage_type2_register_in_system(char *path, gboolean verbose)
     gchar *desktop_icon_value_original = "iDoNotMatchARegex"; // FIXME: otherwise the regex does weird stuff in the first run
     if(verbose)
         fprintf(stderr, "md5 of URI RFC 2396: %s\n", md5);
-    fs_offset = get_elf_size(path);
+    fs_offset = appimage_get_payload_offset(path);
     if(verbose)
         fprintf(stderr, "fs_offset: %lu\n", fs_offset);
     sqfs_err err = SQFS_OK;
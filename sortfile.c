@@ -0,0 +1,287 @@
+/*
+ * Sort files for mksquashfs that control the order in which files are
+ * written, and with it which files are compressed next to each other
+ */
+
+#include <glib.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "parallel.h"
+#include "sortfile.h"
+
+/* mksquashfs accepts priorities from -32768 to 32767, files that are not
+ * listed get 0 */
+#define SORT_PRIORITY_MAX 32767
+#define SORT_PRIORITY_MIN -32768
+#define SORT_PRIORITY_COUNT 65536
+
+/* How much of each file the similarity hash looks at */
+#define SIMHASH_HEAD (64*1024)
+
+struct sort_entry {
+    gchar *path;
+    gchar *type;            /* Extension, "" if there is none */
+    const gchar *name;      /* Points into path */
+    guint64 simhash;        /* 0 unless ordering by similarity */
+};
+
+/* Shared libraries have their extension in the middle, e.g. libfoo.so.1.2 */
+static gchar *file_type(const gchar *name)
+{
+    const gchar *dot;
+    if (strstr(name, ".so.") != NULL)
+        return g_strdup("so");
+    dot = strrchr(name, '.');
+    if (dot == NULL || dot == name)
+        return g_strdup("");
+    return g_ascii_strdown(dot + 1, -1);
+}
+
+/* Collect the regular files below path that are smaller than limit, or all
+ * of them if limit is 0, into files and the others into larger */
+static void find_files(const gchar *path, guint64 limit, GPtrArray *files, GPtrArray *larger)
+{
+    GDir *dir;
+    const gchar *entry;
+
+    dir = g_dir_open(path, 0, NULL);
+    if (dir == NULL) {
+        g_warning("%s: %s", path, g_strerror(errno));
+        return;
+    }
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        gchar *full_name = g_build_filename(path, entry, NULL);
+        struct stat st;
+        if (lstat(full_name, &st) != 0) {
+            g_free(full_name);
+        } else if (S_ISDIR(st.st_mode)) {
+            find_files(full_name, limit, files, larger);
+            g_free(full_name);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0
+                   /* The sort file is whitespace separated */
+                   && strpbrk(full_name, " \t\n") == NULL) {
+            struct sort_entry *file = g_new0(struct sort_entry, 1);
+            file->path = full_name;
+            file->type = file_type(entry);
+            file->name = full_name + strlen(path) + 1;
+            if (limit == 0 || (guint64) st.st_size < limit)
+                g_ptr_array_add(files, file);
+            else
+                g_ptr_array_add(larger, file);
+        } else {
+            g_free(full_name);
+        }
+    }
+    g_dir_close(dir);
+}
+
+/* By type, then by similarity, then by name, so that e.g. all translations
+ * of one domain are adjacent */
+static gint compare_sort_entries(gconstpointer a, gconstpointer b)
+{
+    const struct sort_entry *fa = *(const struct sort_entry **) a;
+    const struct sort_entry *fb = *(const struct sort_entry **) b;
+    gint ret = strcmp(fa->type, fb->type);
+    if (ret == 0 && fa->simhash != fb->simhash)
+        ret = fa->simhash < fb->simhash ? -1 : 1;
+    if (ret == 0)
+        ret = strcmp(fa->name, fb->name);
+    if (ret == 0)
+        ret = strcmp(fa->path, fb->path);
+    return ret;
+}
+
+/* Write files in their order to sort_file, followed by the files in last
+ * if it is not NULL; returns the number of groups of files of the same
+ * type, or -1 if the sort file could not be written */
+static gint write_sort_entries(GPtrArray *files, GPtrArray *last, const gchar *sort_file)
+{
+    GString *contents = g_string_new(NULL);
+    gint priority = SORT_PRIORITY_MAX;
+    gint groups = 0;
+    guint i;
+
+    /* Files of equal priority are written in no particular order, so each
+     * file gets a priority of its own as long as there are enough of them */
+    for (i = 0; i < files->len; i++) {
+        struct sort_entry *file = g_ptr_array_index(files, i);
+        struct sort_entry *prev = i > 0 ? g_ptr_array_index(files, i - 1) : NULL;
+        gboolean new_group = prev == NULL || strcmp(prev->type, file->type) != 0;
+        if (new_group)
+            groups++;
+        if (i > 0 && (files->len < SORT_PRIORITY_COUNT || new_group) && priority > -SORT_PRIORITY_MAX)
+            priority--;
+        g_string_append_printf(contents, "%s %d\n", file->path, priority);
+    }
+    /* Below all of files however many there are, rather than at the
+     * implicit 0 somewhere in their midst */
+    for (i = 0; last != NULL && i < last->len; i++) {
+        struct sort_entry *file = g_ptr_array_index(last, i);
+        g_string_append_printf(contents, "%s %d\n", file->path, SORT_PRIORITY_MIN);
+    }
+    if (!g_file_set_contents(sort_file, contents->str, contents->len, NULL)) {
+        fprintf(stderr, "Could not write %s\n", sort_file);
+        groups = -1;
+    }
+    g_string_free(contents, TRUE);
+    return groups;
+}
+
+static void free_sort_entries(GPtrArray *files)
+{
+    guint i;
+    for (i = 0; i < files->len; i++) {
+        struct sort_entry *file = g_ptr_array_index(files, i);
+        g_free(file->path);
+        g_free(file->type);
+        g_free(file);
+    }
+    g_ptr_array_free(files, TRUE);
+}
+
+gint write_small_file_sort(const gchar *appdir, const gchar *sort_file, guint64 small_file_limit, gboolean verbose)
+{
+    GPtrArray *files = g_ptr_array_new();
+    GPtrArray *larger = g_ptr_array_new();
+    gint groups;
+    gint ret;
+
+    find_files(appdir, small_file_limit, files, larger);
+    g_ptr_array_sort(files, compare_sort_entries);
+    groups = write_sort_entries(files, larger, sort_file);
+    if (groups >= 0 && verbose)
+        fprintf(stderr, "Grouped %u small files by type into %d groups\n", files->len, groups);
+    ret = groups < 0 ? -1 : (gint) files->len;
+    free_sort_entries(files);
+    free_sort_entries(larger);
+    return ret;
+}
+
+/* ELF files are grouped by machine and object type rather than by name,
+ * so that e.g. all x86_64 shared libraries end up together */
+static void classify_elf(struct sort_entry *file, const guint8 *head, gsize len)
+{
+    guint16 type, machine;
+    if (len < sizeof(Elf32_Ehdr) || memcmp(head, ELFMAG, SELFMAG) != 0)
+        return;
+    if (head[EI_DATA] == ELFDATA2MSB) {
+        type = (head[16] << 8) | head[17];
+        machine = (head[18] << 8) | head[19];
+    } else {
+        type = head[16] | (head[17] << 8);
+        machine = head[18] | (head[19] << 8);
+    }
+    g_free(file->type);
+    /* Sorts after the extensions, which are lowercase */
+    file->type = g_strdup_printf("~elf-%u-%u", machine, type);
+}
+
+/* A 64-bit simhash of the 8-byte shingles of the first SIMHASH_HEAD bytes.
+ * Files with similar content get hashes that agree in most bits, and
+ * sorting by the hash puts many of them close to each other. Only the
+ * shingles whose hash has the low 4 bits clear are counted; the choice
+ * depends on the content only, so similar files sample the same spots. */
+static guint64 simhash(const guint8 *data, gsize len)
+{
+    gint counts[64];
+    guint64 hash = 0;
+    gsize i;
+    int bit;
+
+    if (len < 8)
+        return 0;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i + 8 <= len; i++) {
+        guint64 shingle;
+        memcpy(&shingle, data + i, 8);
+        shingle *= 0x9e3779b97f4a7c15ULL;
+        shingle ^= shingle >> 29;
+        if ((shingle & 0xf) != 0)
+            continue;
+        for (bit = 0; bit < 64; bit++)
+            counts[bit] += (shingle >> bit) & 1 ? 1 : -1;
+    }
+    for (bit = 0; bit < 64; bit++)
+        if (counts[bit] > 0)
+            hash |= 1ULL << bit;
+    return hash;
+}
+
+/* Sorting by the hash only brings together files whose hashes share the
+ * high bits. Within each type, chain the files instead, each followed by
+ * the remaining one whose hash differs in the fewest bits. This is
+ * quadratic, so larger groups keep the plain order by hash. */
+#define CHAIN_MAX 4096
+
+static void chain_by_similarity(GPtrArray *files)
+{
+    guint start = 0;
+    while (start < files->len) {
+        struct sort_entry *first = g_ptr_array_index(files, start);
+        guint end = start + 1;
+        guint i, j;
+        while (end < files->len && strcmp(((struct sort_entry *) g_ptr_array_index(files, end))->type, first->type) == 0)
+            end++;
+        if (end - start <= CHAIN_MAX) {
+            for (i = start; i + 1 < end; i++) {
+                struct sort_entry *current = g_ptr_array_index(files, i);
+                guint best = i + 1;
+                int best_distance = 65;
+                for (j = i + 1; j < end; j++) {
+                    struct sort_entry *candidate = g_ptr_array_index(files, j);
+                    int distance = __builtin_popcountll(current->simhash ^ candidate->simhash);
+                    if (distance < best_distance) {
+                        best_distance = distance;
+                        best = j;
+                    }
+                }
+                gpointer tmp = files->pdata[i + 1];
+                files->pdata[i + 1] = files->pdata[best];
+                files->pdata[best] = tmp;
+            }
+        }
+        start = end;
+    }
+}
+
+static void hash_one(size_t index, void *data)
+{
+    struct sort_entry *file = g_ptr_array_index((GPtrArray *) data, index);
+    guint8 *head = g_malloc(SIMHASH_HEAD);
+    ssize_t len;
+    int fd = open(file->path, O_RDONLY);
+
+    if (fd >= 0) {
+        len = read(fd, head, SIMHASH_HEAD);
+        if (len > 0) {
+            classify_elf(file, head, len);
+            file->simhash = simhash(head, len);
+        }
+        close(fd);
+    }
+    g_free(head);
+}
+
+gint write_similarity_sort(const gchar *appdir, const gchar *sort_file, gboolean verbose)
+{
+    GPtrArray *files = g_ptr_array_new();
+    gint groups;
+    gint ret;
+
+    find_files(appdir, 0, files, NULL);
+    parallel_for(files->len, parallel_default_threads(), hash_one, files);
+    g_ptr_array_sort(files, compare_sort_entries);
+    chain_by_similarity(files);
+    groups = write_sort_entries(files, NULL, sort_file);
+    if (groups >= 0 && verbose)
+        fprintf(stderr, "Ordered %u files by similarity within %d groups\n", files->len, groups);
+    ret = groups < 0 ? -1 : (gint) files->len;
+    free_sort_entries(files);
+    return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef __SORTFILE_H__
+#define __SORTFILE_H__
+
+#include <glib.h>
+
+/* mksquashfs -sort decides the order in which files are written, and with
+ * it which small files end up together in a fragment block. Fragment
+ * blocks are compressed as a whole, so placing files of the same type next
+ * to each other lets every one of them compress against its neighbours,
+ * much like a dictionary trained on that type would. */
+
+/* Write a sort file for appdir to sort_file that groups the regular files
+ * smaller than small_file_limit by extension and puts the larger ones
+ * after them. Returns the number of small files, or -1 if the sort file
+ * could not be written. */
+gint write_small_file_sort(const gchar *appdir, const gchar *sort_file, guint64 small_file_limit, gboolean verbose);
+
+/* Write a sort file for appdir to sort_file that orders all regular files
+ * by type, ELF files by machine and object type, and within a type by
+ * the similarity of their contents. Returns the number of files listed,
+ * or -1 if the sort file could not be written. */
+gint write_similarity_sort(const gchar *appdir, const gchar *sort_file, gboolean verbose);
+
+#endif /* __SORTFILE_H__ */
@@ -0,0 +1,926 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include <glib.h>
+
+#include "squashfuse.h"
+
+#include "aiheader.h"
+#include "tarstream.h"
+
+#define TAR_BLOCK 512
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* Files up to this size are read and decompressed ahead of the writer by
+ * the prefetch threads; larger ones are streamed by the writer itself */
+#define PREFETCH_MAX_FILE (4*1024*1024)
+/* Upper bound for data that has been prefetched but not written yet */
+#define PREFETCH_BUDGET (64*1024*1024)
+
+/* Markers for the entries of an overlay directory */
+#define OVERLAY_FILE GINT_TO_POINTER(1)
+#define OVERLAY_DIR GINT_TO_POINTER(2)
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int tar_write_data(int fd, const void *buf, size_t len) {
+    return write_all(fd, buf, len);
+}
+
+int tar_write_padding(int fd, guint64 size) {
+    static const char zeros[TAR_BLOCK];
+    size_t rest = size % TAR_BLOCK;
+    if (rest == 0)
+        return 0;
+    return write_all(fd, zeros, TAR_BLOCK - rest);
+}
+
+int tar_write_end(int fd) {
+    static const char zeros[2 * TAR_BLOCK];
+    return write_all(fd, zeros, sizeof(zeros));
+}
+
+static void set_octal(char *field, size_t len, guint64 value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%0*llo", (int) len - 1, (unsigned long long) value);
+    memcpy(field, buf, len - 1);
+    field[len - 1] = '\0';
+}
+
+/* pax records are "<length> <key>=<value>\n", where length counts itself */
+static void pax_add(GString *pax, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;
+    size_t total = len + 1;
+    while ((size_t) snprintf(NULL, 0, "%zu", total) + len != total)
+        total++;
+    g_string_append_printf(pax, "%zu %s=%s\n", total, key, value);
+}
+
+static int write_raw_header(int fd, const char *name, const struct stat *st, char typeflag,
+                            const char *linkname, guint64 size) {
+    struct tar_header h;
+    unsigned char *bytes = (unsigned char *) &h;
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    set_octal(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    set_octal(h.uid, sizeof(h.uid), st->st_uid & 07777777);
+    set_octal(h.gid, sizeof(h.gid), st->st_gid & 07777777);
+    set_octal(h.size, sizeof(h.size), size > TAR_MAX_OCTAL_SIZE ? 0 : size);
+    set_octal(h.mtime, sizeof(h.mtime), st->st_mtime < 0 ? 0 : st->st_mtime);
+    h.typeflag = typeflag;
+    if (linkname != NULL)
+        strncpy(h.linkname, linkname, sizeof(h.linkname));
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    if (typeflag == '3' || typeflag == '4') {
+        set_octal(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        set_octal(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += bytes[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    h.chksum[7] = ' ';
+
+    return write_all(fd, &h, sizeof(h));
+}
+
+int tar_write_header(int fd, const char *path, const struct stat *st, const char *linkname) {
+    char typeflag;
+    guint64 size = 0;
+    gchar *name;
+    GString *pax;
+    int ret = 0;
+
+    if (S_ISREG(st->st_mode)) {
+        typeflag = '0';
+        size = st->st_size;
+    } else if (S_ISDIR(st->st_mode)) {
+        typeflag = '5';
+    } else if (S_ISLNK(st->st_mode)) {
+        typeflag = '2';
+    } else if (S_ISCHR(st->st_mode)) {
+        typeflag = '3';
+    } else if (S_ISBLK(st->st_mode)) {
+        typeflag = '4';
+    } else if (S_ISFIFO(st->st_mode)) {
+        typeflag = '6';
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    name = S_ISDIR(st->st_mode) ? g_strconcat(path, "/", NULL) : g_strdup(path);
+
+    pax = g_string_new(NULL);
+    if (strlen(name) > sizeof(((struct tar_header *) 0)->name))
+        pax_add(pax, "path", name);
+    if (linkname != NULL && strlen(linkname) > sizeof(((struct tar_header *) 0)->linkname))
+        pax_add(pax, "linkpath", linkname);
+    if (size > TAR_MAX_OCTAL_SIZE) {
+        gchar *value = g_strdup_printf("%" G_GUINT64_FORMAT, size);
+        pax_add(pax, "size", value);
+        g_free(value);
+    }
+    if (pax->len > 0) {
+        struct stat pax_st;
+        memset(&pax_st, 0, sizeof(pax_st));
+        pax_st.st_mode = 0644;
+        pax_st.st_mtime = st->st_mtime;
+        if (write_raw_header(fd, "././@PaxHeader", &pax_st, 'x', NULL, pax->len) != 0
+            || write_all(fd, pax->str, pax->len) != 0
+            || tar_write_padding(fd, pax->len) != 0)
+            ret = -1;
+    }
+    g_string_free(pax, TRUE);
+
+    if (ret == 0)
+        ret = write_raw_header(fd, name, st, typeflag, linkname, size);
+    g_free(name);
+    return ret;
+}
+
+/* Write one inode of the image, including the file data, which is read
+ * from fs unless it has been prefetched into data already */
+static int tar_write_inode(int fd, sqfs *fs, sqfs_inode *inode, const char *path, const char *data) {
+    struct stat st;
+    sqfs_id_t id;
+    int ret = 0;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = inode->base.mode;
+    st.st_mtime = inode->base.mtime;
+    if (sqfs_id_get(fs, inode->base.uid, &id) == SQFS_OK)
+        st.st_uid = id;
+    if (sqfs_id_get(fs, inode->base.guid, &id) == SQFS_OK)
+        st.st_gid = id;
+
+    if (S_ISREG(st.st_mode)) {
+        char buf[64*1024];
+        sqfs_off_t pos = 0;
+        st.st_size = inode->xtra.reg.file_size;
+        if (tar_write_header(fd, path, &st, NULL) != 0)
+            return -1;
+        if (data != NULL) {
+            if (write_all(fd, data, st.st_size) != 0)
+                return -1;
+            return tar_write_padding(fd, st.st_size);
+        }
+        while (pos < st.st_size) {
+            sqfs_off_t n = sizeof(buf);
+            if (n > st.st_size - pos)
+                n = st.st_size - pos;
+            if (sqfs_read_range(fs, inode, pos, &n, buf) != SQFS_OK || n == 0) {
+                fprintf(stderr, "Could not read %s from the image\n", path);
+                return -1;
+            }
+            if (write_all(fd, buf, n) != 0)
+                return -1;
+            pos += n;
+        }
+        return tar_write_padding(fd, st.st_size);
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        size_t size = inode->xtra.symlink_size + 1;
+        char *target = g_malloc(size);
+        if (sqfs_readlink(fs, inode, target, &size) != SQFS_OK) {
+            fprintf(stderr, "Could not read the symlink %s from the image\n", path);
+            ret = -1;
+        } else {
+            ret = tar_write_header(fd, path, &st, target);
+        }
+        g_free(target);
+        return ret;
+    }
+
+    if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode))
+        st.st_rdev = makedev(inode->xtra.dev.major, inode->xtra.dev.minor);
+
+    if (S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Skipping socket %s, tar cannot represent it\n", path);
+        return 0;
+    }
+    return tar_write_header(fd, path, &st, NULL);
+}
+
+/* Record the paths below overlay, relative to it, parents before children */
+static void collect_overlay(const gchar *overlay, const gchar *relpath, GPtrArray *paths, GHashTable *types) {
+    gchar *dirpath = g_build_filename(overlay, relpath, NULL);
+    GDir *dir = g_dir_open(dirpath, 0, NULL);
+    const gchar *entry;
+
+    g_free(dirpath);
+    if (dir == NULL)
+        return;
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        gchar *child = *relpath ? g_build_filename(relpath, entry, NULL) : g_strdup(entry);
+        gchar *full = g_build_filename(overlay, child, NULL);
+        gboolean is_dir = g_file_test(full, G_FILE_TEST_IS_DIR) && !g_file_test(full, G_FILE_TEST_IS_SYMLINK);
+        g_ptr_array_add(paths, child);
+        g_hash_table_insert(types, child, is_dir ? OVERLAY_DIR : OVERLAY_FILE);
+        if (is_dir)
+            collect_overlay(overlay, child, paths, types);
+        g_free(full);
+    }
+    g_dir_close(dir);
+}
+
+/* Write one entry of the overlay directory, including the file data */
+static int tar_write_file(int fd, const gchar *overlay, const gchar *relpath) {
+    gchar *full = g_build_filename(overlay, relpath, NULL);
+    struct stat st;
+    int ret = 0;
+
+    if (lstat(full, &st) != 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", full, strerror(errno));
+        g_free(full);
+        return -1;
+    }
+    /* Like everything else in the image */
+    st.st_uid = 0;
+    st.st_gid = 0;
+
+    if (S_ISREG(st.st_mode)) {
+        char buf[64*1024];
+        off_t done = 0;
+        int in = open(full, O_RDONLY);
+        if (in < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", full, strerror(errno));
+            ret = -1;
+        } else if ((ret = tar_write_header(fd, relpath, &st, NULL)) == 0) {
+            while (done < st.st_size) {
+                size_t want = sizeof(buf);
+                ssize_t n;
+                if ((off_t) want > st.st_size - done)
+                    want = st.st_size - done;
+                n = read(in, buf, want);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    fprintf(stderr, "%s changed while it was being read\n", full);
+                    ret = -1;
+                    break;
+                }
+                if ((ret = write_all(fd, buf, n)) != 0)
+                    break;
+                done += n;
+            }
+            if (ret == 0)
+                ret = tar_write_padding(fd, st.st_size);
+        }
+        if (in >= 0)
+            close(in);
+    } else if (S_ISLNK(st.st_mode)) {
+        gchar *target = g_file_read_link(full, NULL);
+        if (target == NULL) {
+            fprintf(stderr, "Could not read the symlink %s\n", full);
+            ret = -1;
+        } else {
+            ret = tar_write_header(fd, relpath, &st, target);
+        }
+        g_free(target);
+    } else if (S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Skipping socket %s, tar cannot represent it\n", full);
+    } else {
+        ret = tar_write_header(fd, relpath, &st, NULL);
+    }
+    g_free(full);
+    return ret;
+}
+
+/* An entry of the image that goes into the tar archive */
+struct image_entry {
+    gchar *path;
+    sqfs_inode inode;
+    char *data;         /* Prefetched file contents, if any */
+    gboolean ready;
+};
+
+/* State shared between the prefetch threads and the writer */
+struct prefetch {
+    const char *image;
+    unsigned long offset;
+    GPtrArray *entries;
+    guint next;         /* Next entry to consider for prefetching */
+    guint written;      /* Entries before this one have been written */
+    guint64 in_flight;  /* Bytes prefetched but not written yet */
+    gboolean stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static gboolean wants_prefetch(struct image_entry *e) {
+    return S_ISREG(e->inode.base.mode) && e->inode.xtra.reg.file_size > 0
+        && e->inode.xtra.reg.file_size <= PREFETCH_MAX_FILE;
+}
+
+static char *read_file(sqfs *fs, sqfs_inode *inode) {
+    sqfs_off_t size = inode->xtra.reg.file_size;
+    sqfs_off_t pos = 0;
+    char *data = g_malloc(size);
+    while (pos < size) {
+        sqfs_off_t n = size - pos;
+        if (sqfs_read_range(fs, inode, pos, &n, data + pos) != SQFS_OK || n == 0) {
+            g_free(data);
+            return NULL;
+        }
+        pos += n;
+    }
+    return data;
+}
+
+/* Decompress the entries ahead of the writer, in order, using a squashfs
+ * handle of our own. If reading fails, the writer tries again itself. */
+static void *prefetch_worker(void *arg) {
+    struct prefetch *pf = arg;
+    sqfs fs;
+    gboolean opened = sqfs_open_image(&fs, pf->image, pf->offset) == SQFS_OK;
+
+    pthread_mutex_lock(&pf->lock);
+    for (;;) {
+        struct image_entry *e;
+        guint index;
+        guint64 size;
+        char *data = NULL;
+
+        while (pf->next < pf->entries->len && !wants_prefetch(g_ptr_array_index(pf->entries, pf->next)))
+            pf->next++;
+        if (pf->stop || pf->next >= pf->entries->len)
+            break;
+        index = pf->next;
+        e = g_ptr_array_index(pf->entries, index);
+        size = e->inode.xtra.reg.file_size;
+        /* Stay within the budget, unless the writer is waiting for this one */
+        if (index != pf->written && pf->in_flight + size > PREFETCH_BUDGET) {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        pf->next++;
+        pf->in_flight += size;
+        pthread_mutex_unlock(&pf->lock);
+
+        if (opened)
+            data = read_file(&fs, &e->inode);
+
+        pthread_mutex_lock(&pf->lock);
+        e->data = data;
+        e->ready = TRUE;
+        pthread_cond_broadcast(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    if (opened) {
+        sqfs_destroy(&fs);
+        sqfs_fd_close(fs.fd);
+    }
+    return NULL;
+}
+
+static void free_image_entry(gpointer data) {
+    struct image_entry *e = data;
+    g_free(e->path);
+    g_free(e->data);
+    g_free(e);
+}
+
+int tar_from_image(int fd, const char *image, const char *overlay, int threads, gboolean verbose) {
+    sqfs fs;
+    sqfs_traverse trv;
+    sqfs_err err = SQFS_OK;
+    struct prefetch pf;
+    pthread_t *tids = NULL;
+    int started = 0;
+    GPtrArray *entries = g_ptr_array_new_with_free_func(free_image_entry);
+    GPtrArray *overlay_paths = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *overlay_types = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *image_dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    unsigned long offset = appimage_get_payload_offset(image);
+    gchar *pruned = NULL;
+    guint i;
+    int ret = 0;
+
+    if (sqfs_open_image(&fs, image, offset) != SQFS_OK) {
+        fprintf(stderr, "Could not open the squashfs filesystem in %s\n", image);
+        ret = -1;
+        goto out;
+    }
+    if (overlay != NULL)
+        collect_overlay(overlay, "", overlay_paths, overlay_types);
+
+    /* Decide what goes into the archive first, so that the file contents
+     * can be decompressed in parallel afterwards */
+    if (sqfs_traverse_open(&trv, &fs, sqfs_inode_root(&fs)) != SQFS_OK) {
+        fprintf(stderr, "sqfs_traverse_open error\n");
+        ret = -1;
+        goto close;
+    }
+    while (sqfs_traverse_next(&trv, &err)) {
+        struct image_entry *e;
+        sqfs_inode inode;
+        gpointer replacement;
+
+        if (trv.dir_end)
+            continue;
+        /* Below a directory that the overlay replaced with a file */
+        if (pruned != NULL && g_str_has_prefix(trv.path, pruned) && trv.path[strlen(pruned)] == '/')
+            continue;
+        if (sqfs_inode_get(&fs, &inode, trv.entry.inode) != SQFS_OK) {
+            fprintf(stderr, "Could not read the inode of %s\n", trv.path);
+            ret = -1;
+            break;
+        }
+        replacement = g_hash_table_lookup(overlay_types, trv.path);
+        if (S_ISDIR(inode.base.mode) && replacement != OVERLAY_FILE) {
+            /* Directories in both are merged */
+            g_hash_table_insert(image_dirs, g_strdup(trv.path), GINT_TO_POINTER(1));
+        } else if (replacement != NULL) {
+            if (verbose)
+                fprintf(stderr, "Replacing %s\n", trv.path);
+            if (S_ISDIR(inode.base.mode)) {
+                g_free(pruned);
+                pruned = g_strdup(trv.path);
+            }
+            continue;
+        }
+        e = g_new0(struct image_entry, 1);
+        e->path = g_strdup(trv.path);
+        e->inode = inode;
+        e->ready = threads < 1 || !wants_prefetch(e);
+        g_ptr_array_add(entries, e);
+    }
+    if (err != SQFS_OK) {
+        fprintf(stderr, "sqfs_traverse_next error\n");
+        ret = -1;
+    }
+    sqfs_traverse_close(&trv);
+    if (ret != 0)
+        goto close;
+
+    pf.image = image;
+    pf.offset = offset;
+    pf.entries = entries;
+    pf.next = 0;
+    pf.written = 0;
+    pf.in_flight = 0;
+    pf.stop = FALSE;
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.cond, NULL);
+    if (threads > 0) {
+        tids = g_new(pthread_t, threads);
+        for (started = 0; started < threads; started++)
+            if (pthread_create(&tids[started], NULL, prefetch_worker, &pf) != 0)
+                break;
+    }
+    /* Without any prefetch thread, the writer reads everything itself */
+    if (started == 0)
+        for (i = 0; i < entries->len; i++)
+            ((struct image_entry *) g_ptr_array_index(entries, i))->ready = TRUE;
+
+    for (i = 0; ret == 0 && i < entries->len; i++) {
+        struct image_entry *e = g_ptr_array_index(entries, i);
+        pthread_mutex_lock(&pf.lock);
+        while (!e->ready)
+            pthread_cond_wait(&pf.cond, &pf.lock);
+        pthread_mutex_unlock(&pf.lock);
+
+        ret = tar_write_inode(fd, &fs, &e->inode, e->path, e->data);
+
+        pthread_mutex_lock(&pf.lock);
+        if (started > 0 && wants_prefetch(e))
+            pf.in_flight -= e->inode.xtra.reg.file_size;
+        g_free(e->data);
+        e->data = NULL;
+        pf.written = i + 1;
+        pthread_cond_broadcast(&pf.cond);
+        pthread_mutex_unlock(&pf.lock);
+    }
+
+    pthread_mutex_lock(&pf.lock);
+    pf.stop = TRUE;
+    pthread_cond_broadcast(&pf.cond);
+    pthread_mutex_unlock(&pf.lock);
+    for (i = 0; i < (guint) started; i++)
+        pthread_join(tids[i], NULL);
+    g_free(tids);
+    pthread_cond_destroy(&pf.cond);
+    pthread_mutex_destroy(&pf.lock);
+
+    for (i = 0; ret == 0 && i < overlay_paths->len; i++) {
+        const gchar *relpath = g_ptr_array_index(overlay_paths, i);
+        if (g_hash_table_lookup(overlay_types, relpath) == OVERLAY_DIR
+            && g_hash_table_lookup(image_dirs, relpath) != NULL)
+            continue;
+        if (verbose)
+            fprintf(stderr, "Adding %s\n", relpath);
+        ret = tar_write_file(fd, overlay, relpath);
+    }
+
+close:
+    sqfs_fd_close(fs.fd);
+out:
+    g_free(pruned);
+    g_hash_table_destroy(image_dirs);
+    g_hash_table_destroy(overlay_types);
+    g_ptr_array_free(overlay_paths, TRUE);
+    g_ptr_array_free(entries, TRUE);
+    return ret;
+}
+
+/* Paths in the files that mksquashfs takes with -sort and -ef are either
+ * relative to the source directory or absolute */
+static const gchar *relative_to(const gchar *dir, const gchar *path) {
+    size_t len = strlen(dir);
+    if (strncmp(path, dir, len) == 0 && path[len] == '/')
+        return path + len + 1;
+    return path;
+}
+
+/* Priorities of the files listed in a mksquashfs sort file */
+static GHashTable *read_sort_file(const gchar *dir, const gchar *sort_file) {
+    GHashTable *priorities = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gchar *contents = NULL;
+    gchar **lines;
+    guint i;
+
+    if (sort_file == NULL || !g_file_get_contents(sort_file, &contents, NULL, NULL))
+        return priorities;
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *space = strrchr(lines[i], ' ');
+        if (space == NULL)
+            continue;
+        *space = '\0';
+        g_hash_table_insert(priorities, g_strdup(relative_to(dir, lines[i])), GINT_TO_POINTER(atoi(space + 1)));
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return priorities;
+}
+
+static GHashTable *read_exclude_file(const gchar *dir, const gchar *exclude_file) {
+    GHashTable *excluded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gchar *contents = NULL;
+    gchar **lines;
+    guint i;
+
+    if (exclude_file == NULL || !g_file_get_contents(exclude_file, &contents, NULL, NULL))
+        return excluded;
+    lines = g_strsplit(contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++)
+        if (*lines[i] != '\0') {
+            gchar *path = g_strdup(relative_to(dir, lines[i]));
+            g_hash_table_insert(excluded, path, path);
+        }
+    g_strfreev(lines);
+    g_free(contents);
+    return excluded;
+}
+
+/* Whether relpath or one of the directories above it is excluded */
+static gboolean is_excluded(GHashTable *excluded, const gchar *relpath) {
+    gchar *path = g_strdup(relpath);
+    gchar *slash;
+    gboolean found = g_hash_table_lookup(excluded, path) != NULL;
+    while (!found && (slash = strrchr(path, '/')) != NULL) {
+        *slash = '\0';
+        found = g_hash_table_lookup(excluded, path) != NULL;
+    }
+    g_free(path);
+    return found;
+}
+
+struct dir_entry {
+    const gchar *path;
+    gboolean is_file;
+    gint priority;
+    guint index;
+};
+
+/* Directories and links first, in the order they were found; then regular
+ * files by descending priority, which is the order mksquashfs gives them */
+static gint compare_dir_entries(gconstpointer a, gconstpointer b) {
+    const struct dir_entry *ea = a;
+    const struct dir_entry *eb = b;
+    if (ea->is_file != eb->is_file)
+        return ea->is_file ? 1 : -1;
+    if (ea->priority != eb->priority)
+        return ea->priority > eb->priority ? -1 : 1;
+    return ea->index < eb->index ? -1 : (ea->index > eb->index);
+}
+
+int tar_from_directory(int fd, const char *dir, const char *sort_file, const char *exclude_file, gboolean verbose) {
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *types = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *priorities = read_sort_file(dir, sort_file);
+    GHashTable *excluded = read_exclude_file(dir, exclude_file);
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct dir_entry));
+    guint i;
+    int ret = 0;
+
+    collect_overlay(dir, "", paths, types);
+    for (i = 0; i < paths->len; i++) {
+        struct dir_entry e;
+        gchar *full;
+        e.path = g_ptr_array_index(paths, i);
+        if (g_hash_table_size(excluded) > 0 && is_excluded(excluded, e.path))
+            continue;
+        full = g_build_filename(dir, e.path, NULL);
+        e.is_file = g_file_test(full, G_FILE_TEST_IS_REGULAR) && !g_file_test(full, G_FILE_TEST_IS_SYMLINK);
+        e.priority = GPOINTER_TO_INT(g_hash_table_lookup(priorities, e.path));
+        e.index = i;
+        g_array_append_val(entries, e);
+        g_free(full);
+    }
+    g_array_sort(entries, compare_dir_entries);
+    for (i = 0; ret == 0 && i < entries->len; i++) {
+        const gchar *relpath = g_array_index(entries, struct dir_entry, i).path;
+        if (verbose)
+            fprintf(stderr, "Adding %s\n", relpath);
+        ret = tar_write_file(fd, dir, relpath);
+    }
+
+    g_array_free(entries, TRUE);
+    g_hash_table_destroy(excluded);
+    g_hash_table_destroy(priorities);
+    g_hash_table_destroy(types);
+    g_ptr_array_free(paths, TRUE);
+    return ret;
+}
+
+/* Read up to len bytes, returning fewer only at the end of the input */
+static ssize_t read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, p + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* Octal, or GNU base-256 for values that do not fit */
+static guint64 parse_number(const char *field, size_t len) {
+    guint64 value = 0;
+    size_t i;
+    if ((unsigned char) field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    for (i = 0; i < len && (field[i] == ' ' || field[i] == '0'); i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static gboolean header_is_valid(const struct tar_header *h) {
+    const unsigned char *bytes = (const unsigned char *) h;
+    unsigned int sum = 0;
+    size_t i;
+    for (i = 0; i < sizeof(*h); i++)
+        sum += (i >= offsetof(struct tar_header, chksum) && i < offsetof(struct tar_header, typeflag)) ? ' ' : bytes[i];
+    return sum == parse_number(h->chksum, sizeof(h->chksum));
+}
+
+static gboolean is_zero_block(const char *block) {
+    int i;
+    for (i = 0; i < TAR_BLOCK; i++)
+        if (block[i] != 0)
+            return FALSE;
+    return TRUE;
+}
+
+/* Paths relative to the root of the AppDir */
+static gchar *clean_path(const char *path) {
+    size_t len;
+    while (path[0] == '.' && path[1] == '/')
+        path += 2;
+    while (path[0] == '/')
+        path++;
+    len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        len--;
+    return g_strndup(path, len);
+}
+
+/* Pick the records of a pax extended header that we care about */
+static void parse_pax(const char *data, size_t len, gchar **path, gchar **linkname, guint64 *size, gboolean *have_size) {
+    const char *p = data;
+    const char *end = data + len;
+    while (p < end) {
+        char *rest;
+        unsigned long reclen = strtoul(p, &rest, 10);
+        const char *key, *eq, *value;
+        if (reclen == 0 || reclen > (unsigned long) (end - p) || *rest != ' ')
+            break;
+        key = rest + 1;
+        eq = memchr(key, '=', p + reclen - key);
+        if (eq != NULL) {
+            size_t key_len = eq - key;
+            value = eq + 1;
+            /* Without the trailing newline */
+            size_t value_len = p + reclen - 1 - value;
+            if (key_len == 4 && strncmp(key, "path", 4) == 0) {
+                g_free(*path);
+                *path = g_strndup(value, value_len);
+            } else if (key_len == 8 && strncmp(key, "linkpath", 8) == 0) {
+                g_free(*linkname);
+                *linkname = g_strndup(value, value_len);
+            } else if (key_len == 4 && strncmp(key, "size", 4) == 0) {
+                gchar *number = g_strndup(value, value_len);
+                *size = g_ascii_strtoull(number, NULL, 10);
+                *have_size = TRUE;
+                g_free(number);
+            }
+        }
+        p += reclen;
+    }
+}
+
+/* Copy size bytes of entry data plus padding, keeping the first bytes in head */
+static int copy_entry_data(int in, int out, guint64 size, GByteArray *head) {
+    char buf[64*1024];
+    guint64 padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    guint64 keep = MIN(size, TAR_HEAD_SIZE);
+    guint64 done = 0;
+    while (done < padded) {
+        size_t n = MIN(sizeof(buf), padded - done);
+        if (read_all(in, buf, n) != (ssize_t) n || write_all(out, buf, n) != 0)
+            return -1;
+        if (head != NULL && done < keep)
+            g_byte_array_append(head, (guint8 *) buf, MIN(n, keep - done));
+        done += n;
+    }
+    return 0;
+}
+
+int tar_passthrough(int in, int out, void (*fn)(const struct tar_entry *entry, void *data), void *data) {
+    char block[TAR_BLOCK];
+    struct tar_header *h = (struct tar_header *) block;
+    gchar *long_path = NULL;
+    gchar *long_link = NULL;
+    guint64 pax_size = 0;
+    gboolean have_pax_size = FALSE;
+    int ret = 0;
+
+    for (;;) {
+        struct tar_entry e;
+        ssize_t n = read_all(in, block, TAR_BLOCK);
+        guint64 size;
+        char type;
+
+        /* Tolerate archives without an end marker */
+        if (n == 0)
+            break;
+        if (n != TAR_BLOCK) {
+            fprintf(stderr, "The tar archive is truncated\n");
+            ret = -1;
+            break;
+        }
+        if (is_zero_block(block)) {
+            /* The end marker; drain the rest so that the writer does not block */
+            while (read_all(in, block, TAR_BLOCK) > 0)
+                ;
+            break;
+        }
+        if (!header_is_valid(h)) {
+            fprintf(stderr, "The input is not a tar archive or it is corrupt\n");
+            ret = -1;
+            break;
+        }
+        size = parse_number(h->size, sizeof(h->size));
+        type = h->typeflag ? h->typeflag : '0';
+
+        /* Entries that describe the next entry */
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+            guint64 padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+            char *meta;
+            if (size > 1024*1024) {
+                fprintf(stderr, "Oversized extended header in the tar archive\n");
+                ret = -1;
+                break;
+            }
+            meta = g_malloc(padded + 1);
+            if (write_all(out, block, TAR_BLOCK) != 0 || read_all(in, meta, padded) != (ssize_t) padded
+                || write_all(out, meta, padded) != 0) {
+                g_free(meta);
+                ret = -1;
+                break;
+            }
+            meta[size] = '\0';
+            if (type == 'x') {
+                parse_pax(meta, size, &long_path, &long_link, &pax_size, &have_pax_size);
+            } else if (type == 'L') {
+                g_free(long_path);
+                long_path = g_strdup(meta);
+            } else if (type == 'K') {
+                g_free(long_link);
+                long_link = g_strdup(meta);
+            }
+            g_free(meta);
+            continue;
+        }
+
+        if (have_pax_size)
+            size = pax_size;
+        if (long_path != NULL) {
+            e.path = clean_path(long_path);
+        } else {
+            gchar *name;
+            /* Only POSIX ustar has the prefix field, GNU tar uses it otherwise */
+            if (memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0] != '\0')
+                name = g_strdup_printf("%.*s/%.*s", (int) sizeof(h->prefix), h->prefix, (int) sizeof(h->name), h->name);
+            else
+                name = g_strndup(h->name, sizeof(h->name));
+            e.path = clean_path(name);
+            g_free(name);
+        }
+        if (long_link != NULL)
+            e.linkname = g_strdup(long_link);
+        else
+            e.linkname = h->linkname[0] ? g_strndup(h->linkname, sizeof(h->linkname)) : NULL;
+        e.type = type;
+        e.size = size;
+        e.head = (type == '0' || type == '7') ? g_byte_array_new() : NULL;
+
+        /* Links, directories and devices carry no data */
+        if (write_all(out, block, TAR_BLOCK) != 0
+            || copy_entry_data(in, out, strchr("123456", type) ? 0 : size, e.head) != 0) {
+            fprintf(stderr, "Could not copy %s\n", e.path);
+            ret = -1;
+        } else {
+            fn(&e, data);
+        }
+
+        g_free(e.path);
+        g_free(e.linkname);
+        if (e.head != NULL)
+            g_byte_array_free(e.head, TRUE);
+        g_free(long_path);
+        g_free(long_link);
+        long_path = NULL;
+        long_link = NULL;
+        have_pax_size = FALSE;
+        if (ret != 0)
+            break;
+    }
+    g_free(long_path);
+    g_free(long_link);
+    return ret;
+}
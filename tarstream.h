@@ -0,0 +1,60 @@
+#ifndef __TARSTREAM_H__
+#define __TARSTREAM_H__
+
+#include <sys/stat.h>
+#include <glib.h>
+
+/* mksquashfs (4.6 and later) can build an image from a tar archive on
+ * stdin. Streaming a tar archive into it lets us produce images from
+ * something other than a directory on disk without linking against
+ * squashfs-tools. */
+
+/* Write a tar header for path, taking type, permissions, owner, size,
+ * mtime and device numbers from st. linkname is the target of a symlink
+ * and NULL otherwise. Long names and large sizes get a pax header.
+ * Returns 0 on success, -1 on a write error. */
+int tar_write_header(int fd, const char *path, const struct stat *st, const char *linkname);
+
+/* Write len bytes of file data; after the last chunk of a file, call
+ * tar_write_padding() with the total size of the file */
+int tar_write_data(int fd, const void *buf, size_t len);
+int tar_write_padding(int fd, guint64 size);
+
+/* Write the two zero blocks that end a tar archive */
+int tar_write_end(int fd);
+
+/* Write the contents of the squashfs filesystem in the AppImage image to
+ * fd as a tar archive, without the end marker. If overlay is not NULL,
+ * files in the overlay directory are added, replacing entries with the
+ * same path in the image. threads is the number of threads that
+ * decompress files ahead of the writer, each with a squashfs handle of
+ * its own; with 0, all reading happens on the calling thread.
+ * Returns 0 on success, -1 on error. */
+int tar_from_image(int fd, const char *image, const char *overlay, int threads, gboolean verbose);
+
+/* Write the contents of the directory dir to fd as a tar archive, without
+ * the end marker. sort_file and exclude_file, if not NULL, are in the
+ * format of the mksquashfs -sort and -ef options, which do not apply to a
+ * tar archive: excluded files are left out and regular files are written
+ * in the order of their priority instead. Returns 0 on success, -1 on error. */
+int tar_from_directory(int fd, const char *dir, const char *sort_file, const char *exclude_file, gboolean verbose);
+
+/* Bytes of each regular file that tar_passthrough() keeps for inspection */
+#define TAR_HEAD_SIZE (64*1024)
+
+/* An entry of a tar archive passing through tar_passthrough() */
+struct tar_entry {
+    gchar *path;        /* Without leading "./" and trailing "/" */
+    char type;          /* Type flag, '0' for regular files */
+    guint64 size;
+    gchar *linkname;    /* Symlink target, or NULL */
+    GByteArray *head;   /* The first TAR_HEAD_SIZE bytes of a regular file */
+};
+
+/* Copy the tar archive read from in to out, without its end marker, and
+ * call fn for each entry once its contents have passed through. GNU long
+ * names and pax headers are understood. Returns 0 on success, -1 on a
+ * read or write error or a malformed archive. */
+int tar_passthrough(int in, int out, void (*fn)(const struct tar_entry *entry, void *data), void *data);
+
+#endif /* __TARSTREAM_H__ */
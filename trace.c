@@ -0,0 +1,161 @@
+/*
+ * FUSE request trace for --appimage-trace, see trace.h
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockcache.h"
+#include "trace.h"
+
+#define TRACE_LINE_MAX 2048
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+
+/* The request the calling thread is handling */
+static __thread struct trace_op *current;
+
+int __real_fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e);
+int __real_fuse_reply_err(fuse_req_t req, int err);
+int __real_fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
+int __real_fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags);
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_open(const char *path)
+{
+    /* O_APPEND keeps the lines of the workers from overwriting each other */
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd == -1) {
+        perror(path);
+        return -1;
+    }
+    trace_epoch = now_us();
+    return 0;
+}
+
+void trace_begin(struct trace_op *t, const char *op, uint64_t ino)
+{
+    memset(t, 0, sizeof(*t));
+    if (trace_fd == -1)
+        return;
+    t->op = op;
+    t->ino = ino;
+    t->start = now_us();
+    blockcache_thread_counts(&t->hits, &t->misses);
+    current = t;
+}
+
+/* Append s to the line as a JSON string */
+static size_t append_string(char *line, size_t len, const char *s)
+{
+    if (len < TRACE_LINE_MAX)
+        line[len++] = '"';
+    for (; *s != '\0' && len < TRACE_LINE_MAX - 8; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            len += snprintf(line + len, TRACE_LINE_MAX - len, "\\%c", c);
+        else if (c < 0x20)
+            len += snprintf(line + len, TRACE_LINE_MAX - len, "\\u%04x", c);
+        else
+            line[len++] = c;
+    }
+    if (len < TRACE_LINE_MAX)
+        line[len++] = '"';
+    return len;
+}
+
+void trace_end(struct trace_op *t)
+{
+    char line[TRACE_LINE_MAX];
+    uint64_t end, hits, misses;
+    size_t len;
+
+    if (t->op == NULL)
+        return;
+    current = NULL;
+    end = now_us();
+
+    len = snprintf(line, sizeof(line), "{\"ts\":%llu,\"op\":\"%s\"",
+                   (unsigned long long) (t->start - trace_epoch), t->op);
+    if (t->name != NULL) {
+        len += snprintf(line + len, sizeof(line) - len, ",\"parent\":%llu,\"name\":",
+                        (unsigned long long) t->parent);
+        len = append_string(line, len, t->name);
+        if (t->err == 0)
+            len += snprintf(line + len, sizeof(line) - len, ",\"ino\":%llu",
+                            (unsigned long long) t->entry);
+    } else {
+        len += snprintf(line + len, sizeof(line) - len, ",\"ino\":%llu",
+                        (unsigned long long) t->ino);
+    }
+    if (strcmp(t->op, "read") == 0 || strcmp(t->op, "readdir") == 0) {
+        len += snprintf(line + len, sizeof(line) - len, ",\"off\":%llu,\"size\":%llu",
+                        (unsigned long long) t->off, (unsigned long long) t->size);
+        if (t->err == 0)
+            len += snprintf(line + len, sizeof(line) - len, ",\"bytes\":%llu",
+                            (unsigned long long) t->bytes);
+    }
+    if (t->err != 0)
+        len += snprintf(line + len, sizeof(line) - len, ",\"err\":%d", t->err);
+    len += snprintf(line + len, sizeof(line) - len, ",\"us\":%llu",
+                    (unsigned long long) (end - t->start));
+    if (strcmp(t->op, "read") == 0) {
+        if (t->direct) {
+            len += snprintf(line + len, sizeof(line) - len, ",\"direct\":true");
+        } else {
+            blockcache_thread_counts(&hits, &misses);
+            len += snprintf(line + len, sizeof(line) - len, ",\"hits\":%llu,\"misses\":%llu",
+                            (unsigned long long) (hits - t->hits),
+                            (unsigned long long) (misses - t->misses));
+        }
+    }
+    len += snprintf(line + len, sizeof(line) - len, "}\n");
+    if (len > sizeof(line))
+        len = sizeof(line);
+    /* A trace with gaps is better than a failing request */
+    write(trace_fd, line, len);
+}
+
+int __wrap_fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+    if (current != NULL)
+        current->entry = e->ino;
+    return __real_fuse_reply_entry(req, e);
+}
+
+int __wrap_fuse_reply_err(fuse_req_t req, int err)
+{
+    if (current != NULL)
+        current->err = err;
+    return __real_fuse_reply_err(req, err);
+}
+
+int __wrap_fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+    if (current != NULL)
+        current->bytes = size;
+    return __real_fuse_reply_buf(req, buf, size);
+}
+
+int __wrap_fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+    if (current != NULL) {
+        current->bytes = fuse_buf_size(bufv);
+        current->direct = (bufv->buf[0].flags & FUSE_BUF_IS_FD) != 0;
+    }
+    return __real_fuse_reply_data(req, bufv, flags);
+}
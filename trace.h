@@ -0,0 +1,51 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Recorder of the FUSE requests for --appimage-trace=FILE
+ *
+ * Every lookup, getattr, open, read and readdir that the app makes on the
+ * mounted AppImage is appended to FILE as one line of JSON, for example
+ *
+ *   {"ts":1042,"op":"lookup","parent":1,"name":"usr","ino":2,"us":31}
+ *   {"ts":1210,"op":"read","ino":9,"off":0,"size":4096,"bytes":4096,"us":88,"hits":0,"misses":1}
+ *
+ * ts is the time in microseconds since the trace was opened and us the
+ * time the request took. Failed requests have an "err" with the errno
+ * instead of "bytes". Reads report the hits and misses of the block cache,
+ * or "direct":true when served straight from the image file. Following the
+ * lookups from inode 1, the root, gives the path of every inode, so that
+ * appimagetool --hot and --startup-profile take a trace in place of a list
+ * of files.
+ *
+ * The runtime is linked with -Wl,--wrap for fuse_reply_entry,
+ * fuse_reply_err, fuse_reply_buf and fuse_reply_data, so that the result
+ * of a request is recorded whichever code replies to it. */
+
+struct trace_op {
+    const char *op;             /* NULL while not tracing */
+    uint64_t ino;
+    uint64_t parent;            /* Lookups only */
+    const char *name;
+    uint64_t off;               /* Reads and readdirs only */
+    uint64_t size;
+    uint64_t start;
+    uint64_t hits, misses;
+    int err;                    /* From the reply */
+    int direct;
+    uint64_t bytes;
+    uint64_t entry;
+};
+
+/* Append the trace to path from now on. Returns -1 if it cannot be
+ * opened. */
+int trace_open(const char *path);
+
+/* Start recording the request op on ino, handled by the calling thread */
+void trace_begin(struct trace_op *t, const char *op, uint64_t ino);
+
+/* Write the record of t once the request has been replied to */
+void trace_end(struct trace_op *t);
+
+#endif /* __TRACE_H__ */
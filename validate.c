@@ -1,5 +1,5 @@
 /*
-	cc -o validate ../getsection.c ../validate.c -lssl -lcrypto $(pkg-config --cflags glib-2.0) -I/usr/lib/x86_64-linux-gnu/glib-2.0/include
+	cc -o validate ../elf.c ../getsection.c ../aiheader.c ../validate.c -lssl -lcrypto $(pkg-config --cflags glib-2.0) -I/usr/lib/x86_64-linux-gnu/glib-2.0/include
 */
 
 #include <glib.h>
@@ -18,6 +18,7 @@
 #include <sys/mman.h>
 
 #include "getsection.h"
+#include "aiheader.h"
 
 typedef unsigned char byte;      
 
@@ -110,7 +111,7 @@ int main(int argc,char **argv)	{
     unsigned long skip_offset = 0;
     unsigned long skip_length = 0;
   
-    get_elf_section_offset_and_lenghth(filename, ".sha256_sig", &skip_offset, &skip_length);
+    appimage_get_section(filename, ".sha256_sig", &skip_offset, &skip_length);
     if(skip_length > 0) {
         fprintf(stderr, "Skipping ELF section %s with offset %lu, length %lu\n", segment_name, skip_offset, skip_length);
     } else {